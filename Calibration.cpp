@@ -0,0 +1,378 @@
+/*
+Copyright (C) 2010-2013 Jon Herman, Josh Kollat, and others.
+
+Hymod is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Hymod is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with Hymod.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <random>
+
+#include "Calibration.h"
+#include "HyModBatch.h"
+#include "Objectives.h"
+#include "ThreadPool.h"
+
+const int nParams = HYMOD_N_PARAMETERS;
+
+// Size of the complexes and subcomplexes, and evolution steps per complex and loop (Duan et al. 1994)
+const int complexSize = 2*nParams + 1;
+const int subcomplexSize = nParams + 1;
+const int evolutionSteps = 2*nParams + 1;
+
+// Convergence: relative improvement of the best objective over a number of loops, and range of the population
+const int stallLoops = 5;
+const double stallImprovement = 0.001;
+const double parameterConvergence = 0.001;
+
+struct sce_point
+{
+    double x[nParams];
+    double loss;            //Value minimised: the sum of squared errors, or a loss derived from the objective
+};
+
+// The model and objective being calibrated
+struct calibration_problem
+{
+    const HyMod *model;
+    objective_config objectives;
+    bool sseLoss;           //The objective is nse or rmse, both ordered like the sum of squared errors
+    const hymod_parameter_range *ranges;
+};
+
+// Count of model runs, and of those stopped early, during part of the search
+struct calibration_counts
+{
+    long evaluations;
+    long stopped;
+};
+
+// Loss minimised for an objective: 0 is a perfect fit
+static double metric_loss(int metric, double value)
+{
+    double loss;
+    switch (metric)
+    {
+        case METRIC_NSE:
+        case METRIC_KGE:
+        case METRIC_LOGNSE: loss = 1.0 - value; break;
+        case METRIC_RMSE:   loss = value; break;
+        default:            loss = fabs(value); break;
+    }
+    return (loss == loss) ? loss : INFINITY;
+}
+
+// Evaluate up to HYMOD_LANES candidates. With the sum of squared errors as the loss and limits given,
+// a candidate is abandoned once its running sum exceeds its limit (its loss is then infinite), and the
+// run ends when every candidate has been abandoned.
+static void evaluate_candidates(const calibration_problem &problem, double **sets, int nSets, const double *limits,
+                                double *loss, calibration_counts *counts)
+{
+    const HyMod *model = problem.model;
+    const hymod_forcing *forcing = model->forcing;
+    counts->evaluations += nSets;
+
+    if (!problem.sseLoss)
+    {
+        double values[HYMOD_LANES];
+        evaluate_objectives(model, problem.objectives, sets, nSets, values);
+        for (int s = 0; s < nSets; s++) loss[s] = metric_loss(problem.objectives.metrics[0], values[s]);
+        return;
+    }
+
+    hymod_batch b;
+    double Q[HYMOD_LANES], sse[HYMOD_LANES];
+    const double *obs = &forcing->data.flow[forcing->startingIndex];
+    int warmup = problem.objectives.warmup;
+    int modelDay;
+
+    init_hymod_batch(&b, model, sets, nSets);
+    for (int s = 0; s < nSets; s++) sse[s] = 0.0;
+
+    for (modelDay = 0; modelDay < forcing->nDays; modelDay++)
+    {
+        int dataDay = forcing->startingIndex + modelDay;
+        hymod_batch_step(&b, model->parameters.Nq, model->parameters.Kv, forcing->data.precip[dataDay],
+                         forcing->data.avgTemp[dataDay], forcing->PE[modelDay], Q);
+
+        // Days with missing observations (negative flows) are skipped, as in the objectives
+        if (modelDay < warmup || obs[modelDay] < 0.0) continue;
+
+        int running = nSets;
+        for (int s = 0; s < nSets; s++)
+        {
+            sse[s] += (Q[s] - obs[modelDay])*(Q[s] - obs[modelDay]);
+            if (limits != NULL && sse[s] > limits[s]) running--;
+        }
+        if (running == 0) break;
+    }
+    HYMOD_LAPS_FLUSH(b.laps);
+    HYMOD_COUNT(COUNT_EVALUATIONS, nSets);
+    HYMOD_COUNT(COUNT_DAYS, (long) nSets*min(modelDay + 1, forcing->nDays));
+
+    for (int s = 0; s < nSets; s++)
+    {
+        bool abandoned = (limits != NULL && sse[s] > limits[s]);
+        if (abandoned) counts->stopped++;
+        loss[s] = (abandoned || sse[s] != sse[s]) ? INFINITY : sse[s];
+    }
+}
+
+static double uniform(mt19937_64 &random)
+{
+    return (random() >> 11) * (1.0/9007199254740992.0);
+}
+
+static bool by_loss(const sce_point &a, const sce_point &b)
+{
+    return a.loss < b.loss;
+}
+
+// Evaluate one candidate of each of n complexes together, one per lane, with the limits if given
+static void evaluate_points(const calibration_problem &problem, sce_point **points, int n, const double *limits, calibration_counts *counts)
+{
+    double *sets[HYMOD_LANES], loss[HYMOD_LANES];
+    for (int c = 0; c < n; c++) sets[c] = points[c]->x;
+    evaluate_candidates(problem, sets, n, limits, loss, counts);
+    for (int c = 0; c < n; c++) points[c]->loss = loss[c];
+}
+
+// Competitive complex evolution of up to HYMOD_LANES complexes (each sorted by loss), in place. The
+// complexes are independent and each draws from its own generator, so they are evolved in lockstep
+// with the candidates of every complex evaluated together, and each follows the path it would alone.
+static void evolve_complexes(const calibration_problem &problem, vector<sce_point> **complexes, mt19937_64 **random,
+                             int n, calibration_counts *counts)
+{
+    for (int step = 0; step < evolutionSteps; step++)
+    {
+        sce_point candidates[HYMOD_LANES];
+        sce_point *worst[HYMOD_LANES];
+        double centroid[HYMOD_LANES][nParams], low[HYMOD_LANES][nParams], high[HYMOD_LANES][nParams];
+        double limits[HYMOD_LANES];
+
+        for (int c = 0; c < n; c++)
+        {
+            vector<sce_point> &complex = *complexes[c];
+            int m = complex.size();
+
+            // Choose a subcomplex, favouring the better points (trapezoidal probabilities)
+            int chosen[subcomplexSize];
+            bool taken[complexSize] = {false};
+            for (int i = 0; i < subcomplexSize; i++)
+            {
+                int k;
+                do
+                {
+                    double u = uniform(*random[c]);
+                    k = (int) floor(m + 0.5 - sqrt((m + 0.5)*(m + 0.5) - m*(m + 1)*u));
+                } while (k < 0 || k >= m || taken[k]);
+                taken[k] = true;
+                chosen[i] = k;
+            }
+            sort(chosen, chosen + subcomplexSize);
+            worst[c] = &complex[chosen[subcomplexSize - 1]];
+
+            // Centroid of the subcomplex without its worst point, and the smallest box holding the complex
+            for (int j = 0; j < nParams; j++)
+            {
+                centroid[c][j] = 0.0;
+                for (int i = 0; i < subcomplexSize - 1; i++) centroid[c][j] += complex[chosen[i]].x[j];
+                centroid[c][j] /= subcomplexSize - 1;
+
+                low[c][j] = high[c][j] = complex[0].x[j];
+                for (int i = 1; i < m; i++)
+                {
+                    low[c][j] = min(low[c][j], complex[i].x[j]);
+                    high[c][j] = max(high[c][j], complex[i].x[j]);
+                }
+            }
+
+            // Reflection of the worst point through the centroid, or a random point if that leaves the ranges
+            bool feasible = true;
+            for (int j = 0; j < nParams; j++)
+            {
+                candidates[c].x[j] = 2.0*centroid[c][j] - worst[c]->x[j];
+                if (candidates[c].x[j] < problem.ranges[j].lower || candidates[c].x[j] > problem.ranges[j].upper) feasible = false;
+            }
+            if (!feasible)
+                for (int j = 0; j < nParams; j++) candidates[c].x[j] = low[c][j] + uniform(*random[c])*(high[c][j] - low[c][j]);
+
+            // Candidates only matter if they beat the worst point, so they can be stopped once they cannot
+            limits[c] = worst[c]->loss;
+        }
+
+        sce_point *points[HYMOD_LANES];
+        for (int c = 0; c < n; c++) points[c] = &candidates[c];
+        evaluate_points(problem, points, n, limits, counts);
+
+        // Otherwise contract halfway towards the centroid, and failing that take a random point
+        int nPoints = 0;
+        double pointLimits[HYMOD_LANES];
+        int owners[HYMOD_LANES];
+        for (int c = 0; c < n; c++)
+        {
+            if (candidates[c].loss < worst[c]->loss) continue;
+            for (int j = 0; j < nParams; j++) candidates[c].x[j] = 0.5*(centroid[c][j] + worst[c]->x[j]);
+            pointLimits[nPoints] = limits[c];
+            owners[nPoints] = c;
+            points[nPoints++] = &candidates[c];
+        }
+        if (nPoints > 0) evaluate_points(problem, points, nPoints, pointLimits, counts);
+
+        int nRandom = 0;
+        for (int i = 0; i < nPoints; i++)
+        {
+            int c = owners[i];
+            if (candidates[c].loss < worst[c]->loss) continue;
+            for (int j = 0; j < nParams; j++) candidates[c].x[j] = low[c][j] + uniform(*random[c])*(high[c][j] - low[c][j]);
+            points[nRandom++] = &candidates[c];
+        }
+        if (nRandom > 0) evaluate_points(problem, points, nRandom, NULL, counts);
+
+        for (int c = 0; c < n; c++)
+        {
+            *worst[c] = candidates[c];
+            stable_sort(complexes[c]->begin(), complexes[c]->end(), by_loss);
+        }
+    }
+}
+
+// Normalised geometric mean of the parameter ranges spanned by the population
+static double population_spread(const vector<sce_point> &population, const hymod_parameter_range *ranges)
+{
+    double sum = 0.0;
+    int n = 0;
+
+    for (int j = 0; j < nParams; j++)
+    {
+        double width = ranges[j].upper - ranges[j].lower;
+        if (width <= 0.0) continue;
+
+        double low = population[0].x[j], high = low;
+        for (size_t i = 1; i < population.size(); i++)
+        {
+            low = min(low, population[i].x[j]);
+            high = max(high, population[i].x[j]);
+        }
+        sum += log(max((high - low)/width, 1e-300));
+        n++;
+    }
+    return (n > 0) ? exp(sum/n) : 0.0;
+}
+
+void run_sce_calibration(const calibration_config &config, const HyMod *model, ostream &out)
+{
+    calibration_problem problem;
+    problem.model = model;
+    problem.ranges = config.ranges;
+    init_objectives(&problem.objectives, model->forcing, config.metric, config.warmup);
+    if (problem.objectives.metrics.size() != 1)
+    {
+        cout << "Calibration needs a single objective (got \"" << config.metric << "\")" << endl;
+        exit(1);
+    }
+    int metric = problem.objectives.metrics[0];
+    problem.sseLoss = (metric == METRIC_NSE || metric == METRIC_RMSE);
+
+    int nComplexes = max(config.nComplexes, 1);
+    int populationSize = nComplexes*complexSize;
+    ThreadPool pool(config.nThreads);
+    mt19937_64 random(config.seed);
+    calibration_counts total = {0, 0};
+
+    // Initial population, sampled uniformly and evaluated in batches
+    vector<sce_point> population(populationSize);
+    for (int i = 0; i < populationSize; i++)
+        for (int j = 0; j < nParams; j++)
+            population[i].x[j] = config.ranges[j].lower + uniform(random)*(config.ranges[j].upper - config.ranges[j].lower);
+
+    int nBatches = (populationSize + HYMOD_LANES - 1)/HYMOD_LANES;
+    vector<calibration_counts> batchCounts(nBatches, calibration_counts{0, 0});
+    pool.run(nBatches, [&](int batch, int) {
+        int first = batch*HYMOD_LANES;
+        int n = min(HYMOD_LANES, populationSize - first);
+        double *sets[HYMOD_LANES], loss[HYMOD_LANES];
+
+        for (int s = 0; s < n; s++) sets[s] = population[first + s].x;
+        evaluate_candidates(problem, sets, n, NULL, loss, &batchCounts[batch]);
+        for (int s = 0; s < n; s++) population[first + s].loss = loss[s];
+    });
+    for (int b = 0; b < nBatches; b++) total.evaluations += batchCounts[b].evaluations;
+    stable_sort(population.begin(), population.end(), by_loss);
+
+    out << "loop\tevaluations\tstopped\t" << metric_names[metric];
+    for (int j = 0; j < nParams; j++) out << "\t" << config.ranges[j].name;
+    out << "\n";
+
+    vector<double> bestHistory;
+    vector< vector<sce_point> > complexes(nComplexes, vector<sce_point>(complexSize));
+    vector<calibration_counts> complexCounts(nComplexes);
+    vector<mt19937_64> generators(nComplexes);
+
+    for (int loop = 0; ; loop++)
+    {
+        // Report the best point so far with its objective
+        double *best[1] = {population[0].x};
+        double value;
+        evaluate_objectives(model, problem.objectives, best, 1, &value);
+        total.evaluations++;
+        out << loop << "\t" << total.evaluations << "\t" << total.stopped << "\t" << value;
+        for (int j = 0; j < nParams; j++) out << "\t" << population[0].x[j];
+        out << "\n";
+        out.flush();
+        HYMOD_INSTRUMENT_POLL();
+
+        bestHistory.push_back(population[0].loss);
+        if (total.evaluations >= config.maxEvaluations) break;
+        if (population_spread(population, config.ranges) < parameterConvergence) break;
+        if ((int) bestHistory.size() > stallLoops)
+        {
+            double before = bestHistory[bestHistory.size() - 1 - stallLoops];
+            double now = bestHistory.back();
+            if (before - now <= stallImprovement*fabs(before)) break;
+        }
+
+        // Deal the sorted population into the complexes (point i goes to complex i mod p), each with
+        // its own generator seeded in order, so the search does not depend on the number of threads
+        for (int k = 0; k < nComplexes; k++)
+        {
+            for (int i = 0; i < complexSize; i++) complexes[k][i] = population[i*nComplexes + k];
+            generators[k].seed(random());
+            complexCounts[k].evaluations = complexCounts[k].stopped = 0;
+        }
+
+        // HYMOD_LANES complexes per task, their candidates evaluated together
+        int nGroups = (nComplexes + HYMOD_LANES - 1)/HYMOD_LANES;
+        pool.run(nGroups, [&](int g, int) {
+            vector<sce_point> *group[HYMOD_LANES];
+            mt19937_64 *groupGenerators[HYMOD_LANES];
+            int first = g*HYMOD_LANES;
+            int n = min(HYMOD_LANES, nComplexes - first);
+
+            for (int c = 0; c < n; c++)
+            {
+                group[c] = &complexes[first + c];
+                groupGenerators[c] = &generators[first + c];
+            }
+            evolve_complexes(problem, group, groupGenerators, n, &complexCounts[g]);
+        });
+
+        // Shuffle the complexes back together
+        for (int k = 0; k < nComplexes; k++)
+        {
+            for (int i = 0; i < complexSize; i++) population[i*nComplexes + k] = complexes[k][i];
+            total.evaluations += complexCounts[k].evaluations;
+            total.stopped += complexCounts[k].stopped;
+        }
+        stable_sort(population.begin(), population.end(), by_loss);
+    }
+}
@@ -0,0 +1,46 @@
+/*
+Copyright (C) 2010-2013 Jon Herman, Josh Kollat, and others.
+
+Hymod is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Hymod is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with Hymod.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CALIBRATION_H
+#define CALIBRATION_H
+
+#include "HyMod.h"
+
+// Settings of a calibration run
+struct calibration_config
+{
+    string metric;          //Objective to optimise (see Objectives.h)
+    int warmup;             //Days at the start of the simulation excluded from the objective
+    long maxEvaluations;    //Budget of model runs
+    int nComplexes;         //Complexes of the SCE-UA population, evolved in parallel
+    unsigned long seed;     //Seed of the random number generator
+    int nThreads;
+    hymod_parameter_range ranges[HYMOD_N_PARAMETERS];
+};
+
+// Calibrate the 8 parameters of calc_hymod with the shuffled complex evolution method (SCE-UA,
+// Duan et al. 1992) within the given ranges. The complexes are evolved concurrently on the worker
+// threads, HYMOD_LANES at a time in lockstep so that their candidates share one batched model run,
+// and the initial population is evaluated in batches. When the objective is nse or rmse,
+// candidates that can only replace the worst point of a subcomplex are abandoned as soon as their
+// running sum of squared errors exceeds that point's. The search stops when the budget is spent, when
+// the best objective improves by less than 0.1% over 5 shuffling loops, or when the population has
+// converged in parameter space. One row is written per loop: the evaluations so far, how many were
+// stopped early, the best objective and the best parameters (the last row is the result).
+void run_sce_calibration(const calibration_config &config, const HyMod *model, ostream &out);
+
+#endif
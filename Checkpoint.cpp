@@ -0,0 +1,159 @@
+/*
+Copyright (C) 2010-2013 Jon Herman, Josh Kollat, and others.
+
+Hymod is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Hymod is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with Hymod.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "Checkpoint.h"
+
+#define CHECKPOINT_VERSION 1
+#define CHECKPOINT_BYTE_ORDER 0x01020304
+
+struct checkpoint_header
+{
+    char magic[8];      //"HYMODCKP"
+    int version;
+    int byteOrder;      //CHECKPOINT_BYTE_ORDER as written by the machine that saved the file
+    int date[3];
+    int Nq;
+    long nSets;
+};
+
+static const char checkpoint_magic[8] = {'H','Y','M','O','D','C','K','P'};
+static const int nParams = 8;
+
+void write_hymod_checkpoint(const hymod_checkpoint *checkpoint, string checkpointFile)
+{
+    long nSets = checkpoint->states.size();
+    int Nq = checkpoint->Nq;
+
+    checkpoint_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, checkpoint_magic, sizeof(header.magic));
+    header.version = CHECKPOINT_VERSION;
+    header.byteOrder = CHECKPOINT_BYTE_ORDER;
+    memcpy(header.date, checkpoint->date, sizeof(header.date));
+    header.Nq = Nq;
+    header.nSets = nSets;
+
+    // Write to a temporary file first, so that a run resuming from and saving to the same file
+    // never leaves it half written
+    string tempFile = checkpointFile + ".tmp";
+    ofstream out(tempFile.c_str(), ios_base::out | ios_base::binary);
+    if (!out)
+    {
+        cout << "The checkpoint file specified: " << checkpointFile << " could not be written!" << endl;
+        exit(1);
+    }
+    out.write((const char *) &header, sizeof(header));
+
+    vector<double> record(nParams + 4 + Nq);
+    for (long s = 0; s < nSets; s++)
+    {
+        const hymod_state *state = &checkpoint->states[s];
+        copy(&checkpoint->parameters[s*nParams], &checkpoint->parameters[(s+1)*nParams], record.begin());
+        record[nParams]   = state->snow_store;
+        record[nParams+1] = state->XHuz;
+        record[nParams+2] = state->XCuz;
+        record[nParams+3] = state->Xs;
+        for (int m = 0; m < Nq; m++) record[nParams+4+m] = state->Xq[m];
+        out.write((const char *) record.data(), record.size()*sizeof(double));
+    }
+
+    out.close();
+    if (!out || rename(tempFile.c_str(), checkpointFile.c_str()) != 0)
+    {
+        cout << "The checkpoint file specified: " << checkpointFile << " could not be written!" << endl;
+        exit(1);
+    }
+}
+
+void read_hymod_checkpoint(hymod_checkpoint *checkpoint, string checkpointFile)
+{
+    ifstream in(checkpointFile.c_str(), ios_base::in | ios_base::binary);
+    if (!in)
+    {
+        cout << "The checkpoint file specified: " << checkpointFile << " could not be found!" << endl;
+        exit(1);
+    }
+
+    checkpoint_header header;
+    in.read((char *) &header, sizeof(header));
+    if (!in || memcmp(header.magic, checkpoint_magic, sizeof(header.magic)) != 0 || header.version != CHECKPOINT_VERSION
+        || header.byteOrder != CHECKPOINT_BYTE_ORDER || header.Nq < 1 || header.Nq > HYMOD_MAX_NQ || header.nSets < 0)
+    {
+        cout << "The checkpoint file specified: " << checkpointFile << " is not a hymod checkpoint written on this machine" << endl;
+        exit(1);
+    }
+
+    int Nq = header.Nq;
+    long nSets = header.nSets;
+    memcpy(checkpoint->date, header.date, sizeof(header.date));
+    checkpoint->Nq = Nq;
+    checkpoint->parameters.resize(nSets*nParams);
+    checkpoint->states.resize(nSets);
+
+    vector<double> record(nParams + 4 + Nq);
+    for (long s = 0; s < nSets; s++)
+    {
+        in.read((char *) record.data(), record.size()*sizeof(double));
+        if (!in)
+        {
+            cout << "The checkpoint file specified: " << checkpointFile << " is truncated (" << s << " of " << nSets << " records)" << endl;
+            exit(1);
+        }
+
+        hymod_state *state = &checkpoint->states[s];
+        init_hymod_state(state);
+        copy(record.begin(), record.begin() + nParams, &checkpoint->parameters[s*nParams]);
+        state->snow_store = record[nParams];
+        state->XHuz = record[nParams+1];
+        state->XCuz = record[nParams+2];
+        state->Xs   = record[nParams+3];
+        for (int m = 0; m < Nq; m++) state->Xq[m] = record[nParams+4+m];
+    }
+}
+
+void init_hymod_forcing_resume(hymod_forcing *forcing, string dataFile, const hymod_checkpoint *checkpoint, const int *endDate)
+{
+    readMOPEXData(&forcing->data, dataFile);
+
+    //Checkpoints are taken at the end of a day, i.e. after its last time step
+    const int *date = checkpoint->date;
+    int last = find_date_index(&forcing->data, date);
+    if (last >= 0) last += forcing->data.stepsPerDay - 1;
+    if (last < 0 || last >= forcing->data.nDays)
+    {
+        cout << "The checkpoint date " << date[0] << "-" << date[1] << "-" << date[2] << " is not in the data in " << dataFile << endl;
+        exit(1);
+    }
+
+    int end = forcing->data.nDays - 1;
+    if (endDate != NULL)
+    {
+        end = find_date_index(&forcing->data, endDate);
+        if (end >= 0) end += forcing->data.stepsPerDay - 1;
+        if (end < last || end >= forcing->data.nDays)
+        {
+            cout << "The end date " << endDate[0] << "-" << endDate[1] << "-" << endDate[2] << " is not in the data in "
+                 << dataFile << " after the checkpoint" << endl;
+            exit(1);
+        }
+    }
+
+    set_hymod_window(forcing, dataFile, last + 1, end - last);
+}
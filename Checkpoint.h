@@ -0,0 +1,44 @@
+/*
+Copyright (C) 2010-2013 Jon Herman, Josh Kollat, and others.
+
+Hymod is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Hymod is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with Hymod.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <vector>
+
+#include "HyMod.h"
+
+// Model states at the end of a run for each parameter set, so that a later run over the
+// following days can continue from them instead of repeating the whole simulation.
+struct hymod_checkpoint
+{
+    int date[3];                    //Last day simulated [year, month, day]
+    int Nq;                         //Number of quickflow reservoirs
+    vector<double> parameters;      //The 8 parameters of each set, in the order of calc_hymod
+    vector<hymod_state> states;     //Final states of each set
+};
+
+// The file holds a short header followed by one record per parameter set: its parameters, then
+// snow_store, XHuz, XCuz, Xs and the Nq quickflow states (doubles in the byte order of the machine).
+void write_hymod_checkpoint(const hymod_checkpoint *checkpoint, string checkpointFile);
+void read_hymod_checkpoint(hymod_checkpoint *checkpoint, string checkpointFile);
+
+// Read the forcing data for a run continuing from a checkpoint: from the day after the
+// checkpoint to endDate, or to the end of the data if endDate is NULL
+void init_hymod_forcing_resume(hymod_forcing *forcing, string dataFile, const hymod_checkpoint *checkpoint, const int *endDate);
+
+#endif
@@ -0,0 +1,119 @@
+/*
+Copyright (C) 2010-2013 Jon Herman, Josh Kollat, and others.
+
+Hymod is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Hymod is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with Hymod.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <vector>
+
+#include "Client.h"
+#include "Protocol.h"
+#include "Server.h"
+
+bool hymod_client_connect(hymod_client *client, string socketPath, int basin)
+{
+    client->fd = -1;
+    client->nValues = 0;
+
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(address.sun_path)) return false;
+    strcpy(address.sun_path, socketPath.c_str());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return false;
+    if (connect(fd, (sockaddr *) &address, sizeof(address)) != 0)
+    {
+        close(fd);
+        return false;
+    }
+
+    uint32_t hello = basin, nValues;
+    if (!host_is_little_endian()) swap_bytes(&hello, 1, sizeof(hello));
+    if (!write_fully(fd, &hello, sizeof(hello)) || !read_fully(fd, &nValues, sizeof(nValues)))
+    {
+        close(fd);
+        return false;
+    }
+    if (!host_is_little_endian()) swap_bytes(&nValues, 1, sizeof(nValues));
+    if (nValues == 0)
+    {
+        close(fd);
+        return false;
+    }
+
+    client->fd = fd;
+    client->nValues = nValues;
+    return true;
+}
+
+// Send one request frame and read its response
+static bool evaluate_frame(hymod_client *client, const double *parameters, int nSets, double *results)
+{
+    const int nParams = 8;
+
+    // The whole request goes out in one write
+    vector<char> request(sizeof(uint32_t) + (size_t) nSets*nParams*sizeof(double));
+    uint32_t header = nSets;
+    memcpy(&request[0], &header, sizeof(header));
+    memcpy(&request[sizeof(header)], parameters, (size_t) nSets*nParams*sizeof(double));
+    if (!host_is_little_endian())
+    {
+        swap_bytes(&request[0], 1, sizeof(uint32_t));
+        swap_bytes(&request[sizeof(header)], (size_t) nSets*nParams, sizeof(double));
+    }
+
+    uint32_t response[2];
+    size_t count = (size_t) nSets*client->nValues;
+    if (!write_fully(client->fd, &request[0], request.size()) ||
+        !read_fully(client->fd, response, sizeof(response)))
+        return false;
+    if (!host_is_little_endian()) swap_bytes(response, 2, sizeof(uint32_t));
+    if (response[0] != (uint32_t) nSets || response[1] != (uint32_t) client->nValues ||
+        !read_fully(client->fd, results, count*sizeof(double)))
+        return false;
+    if (!host_is_little_endian()) swap_bytes(results, count, sizeof(double));
+    return true;
+}
+
+bool hymod_client_evaluate(hymod_client *client, const double *parameters, int nSets, double *results)
+{
+    const int nParams = 8;
+    if (client->fd < 0) return false;
+
+    // Batches larger than a frame may hold are sent as several frames, one after the other
+    for (int first = 0; first < nSets; first += SERVER_MAX_FRAME_SETS)
+    {
+        int n = min(SERVER_MAX_FRAME_SETS, nSets - first);
+        if (!evaluate_frame(client, &parameters[(size_t) first*nParams], n, &results[(size_t) first*client->nValues]))
+            return false;
+    }
+    return true;
+}
+
+void hymod_client_close(hymod_client *client)
+{
+    if (client->fd < 0) return;
+
+    // A frame of zero sets ends the session
+    uint32_t end = 0;
+    write_fully(client->fd, &end, sizeof(end));
+    close(client->fd);
+    client->fd = -1;
+}
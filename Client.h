@@ -0,0 +1,44 @@
+/*
+Copyright (C) 2010-2013 Jon Herman, Josh Kollat, and others.
+
+Hymod is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Hymod is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with Hymod.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CLIENT_H
+#define CLIENT_H
+
+#include <string>
+
+using namespace std;
+
+// Client side of a session with a model server (see Server.h), for schedulers and optimisers
+// that would otherwise start a hymod process for each batch of parameter sets
+struct hymod_client
+{
+    int fd;         //Connected socket, -1 if closed
+    int nValues;    //Results per parameter set
+};
+
+// Connect to the server listening on socketPath and open a session on one of its basins.
+// Returns false if the server cannot be reached or has no such basin.
+bool hymod_client_connect(hymod_client *client, string socketPath, int basin);
+
+// Evaluate nSets parameter sets (8 values each, in the order of calc_hymod), writing
+// nSets*client->nValues results in the same order. Batches of more than SERVER_MAX_FRAME_SETS
+// sets are sent as several frames. Returns false if the connection fails.
+bool hymod_client_evaluate(hymod_client *client, const double *parameters, int nSets, double *results);
+
+void hymod_client_close(hymod_client *client);
+
+#endif
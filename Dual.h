@@ -0,0 +1,119 @@
+/*
+Copyright (C) 2010-2013 Jon Herman, Josh Kollat, and others.
+
+Hymod is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Hymod is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with Hymod.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DUAL_H
+#define DUAL_H
+
+#include <math.h>
+
+// Forward-mode automatic differentiation: a value together with its derivatives with respect to
+// N inputs. The model kernels are templates on their number type, instantiated with double for
+// simulation and with dual<N> to carry the derivatives along in the same pass. Branches, min and
+// max compare values only, so at a kink the derivative is that of the branch taken.
+template <int N>
+struct dual
+{
+    double v;       //Value
+    double d[N];    //Derivatives with respect to each input
+
+    dual() {}
+    dual(double value) : v(value) { for (int i = 0; i < N; i++) d[i] = 0.0; }
+
+    // The i-th input, with a unit derivative with respect to itself
+    static dual input(double value, int i)
+    {
+        dual x(value);
+        x.d[i] = 1.0;
+        return x;
+    }
+
+    dual &operator+=(const dual &b) { v += b.v; for (int i = 0; i < N; i++) d[i] += b.d[i]; return *this; }
+    dual &operator-=(const dual &b) { v -= b.v; for (int i = 0; i < N; i++) d[i] -= b.d[i]; return *this; }
+    dual &operator*=(const dual &b) { *this = *this * b; return *this; }
+    dual &operator/=(const dual &b) { *this = *this / b; return *this; }
+};
+
+// Value of a number, whatever its type
+inline double value_of(double x) { return x; }
+template <int N> inline double value_of(const dual<N> &x) { return x.v; }
+
+// Derivative of a function g at x.v, given its value there: g(x) to first order
+template <int N>
+inline dual<N> chain(const dual<N> &x, double value, double slope)
+{
+    dual<N> r;
+    r.v = value;
+    for (int i = 0; i < N; i++) r.d[i] = slope*x.d[i];
+    return r;
+}
+
+template <int N> inline dual<N> operator-(const dual<N> &a) { return chain(a, -a.v, -1.0); }
+
+template <int N> inline dual<N> operator+(const dual<N> &a, const dual<N> &b)
+{
+    dual<N> r;
+    r.v = a.v + b.v;
+    for (int i = 0; i < N; i++) r.d[i] = a.d[i] + b.d[i];
+    return r;
+}
+
+template <int N> inline dual<N> operator-(const dual<N> &a, const dual<N> &b)
+{
+    dual<N> r;
+    r.v = a.v - b.v;
+    for (int i = 0; i < N; i++) r.d[i] = a.d[i] - b.d[i];
+    return r;
+}
+
+template <int N> inline dual<N> operator*(const dual<N> &a, const dual<N> &b)
+{
+    dual<N> r;
+    r.v = a.v*b.v;
+    for (int i = 0; i < N; i++) r.d[i] = a.d[i]*b.v + a.v*b.d[i];
+    return r;
+}
+
+template <int N> inline dual<N> operator/(const dual<N> &a, const dual<N> &b)
+{
+    dual<N> r;
+    r.v = a.v/b.v;
+    for (int i = 0; i < N; i++) r.d[i] = (a.d[i] - r.v*b.d[i])/b.v;
+    return r;
+}
+
+template <int N> inline dual<N> operator+(const dual<N> &a, double b) { dual<N> r = a; r.v += b; return r; }
+template <int N> inline dual<N> operator+(double a, const dual<N> &b) { return b + a; }
+template <int N> inline dual<N> operator-(const dual<N> &a, double b) { dual<N> r = a; r.v -= b; return r; }
+template <int N> inline dual<N> operator-(double a, const dual<N> &b) { return chain(b, a - b.v, -1.0); }
+template <int N> inline dual<N> operator*(const dual<N> &a, double b) { return chain(a, a.v*b, b); }
+template <int N> inline dual<N> operator*(double a, const dual<N> &b) { return chain(b, a*b.v, a); }
+template <int N> inline dual<N> operator/(const dual<N> &a, double b) { return chain(a, a.v/b, 1.0/b); }
+template <int N> inline dual<N> operator/(double a, const dual<N> &b) { double r = a/b.v; return chain(b, r, -r/b.v); }
+
+template <int N> inline bool operator<(const dual<N> &a, const dual<N> &b) { return a.v < b.v; }
+template <int N> inline bool operator>(const dual<N> &a, const dual<N> &b) { return a.v > b.v; }
+template <int N> inline bool operator<(const dual<N> &a, double b) { return a.v < b; }
+template <int N> inline bool operator>(const dual<N> &a, double b) { return a.v > b; }
+template <int N> inline bool operator<(double a, const dual<N> &b) { return a < b.v; }
+template <int N> inline bool operator>(double a, const dual<N> &b) { return a > b.v; }
+
+template <int N> inline dual<N> sqrt(const dual<N> &x) { double r = sqrt(x.v); return chain(x, r, 0.5/r); }
+template <int N> inline dual<N> log(const dual<N> &x) { return chain(x, log(x.v), 1.0/x.v); }
+template <int N> inline dual<N> fabs(const dual<N> &x) { return chain(x, fabs(x.v), (x.v < 0.0) ? -1.0 : 1.0); }
+template <int N> inline dual<N> pow(const dual<N> &x, double e) { return chain(x, pow(x.v, e), e*pow(x.v, e - 1.0)); }
+
+#endif
@@ -0,0 +1,107 @@
+/*
+Copyright (C) 2010-2013 Jon Herman, Josh Kollat, and others.
+
+Hymod is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Hymod is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with Hymod.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "Ensemble.h"
+#include "HyModBatch.h"
+#include "ThreadPool.h"
+
+// Parameter sets whose quantiles are held in memory at a time, per thread
+const int setsPerThread = 16;
+
+vector<double> parse_quantiles(string list)
+{
+    vector<double> quantiles;
+    stringstream items(list);
+    string item;
+
+    while (getline(items, item, ','))
+    {
+        char *end;
+        double q = strtod(item.c_str(), &end);
+        if (item.empty() || *end != '\0' || !(q >= 0.0 && q <= 1.0))
+        {
+            cout << "Invalid quantile: " << item << " (quantiles must be between 0 and 1)" << endl;
+            exit(1);
+        }
+        quantiles.push_back(q);
+    }
+    return quantiles;
+}
+
+// Quantile q of the sorted values x[0..n-1], interpolated linearly between order statistics
+static double sorted_quantile(const double *x, int n, double q)
+{
+    double h = (n - 1)*q;
+    int low = (int) h;
+    if (low >= n - 1) return x[n - 1];
+    return x[low] + (h - low)*(x[low + 1] - x[low]);
+}
+
+void run_ensemble(const ensemble_config &config, const HyMod *model, const vector<double> &parameters, ostream &out)
+{
+    const int nParams = 8;
+    const hymod_forcing *forcing = model->forcing;
+    int nSets = parameters.size() / nParams;
+    int nMembers = forcing->data.nMembers;
+    int nDays = forcing->nDays;
+    int nQuantiles = config.quantiles.size();
+
+    ThreadPool pool(config.nThreads);
+    int setsPerRound = setsPerThread * pool.size();
+    vector<double> results((size_t) setsPerRound * nDays * nQuantiles);
+    vector< vector<double> > sorted(pool.size(), vector<double>(nMembers));
+
+    // Header row
+    out << "sample\tyear\tmonth\tday";
+    for (int k = 0; k < nQuantiles; k++) out << "\tq" << config.quantiles[k];
+    out << "\n";
+
+    for (int first = 0; first < nSets; first += setsPerRound)
+    {
+        int nRound = min(setsPerRound, nSets - first);
+
+        pool.run(nRound, [&](int task, int worker) {
+            double *setResults = &results[(size_t) task * nDays * nQuantiles];
+            double *members = &sorted[worker][0];
+
+            // Only the quantiles of each day are kept, not the members' traces
+            auto summarise = [&](int modelDay, const double *Q) {
+                copy(Q, Q + nMembers, members);
+                sort(members, members + nMembers);
+                for (int k = 0; k < nQuantiles; k++)
+                    setResults[(size_t) modelDay * nQuantiles + k] = sorted_quantile(members, nMembers, config.quantiles[k]);
+            };
+            calc_hymod_ensemble(model, (double *) &parameters[(size_t) (first + task) * nParams], summarise);
+        });
+
+        HYMOD_STAGE_BEGIN(STAGE_OUTPUT);
+        for (int s = 0; s < nRound; s++)
+        {
+            for (int day = 0; day < nDays; day++)
+            {
+                const int *date = forcing->data.date[forcing->startingIndex + day];
+                const double *row = &results[((size_t) s * nDays + day) * nQuantiles];
+                out << first + s << "\t" << date[0] << "\t" << date[1] << "\t" << date[2];
+                for (int k = 0; k < nQuantiles; k++) out << "\t" << row[k];
+                out << "\n";
+            }
+        }
+        out.flush();
+        HYMOD_STAGE_END(STAGE_OUTPUT);
+        HYMOD_INSTRUMENT_POLL();
+    }
+}
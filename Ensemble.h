@@ -0,0 +1,41 @@
+/*
+Copyright (C) 2010-2013 Jon Herman, Josh Kollat, and others.
+
+Hymod is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Hymod is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with Hymod.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef ENSEMBLE_H
+#define ENSEMBLE_H
+
+#include <vector>
+
+#include "HyMod.h"
+
+// Settings of an ensemble run
+struct ensemble_config
+{
+    vector<double> quantiles;   //Quantiles of the members' streamflow written for each day, in [0, 1]
+    int nThreads;
+};
+
+// Quantiles given as a comma-separated list (e.g. "0.05,0.5,0.95")
+vector<double> parse_quantiles(string list);
+
+// Run every parameter set (8 values each, in the order of calc_hymod) over all members of an ensemble
+// forcing (see init_hymod_forcing_ensemble), writing a table with one row per parameter set and day:
+// the sample index, the date, then the quantiles of the members' streamflow on that day. Parameter
+// sets are spread over the threads, each advancing all of the members of its set in lockstep.
+void run_ensemble(const ensemble_config &config, const HyMod *model, const vector<double> &parameters, ostream &out);
+
+#endif
@@ -0,0 +1,128 @@
+/*
+Copyright (C) 2010-2013 Jon Herman, Josh Kollat, and others.
+
+Hymod is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Hymod is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with Hymod.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef FASTMATH_H
+#define FASTMATH_H
+
+#include <stdint.h>
+#include <string.h>
+
+// Branch-free elementary functions written so that loops calling them can be vectorised
+// by the compiler (libm calls cannot be, unless -ffast-math is used).
+
+// exp(x) for |x| < 700, accurate to about 1 ulp. The argument is reduced to
+// x = n*ln(2) + r with |r| <= ln(2)/2, exp(r) comes from its Taylor series (the
+// first omitted term is below 1e-17 relative) and 2^n is added to the exponent bits.
+// The range of x is not checked, since a comparison keeps the loop from being vectorised.
+inline double fast_exp(double x)
+{
+    const double LOG2E  = 1.4426950408889634;
+    const double LN2_HI = 6.93147180369123816490e-01;
+    const double LN2_LO = 1.90821492927058770002e-10;
+    const double SHIFT  = 6755399441055744.0; // 1.5*2^52, rounds to an integer in the low mantissa bits
+
+    double t = x*LOG2E + SHIFT;
+    double n = t - SHIFT;
+    double r = (x - n*LN2_HI) - n*LN2_LO;
+
+    // Taylor series of exp(r) to r^13, summed in a tree (Estrin's scheme) rather than by
+    // Horner's rule, so that a single call has a short chain of dependent operations
+    double r2 = r*r, r4 = r2*r2, r8 = r4*r4;
+    double q0 = 1.0 + r;
+    double q1 = 1.0/2.0 + r*(1.0/6.0);
+    double q2 = 1.0/24.0 + r*(1.0/120.0);
+    double q3 = 1.0/720.0 + r*(1.0/5040.0);
+    double q4 = 1.0/40320.0 + r*(1.0/362880.0);
+    double q5 = 1.0/3628800.0 + r*(1.0/39916800.0);
+    double q6 = 1.0/479001600.0 + r*(1.0/6227020800.0);
+    double p = ((q0 + q1*r2) + (q2 + q3*r2)*r4) + ((q4 + q5*r2) + q6*r4)*r8;
+
+    // The low bits of t hold n, shifting them into the exponent field scales p by 2^n
+    uint64_t tBits, pBits;
+    memcpy(&tBits, &t, sizeof(t));
+    memcpy(&pBits, &p, sizeof(p));
+    pBits += tBits << 52;
+    memcpy(&p, &pBits, sizeof(p));
+    return p;
+}
+
+// log(x) for positive normal x, accurate to about 1 ulp. x is split into m*2^k with
+// sqrt(1/2) <= m < sqrt(2) and log(m) = 2*atanh(s), s = (m-1)/(m+1), is summed as an odd
+// series in s (|s| < 0.172, the first omitted term is below 1e-18 relative).
+inline double fast_log(double x)
+{
+    const double LN2_HI = 6.93147180369123816490e-01;
+    const double LN2_LO = 1.90821492927058770002e-10;
+    const double TWO52  = 4503599627370496.0;
+    const uint64_t SQRT_HALF_BITS = 0x3fe6a09e667f3bcdULL;
+
+    // Offsetting the bits by those of sqrt(1/2) moves the exponent boundary to sqrt(2), so that k
+    // and m come out of integer operations alone. k is placed in the mantissa of 2^52 and converted
+    // by a subtraction, since SSE2/AVX2 have no vector conversion from 64-bit integers.
+    uint64_t bits, kBits, mBits;
+    memcpy(&bits, &x, sizeof(x));
+    bits += 0x3ff0000000000000ULL - SQRT_HALF_BITS;
+    kBits = (bits >> 52) | 0x4330000000000000ULL;
+    mBits = (bits & 0x000fffffffffffffULL) + SQRT_HALF_BITS;
+
+    double k, m;
+    memcpy(&k, &kBits, sizeof(k));
+    memcpy(&m, &mBits, sizeof(m));
+    k -= TWO52 + 1023.0;
+
+    double s = (m - 1.0)/(m + 1.0);
+    double s2 = s*s, s4 = s2*s2, s8 = s4*s4;
+
+    // sum of s2^j/(2j+3) for j = 0..10, in a tree as in fast_exp
+    double b0 = 1.0/3.0 + s2*(1.0/5.0);
+    double b1 = 1.0/7.0 + s2*(1.0/9.0);
+    double b2 = 1.0/11.0 + s2*(1.0/13.0);
+    double b3 = 1.0/15.0 + s2*(1.0/17.0);
+    double b4 = 1.0/19.0 + s2*(1.0/21.0);
+    double p = ((b0 + b1*s4) + (b2 + b3*s4)*s8) + (b4 + s4*(1.0/23.0))*(s8*s8);
+
+    double logm = 2.0*s + 2.0*s*s2*p;
+    return k*LN2_HI + (k*LN2_LO + logm);
+}
+
+// x^e for 0 <= x <= 1 (x zero or normal) and 0 < e <= 3, as exp(e*log(x)). The relative error
+// is at most about (|e*log(x)| + 4) ulp, below 1e-13 unless the result is under 1e-300.
+// Results smaller than exp(-700) are returned as exp(-700), and x = 0 gives 0.
+inline double fast_pow(double x, double e)
+{
+    const uint64_t MINUS_700_BITS = 0xc085e00000000000ULL;
+
+    double y = e*fast_log(x);
+
+    // The clamp and the test for x = 0 compare bits rather than doubles, since floating point
+    // comparisons (which might trap) keep the compiler from vectorising the calling loop.
+    // y <= 0, and negative doubles order like their bits.
+    uint64_t xBits, yBits, rBits;
+    memcpy(&xBits, &x, sizeof(x));
+    memcpy(&yBits, &y, sizeof(y));
+    uint64_t below = (uint64_t) 0 - (uint64_t) (yBits > MINUS_700_BITS);
+    yBits = (yBits & ~below) | (MINUS_700_BITS & below);
+    memcpy(&y, &yBits, sizeof(y));
+
+    double r = fast_exp(y);
+    memcpy(&rBits, &r, sizeof(r));
+    rBits &= (uint64_t) 0 - (uint64_t) (xBits != 0);
+    memcpy(&r, &rBits, sizeof(r));
+    return r;
+}
+
+#endif
@@ -0,0 +1,130 @@
+/*
+Copyright (C) 2010-2013 Jon Herman, Josh Kollat, and others.
+
+Hymod is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Hymod is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with Hymod.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "Gradient.h"
+#include "ThreadPool.h"
+
+template <unsigned Groups>
+static void hymod_gradient_groups(const HyMod *model, const objective_config &config, const double *parameters, double *values, double *gradients)
+{
+    const hymod_forcing *forcing = model->forcing;
+    const double *obs = &forcing->data.flow[forcing->startingIndex];
+    int nObjectives = config.metrics.size();
+
+    hymod_parameters_t<hymod_dual> p;
+    hymod_state_t<hymod_dual> state;
+    hymod_step_fluxes_t<hymod_dual> fluxes;
+    hymod_stage_laps laps;
+    hymod_dual inputs[HYMOD_N_PARAMETERS];
+    objective_accumulator<Groups, hymod_dual> acc;
+    vector<hymod_dual> results(max(nObjectives, 1));
+
+    // The settings of the model are constants, each user specified parameter is an input
+    p.Nq = model->parameters.Nq;
+    p.Kv = model->parameters.Kv;
+    p.stepsPerDay = model->parameters.stepsPerDay;
+    p.pdmKernel = model->parameters.pdmKernel;
+    for (int i = 0; i < HYMOD_N_PARAMETERS; i++) inputs[i] = hymod_dual::input(parameters[i], i);
+    set_hymod_parameters(&p, inputs);
+
+    init_hymod_state(&state);
+    acc.init();
+    HYMOD_LAPS_INIT(laps);
+    HYMOD_COUNT(COUNT_EVALUATIONS, 1);
+    HYMOD_COUNT(COUNT_DAYS, forcing->nDays);
+
+    for (int modelDay = 0; modelDay < forcing->nDays; modelDay++)
+    {
+        int dataDay = forcing->startingIndex + modelDay;
+        hymod_dual Q = hymod_step(&p, &state, forcing->data.precip[dataDay], forcing->data.avgTemp[dataDay],
+                                  forcing->PE[modelDay], &fluxes, &laps);
+        if (modelDay >= config.warmup) acc.add(obs[modelDay], Q, config.logEps);
+    }
+    HYMOD_LAPS_FLUSH(laps);
+
+    finish_objectives(config, acc, &results[0]);
+    for (int m = 0; m < nObjectives; m++)
+    {
+        bool histogram = (config.metrics[m] == METRIC_FMS || config.metrics[m] == METRIC_FHV);
+        values[m] = results[m].v;
+        for (int i = 0; i < HYMOD_N_PARAMETERS; i++)
+            gradients[m*HYMOD_N_PARAMETERS + i] = histogram ? NAN : results[m].d[i];
+    }
+}
+
+// Dispatch to the accumulator specialised for the running sums that are actually needed
+void hymod_gradient(const HyMod *model, const objective_config &config, const double *parameters, double *values, double *gradients)
+{
+    switch (config.groups)
+    {
+        case 0: hymod_gradient_groups<0>(model, config, parameters, values, gradients); break;
+        case 1: hymod_gradient_groups<1>(model, config, parameters, values, gradients); break;
+        case 2: hymod_gradient_groups<2>(model, config, parameters, values, gradients); break;
+        case 3: hymod_gradient_groups<3>(model, config, parameters, values, gradients); break;
+        case 4: hymod_gradient_groups<4>(model, config, parameters, values, gradients); break;
+        case 5: hymod_gradient_groups<5>(model, config, parameters, values, gradients); break;
+        case 6: hymod_gradient_groups<6>(model, config, parameters, values, gradients); break;
+        case 7: hymod_gradient_groups<7>(model, config, parameters, values, gradients); break;
+    }
+}
+
+void run_gradients(const gradient_config &config, const HyMod *model, const vector<double> &parameters, ostream &out)
+{
+    const int nParams = HYMOD_N_PARAMETERS;
+    int nSets = parameters.size() / nParams;
+
+    objective_config objectives;
+    init_objectives(&objectives, model->forcing, config.metricList, config.warmup);
+    int nObjectives = objectives.metrics.size();
+
+    for (int m = 0; m < nObjectives; m++)
+    {
+        if (objectives.metrics[m] == METRIC_FMS || objectives.metrics[m] == METRIC_FHV)
+        {
+            cout << "The gradient of " << metric_names[objectives.metrics[m]] << " cannot be computed (it is read from the flow duration curve histogram)" << endl;
+            exit(1);
+        }
+    }
+
+    vector<double> values((size_t) nSets * nObjectives);
+    vector<double> gradients((size_t) nSets * nObjectives * nParams);
+
+    ThreadPool pool(config.nThreads);
+    pool.run(nSets, [&](int s, int) {
+        hymod_gradient(model, objectives, &parameters[(size_t) s*nParams],
+                       &values[(size_t) s*nObjectives], &gradients[(size_t) s*nObjectives*nParams]);
+    });
+
+    // Header: each objective, then its derivatives named d<objective>/d<parameter>
+    for (int m = 0; m < nObjectives; m++)
+    {
+        const char *name = metric_names[objectives.metrics[m]];
+        out << (m > 0 ? "\t" : "") << name;
+        for (int i = 0; i < nParams; i++) out << "\td" << name << "/d" << hymod_default_ranges[i].name;
+    }
+    out << "\n";
+
+    for (int s = 0; s < nSets; s++)
+    {
+        for (int m = 0; m < nObjectives; m++)
+        {
+            out << (m > 0 ? "\t" : "") << values[(size_t) s*nObjectives + m];
+            for (int i = 0; i < nParams; i++) out << "\t" << gradients[((size_t) s*nObjectives + m)*nParams + i];
+        }
+        out << "\n";
+    }
+}
@@ -0,0 +1,49 @@
+/*
+Copyright (C) 2010-2013 Jon Herman, Josh Kollat, and others.
+
+Hymod is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Hymod is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with Hymod.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef GRADIENT_H
+#define GRADIENT_H
+
+#include "HyMod.h"
+#include "Objectives.h"
+
+// Number type of the kernels when they carry derivatives with respect to the parameters
+typedef dual<HYMOD_N_PARAMETERS> hymod_dual;
+
+// Settings of a gradient run
+struct gradient_config
+{
+    string metricList;      //Objectives to differentiate (see Objectives.h)
+    int warmup;             //Days at the start of the simulation excluded from the objectives
+    int nThreads;
+};
+
+// Run one parameter set (in the order of set_hymod_parameters) with the scalar kernels instantiated
+// for hymod_dual, so that the streamflow of each step and then the objectives carry their derivatives
+// with respect to all 8 parameters in a single pass. values receives config.metrics.size() objectives,
+// gradients HYMOD_N_PARAMETERS derivatives for each of them in turn. Values are the same as those of
+// calc_hymod. Where a branch, min or max switches the derivative is that of the branch taken.
+// The flow duration curve metrics (fms, fhv) are read from a histogram, which the derivatives cannot
+// pass through, so their gradients are NaN.
+void hymod_gradient(const HyMod *model, const objective_config &config, const double *parameters, double *values, double *gradients);
+
+// Evaluate the gradients of every parameter set in parallel, writing a header and then one row per set:
+// each objective followed by its derivatives with respect to Ks, Kq, DDF, Tb, Tth, alpha, B and Huz.
+// The flow duration curve metrics (fms, fhv) are refused, since they have no gradient here.
+void run_gradients(const gradient_config &config, const HyMod *model, const vector<double> &parameters, ostream &out);
+
+#endif
@@ -17,194 +17,629 @@ along with Hymod.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "HyMod.h"
 
-void zero_states_and_fluxes(int ndays)
+// Set the simulation period of forcing data that has already been read
+void set_hymod_window(hymod_forcing *forcing, string dataFile, int startingIndex, int nDays)
 {
-    for (int k=0; k < ndays; k++)
+    if (startingIndex < 0 || nDays < 0 || startingIndex + nDays > forcing->data.nDays)
     {
-        hymod.fluxes.snow[k]  = 0.0;
-        hymod.fluxes.melt[k]  = 0.0;
-        hymod.fluxes.effPrecip[k] = 0.0;
-        hymod.fluxes.AE[k] = 0.0;
-        hymod.fluxes.OV[k] = 0.0;
-        hymod.fluxes.Qq[k] = 0.0;
-        hymod.fluxes.Qs[k] = 0.0;
-        hymod.fluxes.Q[k]  = 0.0;
+        cout << "The simulation period (" << nDays << " days from index " << startingIndex << ") is outside of the "
+             << forcing->data.nDays << " days of data in " << dataFile << endl;
+        exit(1);
+    }
+
+    forcing->nDays = nDays;
+    forcing->startingIndex = startingIndex;
+
+    //The Hamon Potential Evaporation is calculated once for the whole record, the simulation uses a slice of it
+    forcing->PE = hamon_PE_series(&forcing->data) + startingIndex;
+    forcing->memberPE = NULL;
+    if (forcing->data.nMembers > 0)
+        forcing->memberPE = hamon_member_PE_series(&forcing->data) + (size_t) startingIndex*forcing->data.nMembers;
+}
+
+// Read the forcing data and look up the Hamon PE for the simulation period
+void init_hymod_forcing(hymod_forcing *forcing, string dataFile, int startingIndex, int nDays)
+{
+    readMOPEXData(&forcing->data, dataFile);
+    set_hymod_window(forcing, dataFile, startingIndex, nDays);
+    return;
+}
+
+// Same as init_hymod_forcing, with the simulation period given by its first and last dates [year, month, day]
+void init_hymod_forcing_dates(hymod_forcing *forcing, string dataFile, const int *startDate, const int *endDate)
+{
+    readMOPEXData(&forcing->data, dataFile);
+    set_hymod_window_dates(forcing, dataFile, startDate, endDate);
+}
+
+// Read the members of an ensemble forcing (one file each) and set the simulation period by its dates
+void init_hymod_forcing_ensemble(hymod_forcing *forcing, const vector<string> &memberFiles, const int *startDate, const int *endDate)
+{
+    readMOPEXEnsemble(&forcing->data, memberFiles);
+    set_hymod_window_dates(forcing, memberFiles[0], startDate, endDate);
+}
+
+// Set the simulation period of forcing data that has already been read from its first and last dates
+void set_hymod_window_dates(hymod_forcing *forcing, string dataFile, const int *startDate, const int *endDate)
+{
+    //The period runs from the first step of the start date to the last step of the end date
+    int first = find_date_index(&forcing->data, startDate);
+    int last = find_date_index(&forcing->data, endDate);
+    if (last >= 0) last += forcing->data.stepsPerDay - 1;
+    if (first < 0 || last < first || last >= forcing->data.nDays)
+    {
+        cout << "The simulation period " << startDate[0] << "-" << startDate[1] << "-" << startDate[2] << " to "
+             << endDate[0] << "-" << endDate[1] << "-" << endDate[2] << " is not covered by the data in " << dataFile << endl;
+        exit(1);
+    }
+
+    set_hymod_window(forcing, dataFile, first, last - first + 1);
+}
+
+// Order of two [year, month, day] dates: -1, 0 or 1
+int compare_dates(const int *a, const int *b)
+{
+    for (int k = 0; k < 3; k++)
+        if (a[k] != b[k]) return (a[k] < b[k]) ? -1 : 1;
+    return 0;
+}
+
+// Index of the first time step of a [year, month, day] date in the (chronological) data, or -1 if it is not there
+int find_date_index(const MOPEXData *data, const int *date)
+{
+    int low = 0, high = data->nDays;
+
+    while (low < high)
+    {
+        int middle = low + (high - low)/2;
+        if (compare_dates(data->date[middle], date) < 0) low = middle + 1;
+        else high = middle;
+    }
+
+    if (low == data->nDays || compare_dates(data->date[low], date) != 0) return -1;
+    return low;
+}
+
+void delete_hymod_forcing(hymod_forcing *forcing)
+{
+    freeMOPEXData(&forcing->data);
+}
+
+// Exit with an error unless Nq is a supported number of quickflow reservoirs
+void check_hymod_nq(int Nq)
+{
+    if (Nq < 1 || Nq > HYMOD_MAX_NQ)
+    {
+        cout << "The number of quickflow reservoirs must be between 1 and " << HYMOD_MAX_NQ << " (got " << Nq << ")" << endl;
+        exit(1);
+    }
+}
+
+// Set up a model instance that runs over the given (shared) forcing data.
+// The daily state and flux arrays used by calc_hymod are only allocated if storeHistory is set,
+// instances used only with the lean run mode (calc_hymod_lean) do not need them.
+void init_hymod(HyMod *model, const hymod_forcing *forcing, bool storeHistory, int Nq, int pdmKernel)
+{
+    check_hymod_nq(Nq);
+
+    model->forcing = forcing;
+    model->parameters.Nq = Nq; // number of quickflow reservoirs
+    model->parameters.Kv = 1.0; // vegetation parameter
+    model->parameters.stepsPerDay = forcing->data.stepsPerDay;
+    model->parameters.pdmKernel = pdmKernel;
+
+    model->states = hymod_states();
+    model->fluxes = hymod_fluxes();
+    if (storeHistory) hymod_allocate(model);
+    return;
+}
+
+// Assign the values of a parameter set (in the order read from stdin) for a run
+template <class T>
+void set_hymod_parameters(hymod_parameters_t<T> *p, const T *parameters)
+{
+    // Rate constants Ks and Kq should be specified in units of time-1, 0 < Ks < Kq < 1
+    p->Ks    = parameters[0];
+    p->Kq    = parameters[1];
+    p->DDF   = parameters[2];
+    p->Tb    = parameters[3];
+    p->Tth   = parameters[4];
+    p->alpha = parameters[5];
+    p->B     = parameters[6];
+    p->Huz   = parameters[7];
+    p->Cpar = p->Huz / (1.0 + p->B); // max capacity of soil moisture tank
+
+    // The rates are per day, a sub-daily step takes the same fraction of a store over a day
+    // (what remains after each step compounds to 1-K over the day) and melts in proportion to its length
+    if (p->stepsPerDay > 1)
+    {
+        double dt = 1.0/p->stepsPerDay;
+        p->Ks  = 1.0 - pow(1.0 - p->Ks, dt);
+        p->Kq  = 1.0 - pow(1.0 - p->Kq, dt);
+        p->DDF = p->DDF*dt;
+    }
+
+    // The exponents of the soil moisture store are constant over the run
+    p->expC = 1.0 + p->B;
+    p->expH = 1.0/(1.0 + p->B);
+    p->powC = pdm_pow_method(value_of(p->expC), p->pdmKernel);
+    p->powH = pdm_pow_method(value_of(p->expH), p->pdmKernel);
+}
+
+// The ranges documented in hymod_parameters. Huz has no upper limit there, it is sampled up to
+// 500 mm, and from 1 mm since the soil moisture store divides by it.
+const hymod_parameter_range hymod_default_ranges[HYMOD_N_PARAMETERS] =
+{
+    {"Ks",     0.0,   1.0},
+    {"Kq",     0.0,   1.0},
+    {"DDF",    0.0,   2.0},
+    {"Tb",    -5.0,   5.0},
+    {"Tth",   -5.0,   5.0},
+    {"alpha",  0.0,   1.0},
+    {"B",      0.0,   2.0},
+    {"Huz",    1.0, 500.0}
+};
+
+// Start from the default ranges and replace those listed in a file, one "name lower upper" per line
+// (blank lines and lines starting with # are skipped)
+void read_parameter_ranges(string rangeFile, hymod_parameter_range *ranges)
+{
+    for (int i = 0; i < HYMOD_N_PARAMETERS; i++) ranges[i] = hymod_default_ranges[i];
+    if (rangeFile == "") return;
+
+    ifstream in(rangeFile.c_str(), ios_base::in);
+    if (!in)
+    {
+        cout << "The parameter range file specified: " << rangeFile << " could not be found!" << endl;
+        exit(1);
+    }
+
+    string line;
+    while (getline(in, line))
+    {
+        stringstream fields(line);
+        string name;
+        double lower, upper;
+        if (!(fields >> name) || name[0] == '#') continue;
+
+        int i = 0;
+        while (i < HYMOD_N_PARAMETERS && name != ranges[i].name) i++;
+        if (i == HYMOD_N_PARAMETERS || !(fields >> lower >> upper) || !(lower <= upper))
+        {
+            cout << "Invalid parameter range in " << rangeFile << ": " << line << endl;
+            exit(1);
+        }
+        ranges[i].lower = lower;
+        ranges[i].upper = upper;
+    }
+}
+
+// How x^exponent is evaluated by a PDM kernel. The shortcuts are correctly rounded, as is pow()
+// in all but rare cases, so PDM_FAST follows PDM_POW to within an ulp per term.
+int pdm_pow_method(double exponent, int pdmKernel)
+{
+    if (pdmKernel == PDM_POW) return POW_LIBM;
+    if (exponent == 1.0) return POW_ONE;
+    if (exponent == 2.0) return POW_SQUARE;
+    if (exponent == 0.5) return POW_SQRT;
+    return (pdmKernel == PDM_APPROX) ? POW_APPROX : POW_LIBM;
+}
+
+// Kernel named on the command line ("pow", "fast" or "approx")
+int find_pdm_kernel(string name)
+{
+    if (name == "pow") return PDM_POW;
+    if (name == "fast") return PDM_FAST;
+    if (name == "approx") return PDM_APPROX;
+
+    cout << "Unknown soil moisture kernel: " << name << " (use pow, fast or approx)" << endl;
+    exit(1);
+}
 
-        hymod.states.snow_store[k] = 0.0;
-        hymod.states.XHuz[k]      = 0.0;
-        hymod.states.XCuz[k] = 0.0;
-        hymod.states.Xs[k] = 0.0;
-        for (int m=0; m < hymod.parameters.Nq; m++) hymod.states.Xq[k][m] = 0.0;
+//This is the function that gets called to evaluate each parameter set, saving all states and fluxes.
+//The run starts from empty stores, or from the given states (e.g. read from a checkpoint).
+void calc_hymod(HyMod *model, double* parameters, const hymod_state *initial)
+{
+    int nDays = model->forcing->nDays;
+    hymod_state state;
+    hymod_step_fluxes fluxes;
+    hymod_stage_laps laps;
+
+    // assign parameter values for this run
+    set_hymod_parameters(&model->parameters, parameters);
+    HYMOD_LAPS_INIT(laps);
+    HYMOD_COUNT(COUNT_EVALUATIONS, 1);
+    HYMOD_COUNT(COUNT_DAYS, nDays);
+
+    if (initial != NULL) state = *initial;
+    else init_hymod_state(&state);
+
+    //Run Model for Simulation Period
+    int dataDay;
+    for (int modelDay = 0; modelDay < nDays; modelDay++)
+    {
+        //Since used as an index, we need to convert to zero indexing
+        dataDay = model->forcing->startingIndex + modelDay;
+
+        hymod_step(&model->parameters, &state, model->forcing->data.precip[dataDay], model->forcing->data.avgTemp[dataDay],
+                   model->forcing->PE[modelDay], &fluxes, &laps);
+
+        // Save the states at the end of the time step and the fluxes during it
+        model->states.snow_store[modelDay] = state.snow_store;
+        model->states.XHuz[modelDay] = state.XHuz;
+        model->states.XCuz[modelDay] = state.XCuz;
+        model->states.Xs[modelDay]   = state.Xs;
+        for(int m = 0; m < model->parameters.Nq; m++)
+            model->states.Xq[modelDay*model->parameters.Nq + m] = state.Xq[m];
+
+        model->fluxes.snow[modelDay] = fluxes.snow;
+        model->fluxes.melt[modelDay] = fluxes.melt;
+        model->fluxes.effPrecip[modelDay] = fluxes.effPrecip;
+        model->fluxes.AE[modelDay] = fluxes.AE;
+        model->fluxes.OV[modelDay] = fluxes.OV;
+        model->fluxes.Qq[modelDay] = fluxes.Qq;
+        model->fluxes.Qs[modelDay] = fluxes.Qs;
+        model->fluxes.Q[modelDay]  = fluxes.Q;
     }
+    HYMOD_LAPS_FLUSH(laps);
+
     return;
 }
 
-// Allocate time series arrays for states, fluxes, and forcing data
-void hymod_allocate(int ndays)
+// States at the end of the last day run by calc_hymod, to continue the simulation from
+void hymod_final_state(const HyMod *model, hymod_state *state)
 {
-    hymod.states.snow_store     = new double [ndays];
-    hymod.states.XHuz = new double [ndays];
-    hymod.states.XCuz = new double [ndays];
-    hymod.states.Xs   = new double [ndays];
-    hymod.states.Xq   = new double* [ndays];
-    for (int i=0; i < ndays; i++) 
-        hymod.states.Xq[i] = new double[hymod.parameters.Nq];
+    int last = model->forcing->nDays - 1;
+
+    init_hymod_state(state);
+    if (last < 0) return;
 
-    hymod.fluxes.snow           = new double [ndays];
-    hymod.fluxes.melt           = new double [ndays];
-    hymod.fluxes.effPrecip      = new double [ndays];
-    hymod.fluxes.AE             = new double [ndays];
-    hymod.fluxes.OV             = new double [ndays];
-    hymod.fluxes.Qq             = new double [ndays];
-    hymod.fluxes.Qs             = new double [ndays];
-    hymod.fluxes.Q              = new double [ndays];
-    hymod.fluxes.PE = new double [ndays];
+    state->snow_store = model->states.snow_store[last];
+    state->XHuz = model->states.XHuz[last];
+    state->XCuz = model->states.XCuz[last];
+    state->Xs   = model->states.Xs[last];
+    for (int m = 0; m < model->parameters.Nq; m++)
+        state->Xq[m] = model->states.Xq[last*model->parameters.Nq + m];
+}
+
+// Empty all of the stores
+template <class T>
+void init_hymod_state(hymod_state_t<T> *state)
+{
+    state->snow_store = 0.0;
+    state->XHuz = 0.0;
+    state->XCuz = 0.0;
+    state->Xs = 0.0;
+    for (int m=0; m < HYMOD_MAX_NQ; m++) state->Xq[m] = 0.0;
+}
+
+// Advance the states by one time step, returning the total streamflow (stage times go to laps)
+template <class T>
+T hymod_step(const hymod_parameters_t<T> *p, hymod_state_t<T> *state, double precip, double avgTemp, double PE, hymod_step_fluxes_t<T> *fluxes, hymod_stage_laps *laps)
+{
+    return hymod_step_nq<0>(p, state, state->Xq, precip, avgTemp, PE, fluxes, laps);
+}
+
+// Point the daily state and flux series into the arena of the model, each starting on its own
+// cache line. The arena is only reallocated if it is too small for the simulation period and Nq,
+// so this can be called again after either changes.
+void hymod_allocate(HyMod *model)
+{
+    int ndays = model->forcing->nDays;
+    int Nq = model->parameters.Nq;
+    const size_t line = HYMOD_ALIGNMENT/sizeof(double);
+
+    size_t stride = ((size_t) ndays + line - 1)/line*line;
+    size_t XqSize = ((size_t) ndays*Nq + line - 1)/line*line;
+    size_t needed = 12*stride + XqSize;
+
+    if (needed > model->arena.capacity)
+    {
+        void *block = NULL;
+        free(model->arena.data);
+        if (posix_memalign(&block, HYMOD_ALIGNMENT, max(needed, line)*sizeof(double)) != 0)
+        {
+            cout << "Could not allocate " << needed*sizeof(double) << " bytes for the model states and fluxes" << endl;
+            exit(1);
+        }
+        model->arena.data = (double *) block;
+        model->arena.capacity = needed;
+        HYMOD_COUNT(COUNT_ALLOCATIONS, 1);
+        HYMOD_COUNT(COUNT_ALLOCATED_BYTES, needed*sizeof(double));
+    }
+
+    double *next = model->arena.data;
+    model->states.snow_store = next; next += stride;
+    model->states.XHuz       = next; next += stride;
+    model->states.XCuz       = next; next += stride;
+    model->states.Xs         = next; next += stride;
+
+    model->fluxes.snow       = next; next += stride;
+    model->fluxes.melt       = next; next += stride;
+    model->fluxes.effPrecip  = next; next += stride;
+    model->fluxes.AE         = next; next += stride;
+    model->fluxes.OV         = next; next += stride;
+    model->fluxes.Qq         = next; next += stride;
+    model->fluxes.Qs         = next; next += stride;
+    model->fluxes.Q          = next; next += stride;
+
+    model->states.Xq         = next;
 }
 
 // clean up memory
-void hymod_delete(int ndays) 
+void hymod_delete(HyMod *model) 
 {
-    delete[] hymod.fluxes.snow;
-    delete[] hymod.fluxes.melt;
-    delete[] hymod.states.snow_store;
-    
-    delete[] hymod.fluxes.effPrecip;
-    delete[] hymod.states.XHuz;
-    delete[] hymod.states.XCuz;
-    delete[] hymod.states.Xs;
-    delete[] hymod.fluxes.AE;
-    delete[] hymod.fluxes.OV;
-    delete[] hymod.fluxes.Qq;
-    delete[] hymod.fluxes.Qs;
-    delete[] hymod.fluxes.Q;
-    
-    for (int i=0; i < ndays; i++) delete[] hymod.states.Xq[i];
-    delete[] hymod.states.Xq;
+    free(model->arena.data);
+    model->arena.data = NULL;
+    model->arena.capacity = 0;
+
+    model->states = hymod_states();
+    model->fluxes = hymod_fluxes();
 }
 
-void PDM_soil_moisture(int modelDay, int dataDay)
+template <class T>
+void PDM_soil_moisture(const hymod_parameters_t<T> *p, hymod_state_t<T> *state, double PE, hymod_step_fluxes_t<T> *fluxes)
 {
-    double Cbeg, OV2, PPinf, Hint, Cint, OV1; // temporary variables for intermediate calculations
+    T Cbeg, OV2, PPinf, Hint, Cint, OV1; // temporary variables for intermediate calculations
     
     // Storage contents at begining
-    Cbeg = hymod.parameters.Cpar * (1.0 - pow(1.0-(hymod.states.XHuz[modelDay]/hymod.parameters.Huz),1.0+hymod.parameters.B));
+    Cbeg = p->Cpar * (1.0 - pdm_pow(1.0-(state->XHuz/p->Huz), p->expC, p->powC));
 
     // Compute overflow from soil moisture storage element
-    OV2 = max(0.0, hymod.fluxes.effPrecip[modelDay] + hymod.states.XHuz[modelDay] - hymod.parameters.Huz);
+    OV2 = max(T(0.0), fluxes->effPrecip + state->XHuz - p->Huz);
 
     // Remaining net rainfall
-    PPinf = hymod.fluxes.effPrecip[modelDay] - OV2;
+    PPinf = fluxes->effPrecip - OV2;
 
     // New actual height in the soil moisture storage element
-    Hint = min(hymod.parameters.Huz, hymod.states.XHuz[modelDay] + PPinf);
+    Hint = min(p->Huz, state->XHuz + PPinf);
 
     // New storage content
-    Cint = hymod.parameters.Cpar*(1.0-pow(1.0-(Hint/hymod.parameters.Huz),1.0+hymod.parameters.B));
+    Cint = p->Cpar*(1.0-pdm_pow(1.0-(Hint/p->Huz), p->expC, p->powC));
 
     // Additional effective rainfall produced by overflow from stores smaller than Cmax
-    OV1 = max(0.0, PPinf + Cbeg - Cint);
+    OV1 = max(T(0.0), PPinf + Cbeg - Cint);
 
     // Compute total overflow from soil moisture storage element
-    hymod.fluxes.OV[modelDay] = OV1 + OV2;
+    fluxes->OV = OV1 + OV2;
     
     // Compute actual evapotranspiration
-    hymod.fluxes.AE[modelDay] = min(Cint, (Cint/hymod.parameters.Cpar)*hymod.fluxes.PE[modelDay]*hymod.parameters.Kv);
+    fluxes->AE = min(Cint, (Cint/p->Cpar)*PE*p->Kv);
     
     // Storage contents and height after ET occurs
-    hymod.states.XCuz[modelDay] = max(0.0, Cint - hymod.fluxes.AE[modelDay]);
-    hymod.states.XHuz[modelDay] = hymod.parameters.Huz*(1.0-pow(1.0-(hymod.states.XCuz[modelDay]/hymod.parameters.Cpar),1.0/(1.0+hymod.parameters.B)));
+    state->XCuz = max(T(0.0), Cint - fluxes->AE);
+    state->XHuz = p->Huz*(1.0-pdm_pow(1.0-(state->XCuz/p->Cpar), p->expH, p->powH));
 
     return;
 
 }
 
-double Nash(double K, int N, double Qin, double *X)
+// Nash cascade with the number of reservoirs only known at run time
+template <class T>
+T Nash(T K, int N, T Qin, T *X)
 {
-    //Initialization
-    double *OO = new double[N];
-    double Qout;                       //Flow out of series of reservoirs
+    switch (N)
+    {
+        case 1: return Nash<1>(K, Qin, X);
+        case 2: return Nash<2>(K, Qin, X);
+        case 3: return Nash<3>(K, Qin, X);
+        case 4: return Nash<4>(K, Qin, X);
+    }
+
+    T Qout = Qin;                      //Flow out of series of reservoirs
     
-    //Loop through reservoirs
+    //Loop through reservoirs, the outflow of each one is the inflow to the next
     for (int Res = 0; Res < N; Res++)
     {
-        OO[Res] = K*X[Res];
-        X[Res]  = X[Res] - OO[Res];
-
-        if (Res==0) X[Res] = X[Res] + Qin; 
-        else        X[Res] = X[Res] + OO[Res-1];
+        T OO = K*X[Res];
+        X[Res] = X[Res] - OO;
+        X[Res] = X[Res] + Qout;
+        Qout = OO;
     }
 
     // The outflow from the cascade is the outflow from the last reservoir
-    Qout = OO[N-1];
-    delete[] OO;
     return Qout;
 }
 
-double snowDD(int modelDay, int dataDay)
+template <class T>
+T snowDD(const hymod_parameters_t<T> *p, hymod_state_t<T> *state, double precip, double avgTemp, hymod_step_fluxes_t<T> *fluxes)
 {
-    double Qout; // effective precip after freezing/melting
+    T Qout; // effective precip after freezing/melting
 
     //If temperature is lower than threshold, precip is all snow
-    if (hymod.data.avgTemp[dataDay] < hymod.parameters.Tth)
+    if (avgTemp < p->Tth)
     {
-        hymod.fluxes.snow[modelDay] = hymod.data.precip[dataDay];
+        fluxes->snow = precip;
         Qout = 0.0;
     }
     else //Otherwise, there is no snow and it's all rain
     {
-        hymod.fluxes.snow[modelDay] = 0.0;
-        Qout = hymod.data.precip[dataDay];
+        fluxes->snow = 0.0;
+        Qout = precip;
     }
 
     //Add to the snow storage for this day
-    hymod.states.snow_store[modelDay] += hymod.fluxes.snow[modelDay];
+    state->snow_store += fluxes->snow;
 
     //Snow melt occurs if we are above the base temperature (either a fraction of the store, or the whole thing)
-    if (hymod.data.avgTemp[dataDay] > hymod.parameters.Tb)
+    if (avgTemp > p->Tb)
     {
-        hymod.fluxes.melt[modelDay] = min(hymod.parameters.DDF*(hymod.data.avgTemp[dataDay]-hymod.parameters.Tb), hymod.states.snow_store[modelDay]);
+        fluxes->melt = min(T(p->DDF*(avgTemp-p->Tb)), state->snow_store);
     }
     //Otherwise, snowmelt is zero
     else
     {
-        hymod.fluxes.melt[modelDay] = 0.0;
+        fluxes->melt = 0.0;
     }
 
     //Update the snow storage depending on melt
-    hymod.states.snow_store[modelDay] -= hymod.fluxes.melt[modelDay];
-    if(hymod.states.snow_store[modelDay] < 0.0) hymod.states.snow_store[modelDay] = 0.0;
+    state->snow_store -= fluxes->melt;
+    if(state->snow_store < 0.0) state->snow_store = 0.0;
 
     //Qout is any rain + snow melt
-    Qout += hymod.fluxes.melt[modelDay];
+    Qout += fluxes->melt;
 
     return Qout;
 }
 
-void calculateHamonPE(int dataIndex, int nDays, int startDay)
+// Instantiate the kernels for simulation and for derivatives with respect to the parameters
+#define HYMOD_INSTANTIATE_KERNELS(T) \
+    template void set_hymod_parameters<T>(hymod_parameters_t<T> *, const T *); \
+    template void init_hymod_state<T>(hymod_state_t<T> *); \
+    template T hymod_step<T>(const hymod_parameters_t<T> *, hymod_state_t<T> *, double, double, double, hymod_step_fluxes_t<T> *, hymod_stage_laps *); \
+    template void PDM_soil_moisture<T>(const hymod_parameters_t<T> *, hymod_state_t<T> *, double, hymod_step_fluxes_t<T> *); \
+    template T Nash<T>(T, int, T, T *); \
+    template T snowDD<T>(const hymod_parameters_t<T> *, hymod_state_t<T> *, double, double, hymod_step_fluxes_t<T> *);
+
+HYMOD_INSTANTIATE_KERNELS(double)
+HYMOD_INSTANTIATE_KERNELS(dual<HYMOD_N_PARAMETERS>)
+
+// Day of the year (1-366) of a [year, month, day] date
+int day_of_year(const int *date)
 {
-    int oldYear;
-    int counter;
-    double evap_P, evap_day_length, evap_eStar;
+    static const int daysBefore[12] = {0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334};
+    int year = date[0], month = date[1];
+    bool leap = (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
+    return daysBefore[month-1] + date[2] + ((leap && month > 2) ? 1 : 0);
+}
 
-    //Initialize the starting year
-    oldYear = hymod.data.date[dataIndex][0];
-    counter = startDay-1;
+// Day length (hours) for each day of the year at a given latitude; only depends on astronomy
+static void hamon_day_lengths(double gageLat, double *dayLength)
+{
+    double evap_P;
 
-    //Fill out each of the arrays
-    for (int i=0; i<nDays; i++)
+    for (int counter = 1; counter <= 366; counter++)
     {
-        //If the years hasn't changed, increment counter
-        if (hymod.data.date[dataIndex+i][0] == oldYear) counter++;
-        //If it has changed, reset counter - this handles leap years
-        else counter = 1;
-
         evap_P = asin(0.39795*cos(0.2163108 + 2.0 * atan(0.9671396*tan(0.00860*double(counter-186)))));
-        evap_day_length = 24.0 - (24.0/PI)*(acos((sin(0.8333*PI/180.0)+sin(hymod.data.gageLat*PI/180.0)*sin(evap_P))/(cos(hymod.data.gageLat*PI/180.0)*cos(evap_P))));
-        evap_eStar = 0.6108*exp((17.27*hymod.data.avgTemp[dataIndex+i])/(237.3+hymod.data.avgTemp[dataIndex+i]));
-        hymod.fluxes.PE[i] = (715.5*evap_day_length*evap_eStar/24.0)/(hymod.data.avgTemp[dataIndex+i] + 273.2);
+        dayLength[counter] = 24.0 - (24.0/PI)*(acos((sin(0.8333*PI/180.0)+sin(gageLat*PI/180.0)*sin(evap_P))/(cos(gageLat*PI/180.0)*cos(evap_P))));
+    }
+}
 
-        oldYear = hymod.data.date[dataIndex+i][0];
+// Hamon PE from nMembers temperature traces stored side by side (avgTemp[i*nMembers + m] for step i)
+static void hamon_PE(const MOPEXData *data, const double *avgTemp, int nMembers, double *PE)
+{
+    double dayLength[367];
+    size_t n = (size_t) data->nDays*nMembers;
+
+    hamon_day_lengths(data->gageLat, dayLength);
+
+    //Saturated vapor pressure, in a loop of its own so that it is vectorised
+    for (size_t i=0; i<n; i++)
+        PE[i] = 0.6108*fast_exp((17.27*avgTemp[i])/(237.3+avgTemp[i]));
+
+    //Sub-daily steps share the PE of their day evenly
+    double stepFraction = 1.0/data->stepsPerDay;
+    for (int i=0; i<data->nDays; i++)
+    {
+        double evap_day_length = dayLength[day_of_year(data->date[i])];
+        for (size_t k = (size_t) i*nMembers; k < (size_t) (i+1)*nMembers; k++)
+        {
+            PE[k] = (715.5*evap_day_length*PE[k]/24.0)/(avgTemp[k] + 273.2);
+            if (data->stepsPerDay > 1) PE[k] *= stepFraction;
+        }
     }
+}
 
-    return;
+// Hamon PE for every time step of the record
+void calculateHamonPE(const MOPEXData *data, double *PE)
+{
+    hamon_PE(data, data->avgTemp, 1, PE);
+}
+
+// Hamon PE series for the whole record of each basin, computed once per process and shared
+// by every window and every model run over that basin. Entries are identified by the gage
+// and a checksum of the dates and temperatures, so reloading the same data reuses them.
+// Ensemble forcings have an entry of their own with the PE of every member.
+struct hamon_cache_entry
+{
+    string ID;
+    double gageLat;
+    int nDays;
+    int stepsPerDay;
+    int nMembers;
+    uint64_t checksum;
+    vector<double> PE;
+};
+
+static mutex hamonCacheLock;
+static list<hamon_cache_entry> hamonCache;
+
+// FNV-1a hash of a block of bytes, continuing from hash (start from FNV_OFFSET)
+uint64_t fnv1a(uint64_t hash, const void *bytes, size_t length)
+{
+    const unsigned char *p = (const unsigned char *) bytes;
+    for (size_t i = 0; i < length; i++) hash = (hash ^ p[i]) * 1099511628211ULL;
+    return hash;
+}
+
+static hamon_cache_entry *find_PE_series(const MOPEXData *data, int nMembers, uint64_t checksum)
+{
+    for (list<hamon_cache_entry>::iterator entry = hamonCache.begin(); entry != hamonCache.end(); entry++)
+        if (entry->checksum == checksum && entry->nDays == data->nDays && entry->stepsPerDay == data->stepsPerDay &&
+            entry->nMembers == nMembers && entry->gageLat == data->gageLat && entry->ID == data->ID)
+            return &*entry;
+    return NULL;
+}
+
+// The series is computed outside the lock, so threads needing other basins are not held up.
+// If another thread added the same series meanwhile, its entry is kept and ours is dropped.
+static const double *cached_PE_series(const MOPEXData *data, const double *avgTemp, int nMembers)
+{
+    HYMOD_STAGE_BEGIN(STAGE_PE);
+    size_t n = (size_t) data->nDays*nMembers;
+    uint64_t checksum = FNV_OFFSET;
+    checksum = fnv1a(checksum, avgTemp, n*sizeof(double));
+    checksum = fnv1a(checksum, data->date, data->nDays*sizeof(data->date[0]));
+
+    {
+        lock_guard<mutex> guard(hamonCacheLock);
+        hamon_cache_entry *entry = find_PE_series(data, nMembers, checksum);
+        if (entry)
+        {
+            HYMOD_STAGE_END(STAGE_PE);
+            return entry->PE.data();
+        }
+    }
+
+    list<hamon_cache_entry> added(1);
+    hamon_cache_entry &entry = added.front();
+    entry.ID = data->ID;
+    entry.gageLat = data->gageLat;
+    entry.nDays = data->nDays;
+    entry.stepsPerDay = data->stepsPerDay;
+    entry.nMembers = nMembers;
+    entry.checksum = checksum;
+    entry.PE.resize(n);
+    hamon_PE(data, avgTemp, nMembers, entry.PE.data());
+
+    lock_guard<mutex> guard(hamonCacheLock);
+    hamon_cache_entry *existing = find_PE_series(data, nMembers, checksum);
+    if (existing)
+    {
+        HYMOD_STAGE_END(STAGE_PE);
+        return existing->PE.data();
+    }
+    hamonCache.splice(hamonCache.end(), added);
+    HYMOD_COUNT(COUNT_ALLOCATIONS, 1);
+    HYMOD_COUNT(COUNT_ALLOCATED_BYTES, n*sizeof(double));
+    HYMOD_STAGE_END(STAGE_PE);
+    return hamonCache.back().PE.data();
+}
+
+const double *hamon_PE_series(const MOPEXData *data)
+{
+    return cached_PE_series(data, data->avgTemp, 1);
+}
+
+// PE of every ensemble member, laid out like the member temperatures
+const double *hamon_member_PE_series(const MOPEXData *data)
+{
+    return cached_PE_series(data, data->memberAvgTemp, data->nMembers);
+}
+
+// Release the cached PE series; forcing structures using them must not be used afterwards
+void clear_hamon_cache()
+{
+    lock_guard<mutex> guard(hamonCacheLock);
+    hamonCache.clear();
 }
\ No newline at end of file
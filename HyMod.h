@@ -15,6 +15,9 @@ You should have received a copy of the GNU Lesser General Public License
 along with Hymod.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#ifndef HYMOD_H
+#define HYMOD_H
+
 #include <iostream>
 #include <fstream>
 #include <math.h>
@@ -24,37 +27,92 @@ along with Hymod.  If not, see <http://www.gnu.org/licenses/>.
 #include <time.h>
 #include <iomanip>
 #include <math.h>
+#include <vector>
+#include <list>
+#include <mutex>
 
 #include "MOPEXData.h"
+#include "FastMath.h"
+#include "Dual.h"
+#include "Instrument.h"
 
 using namespace std;
 const double PI = 3.141592653589793238462;
 
-struct hymod_parameters
+// Largest number of quickflow reservoirs (Nq) the model keeps states for
+#define HYMOD_MAX_NQ 16
+
+// Alignment (bytes) of each daily series stored by a model instance
+#define HYMOD_ALIGNMENT 64
+
+// Ways of evaluating the power terms x^(1+B) and x^(1/(1+B)) of PDM_soil_moisture
+enum pdm_kernel
+{
+    PDM_POW,        //pow() for every term (reference)
+    PDM_FAST,       //Exact shortcuts for the exponents 1, 2 and 1/2 (B = 0 or 1), pow() otherwise
+    PDM_APPROX      //The shortcuts, otherwise fast_pow (relative error below 1e-13 per term, see FastMath.h)
+};
+
+// Method used for one exponent, chosen once per parameter set
+enum pdm_pow_method
+{
+    POW_LIBM,
+    POW_ONE,
+    POW_SQUARE,
+    POW_SQRT,
+    POW_APPROX
+};
+
+// The real-valued parameters are of type T: double for simulation, dual<HYMOD_N_PARAMETERS> to carry
+// derivatives with respect to the user specified parameters (see hymod_gradient)
+template <class T>
+struct hymod_parameters_t
 {
     //User specified parameters
-    double Huz;      //Maximum height of soil moisture accounting tank - Range [0, Inf]
-    double B;        //Scaled distribution function shape parameter    - Range [0, 2]
-    double alpha;    //Quick/slow split parameter                      - Range [0, 1]
+    T      Huz;      //Maximum height of soil moisture accounting tank - Range [0, Inf]
+    T      B;        //Scaled distribution function shape parameter    - Range [0, 2]
+    T      alpha;    //Quick/slow split parameter                      - Range [0, 1]
     int    Nq;       //Number of quickflow routing tanks               - Range [1, Inf] (typically set to <3)
-    double Kq;       //Quickflow routing tanks' rate parameter         - Range [0, 1]
-    double Ks;       //Slowflow routing tank's rate parameter          - Range [0, 1]
+    T      Kq;       //Quickflow routing tanks' rate parameter         - Range [0, 1]
+    T      Ks;       //Slowflow routing tank's rate parameter          - Range [0, 1]
 
     // Snow parameters (degree-day model)
-    double DDF;        //Degree day factor                        - Range [ 0, 2]
-    double Tth;        //Temperature threshold                    - Range [-5, 5] 
-    double Tb;         //Base temperature to calculate melt       - Range [-5, 5]
+    T      DDF;        //Degree day factor                        - Range [ 0, 2]
+    T      Tth;        //Temperature threshold                    - Range [-5, 5] 
+    T      Tb;         //Base temperature to calculate melt       - Range [-5, 5]
 
     // Given/calculated parameters
-    double Kv;       //Vegetation adjustment to PE                     - Range [0, 2]
-    double Cpar;     //Maximum combined contents of all stores (calculated from Huz and b)
+    T      Kv;       //Vegetation adjustment to PE                     - Range [0, 2]
+    T      Cpar;     //Maximum combined contents of all stores (calculated from Huz and b)
+    int stepsPerDay; //Time steps per day of the forcing; Ks, Kq and DDF are given per day and scaled to the step
+
+    // Power terms of the soil moisture store (calculated from B)
+    int    pdmKernel;  //PDM_POW, PDM_FAST or PDM_APPROX
+    T      expC;       //Exponent of the storage contents, 1+B
+    T      expH;       //Exponent of the storage height, 1/(1+B)
+    int    powC, powH; //pdm_pow_method used for each exponent
 };
+typedef hymod_parameters_t<double> hymod_parameters;
+
+// Number of user specified parameters, in the order read by set_hymod_parameters
+#define HYMOD_N_PARAMETERS 8
+
+// Sampling range of a parameter, for sensitivity analysis and calibration
+struct hymod_parameter_range
+{
+    const char *name;
+    double lower;
+    double upper;
+};
+
+// Default ranges, in the order of set_hymod_parameters (see hymod_parameters)
+extern const hymod_parameter_range hymod_default_ranges[HYMOD_N_PARAMETERS];
 
 struct hymod_states
 {
     double *XHuz;        //Model computed upper zone soil moisture tank state height
     double *XCuz;        //Model computed upper zone soil moisture tank state contents
-    double **Xq;         //Model computed quickflow tank states contents
+    double *Xq;          //Model computed quickflow tank states contents, Nq values per day (Xq[day*Nq + tank])
     double *Xs;          //Model computed slowflow tank state contents
     double *snow_store;      //State of snow reservoir
 };
@@ -69,25 +127,237 @@ struct hymod_fluxes
     double *Q;           //Model computed total streamflow flux
     double *snow;        //Daily snow
     double *melt;        //Snow melt
-    double *PE;          // Potential ET (Hamon)
 };
 
-struct HyMod
+// States of the model at the end of a time step, carried over to the next one
+template <class T>
+struct hymod_state_t
+{
+    T snow_store;               //State of snow reservoir
+    T XHuz;                     //Upper zone soil moisture tank state height
+    T XCuz;                     //Upper zone soil moisture tank state contents
+    T Xs;                       //Slowflow tank state contents
+    T Xq[HYMOD_MAX_NQ];         //Quickflow tank states contents
+};
+typedef hymod_state_t<double> hymod_state;
+
+// Fluxes computed during a single time step
+template <class T>
+struct hymod_step_fluxes_t
+{
+    T effPrecip;         //Effective rain entering the SMA model (melt+precip if using snow model)
+    T AE;                //Actual evapotranspiration flux
+    T OV;                //Precipitation excess flux
+    T Qq;                //Quickflow flux
+    T Qs;                //Slowflow flux
+    T Q;                 //Total streamflow flux
+    T snow;              //Snow
+    T melt;              //Snow melt
+};
+typedef hymod_step_fluxes_t<double> hymod_step_fluxes;
+
+// Forcing data for the simulation period, read once and shared (read-only) by all model instances
+struct hymod_forcing
 {
     MOPEXData data;
+    int nDays;           //Length of simulation in time steps, including warmup
+    int startingIndex;   //Index of the data file corresponding with the start date
+    const double *PE;    //Potential ET (Hamon) for each step of the simulation (points into the shared PE cache)
+    const double *memberPE; //Potential ET of each ensemble member, data.nMembers per step (NULL without members)
+};
+
+// Single aligned block holding all of the daily series of a model instance. It is reused by
+// hymod_allocate while it is large enough, and released by hymod_delete or, failing that,
+// when the instance goes out of scope.
+struct hymod_arena
+{
+    double *data;
+    size_t capacity;     //Number of doubles in the block
+
+    hymod_arena() : data(NULL), capacity(0) {}
+    ~hymod_arena() { free(data); }
+    hymod_arena(const hymod_arena &) = delete;
+    hymod_arena &operator=(const hymod_arena &) = delete;
+};
+
+// One model instance. Each thread evaluating parameter sets needs its own.
+struct HyMod
+{
+    const hymod_forcing *forcing;
     hymod_parameters parameters;
     hymod_states states;   
     hymod_fluxes fluxes;
+    hymod_arena arena;   //Storage of the states and fluxes series
 };
 
-// Global hymod structure, accessible by all files
-extern struct HyMod hymod;
-
 //Function Prototypes
-void zero_states_and_fluxes(int ndays);
-void hymod_allocate(int ndays);
-void hymod_delete(int ndays);
-void PDM_soil_moisture(int modelDay, int dataDay);
-double Nash(double K, int N, double Qin, double *X);
-double snowDD(int modelDay, int dataDay);
-void calculateHamonPE(int dataIndex, int nDays, int startDay);
+void init_hymod_forcing(hymod_forcing *forcing, string dataFile, int startingIndex, int nDays);
+void init_hymod_forcing_dates(hymod_forcing *forcing, string dataFile, const int *startDate, const int *endDate);
+void init_hymod_forcing_ensemble(hymod_forcing *forcing, const vector<string> &memberFiles, const int *startDate, const int *endDate);
+void set_hymod_window(hymod_forcing *forcing, string dataFile, int startingIndex, int nDays);
+void set_hymod_window_dates(hymod_forcing *forcing, string dataFile, const int *startDate, const int *endDate);
+int find_date_index(const MOPEXData *data, const int *date);
+int compare_dates(const int *a, const int *b);
+void delete_hymod_forcing(hymod_forcing *forcing);
+void check_hymod_nq(int Nq);
+void init_hymod(HyMod *model, const hymod_forcing *forcing, bool storeHistory = true, int Nq = 3, int pdmKernel = PDM_POW);
+template <class T> void set_hymod_parameters(hymod_parameters_t<T> *p, const T *parameters);
+void read_parameter_ranges(string rangeFile, hymod_parameter_range *ranges);
+int pdm_pow_method(double exponent, int pdmKernel);
+int find_pdm_kernel(string name);
+void calc_hymod(HyMod *model, double *parameters, const hymod_state *initial = NULL);
+void hymod_final_state(const HyMod *model, hymod_state *state);
+void hymod_allocate(HyMod *model);
+void hymod_delete(HyMod *model);
+
+// The process kernels are written once for any number type T and instantiated (in HyMod.cpp)
+// for double and for dual<HYMOD_N_PARAMETERS>
+template <class T> void init_hymod_state(hymod_state_t<T> *state);
+template <class T> T hymod_step(const hymod_parameters_t<T> *p, hymod_state_t<T> *state, double precip, double avgTemp, double PE, hymod_step_fluxes_t<T> *fluxes, hymod_stage_laps *laps);
+template <class T> void PDM_soil_moisture(const hymod_parameters_t<T> *p, hymod_state_t<T> *state, double PE, hymod_step_fluxes_t<T> *fluxes);
+template <class T> T Nash(T K, int N, T Qin, T *X);
+template <class T> T snowDD(const hymod_parameters_t<T> *p, hymod_state_t<T> *state, double precip, double avgTemp, hymod_step_fluxes_t<T> *fluxes);
+
+int day_of_year(const int *date);
+void calculateHamonPE(const MOPEXData *data, double *PE);
+const double *hamon_PE_series(const MOPEXData *data);
+const double *hamon_member_PE_series(const MOPEXData *data);
+void clear_hamon_cache();
+
+#define FNV_OFFSET 14695981039346656037ULL
+uint64_t fnv1a(uint64_t hash, const void *bytes, size_t length);
+
+// x^e with the method chosen for the exponent by pdm_pow_method
+inline double pdm_pow(double x, double e, int method)
+{
+    switch (method)
+    {
+        case POW_ONE:    return x;
+        case POW_SQUARE: return x*x;
+        case POW_SQRT:   return sqrt(x);
+        case POW_APPROX: return fast_pow(x, e);
+        default:         return pow(x, e);
+    }
+}
+
+// x^e carrying the derivatives of both x and e (e depends on B). The value is that of the chosen
+// method; the derivatives are exact whatever the method, so they stay right at B = 0 or 1 too.
+// At x = 0 the slope in x is 1 for e = 1 and 0 otherwise (for e < 1 it is unbounded, which only
+// happens when the store is exactly full after evaporation); the slope in e vanishes there.
+template <int N>
+inline dual<N> pdm_pow(const dual<N> &x, const dual<N> &e, int method)
+{
+    dual<N> r;
+    r.v = pdm_pow(x.v, e.v, method);
+
+    double dx = (e.v == 1.0) ? 1.0 : 0.0, de = 0.0;
+    if (x.v > 0.0)
+    {
+        dx = e.v*r.v/x.v;
+        de = r.v*log(x.v);
+    }
+    for (int i = 0; i < N; i++) r.d[i] = dx*x.d[i] + de*e.d[i];
+    return r;
+}
+
+// Nash cascade of N linear reservoirs, specialised on N so that the loop is unrolled and,
+// once inlined into a time loop, the reservoir states can stay in registers
+template <int N, class T>
+inline T Nash(T K, T Qin, T *X)
+{
+    T Qout = Qin;                      //Flow out of series of reservoirs
+
+    //Loop through reservoirs, the outflow of each one is the inflow to the next
+    for (int Res = 0; Res < N; Res++)
+    {
+        T OO = K*X[Res];
+        X[Res] = X[Res] - OO;
+        X[Res] = X[Res] + Qout;
+        Qout = OO;
+    }
+
+    // The outflow from the cascade is the outflow from the last reservoir
+    return Qout;
+}
+
+// One time step with NQ quickflow reservoirs fixed at compile time (NQ = 0 uses p->Nq at run time).
+// The quickflow states are passed separately so that callers can keep them in local variables.
+// The stage times are added to the run's laps (see Instrument.h).
+template <int NQ, class T>
+inline T hymod_step_nq(const hymod_parameters_t<T> *p, hymod_state_t<T> *state, T *Xq, double precip, double avgTemp, double PE, hymod_step_fluxes_t<T> *fluxes, hymod_stage_laps *laps)
+{
+    // Run snow model to find effective precip for this timestep
+    HYMOD_LAPS_START(*laps);
+    fluxes->effPrecip = snowDD(p, state, precip, avgTemp, fluxes);
+    HYMOD_LAP(*laps, STAGE_SNOW);
+
+    // Run Pdm soil moisture accounting including evapotranspiration
+    PDM_soil_moisture(p, state, PE, fluxes);
+    HYMOD_LAP(*laps, STAGE_SOIL);
+
+    // Run Nash Cascade routing of quickflow component
+    T new_quickflow = p->alpha * fluxes->OV;
+    fluxes->Qq = (NQ > 0) ? Nash<NQ>(p->Kq, new_quickflow, Xq) : Nash(p->Kq, p->Nq, new_quickflow, Xq);
+
+    // Run Nash Cascade routing of slowflow component
+    T new_slowflow = (1.0-p->alpha) * fluxes->OV;
+    fluxes->Qs = Nash<1>(p->Ks, new_slowflow, &state->Xs);
+    HYMOD_LAP(*laps, STAGE_ROUTING);
+
+    fluxes->Q = fluxes->Qq + fluxes->Qs;
+    return fluxes->Q;
+}
+
+template <int NQ, class Output>
+void calc_hymod_lean_nq(const HyMod *model, const double *parameters, Output &output, hymod_state *carry)
+{
+    const hymod_forcing *forcing = model->forcing;
+    hymod_parameters p = model->parameters;
+    hymod_state state;
+    hymod_step_fluxes fluxes;
+    hymod_stage_laps laps;
+    double Xq[NQ > 0 ? NQ : 1];
+
+    set_hymod_parameters(&p, parameters);
+    HYMOD_LAPS_INIT(laps);
+    HYMOD_COUNT(COUNT_EVALUATIONS, 1);
+    HYMOD_COUNT(COUNT_DAYS, forcing->nDays);
+    if (carry != NULL) state = *carry;
+    else init_hymod_state(&state);
+    for (int m = 0; m < NQ; m++) Xq[m] = state.Xq[m];
+
+    for (int modelDay = 0; modelDay < forcing->nDays; modelDay++)
+    {
+        int dataDay = forcing->startingIndex + modelDay;
+        double Q = hymod_step_nq<NQ>(&p, &state, (NQ > 0) ? Xq : state.Xq, forcing->data.precip[dataDay],
+                                     forcing->data.avgTemp[dataDay], forcing->PE[modelDay], &fluxes, &laps);
+        output(modelDay, Q);
+    }
+    HYMOD_LAPS_FLUSH(laps);
+
+    if (carry != NULL)
+    {
+        for (int m = 0; m < NQ; m++) state.Xq[m] = Xq[m];
+        *carry = state;
+    }
+}
+
+// Lean run mode: evaluate a parameter set carrying the states from one day to the next
+// as scalars, without storing any daily states or fluxes in the model instance.
+// output(modelDay, Q) is called with the streamflow of each day, so callers keep only what they need.
+// If state is not NULL, the run starts from it (e.g. a checkpoint) and it receives the final states.
+// The time loop is specialised for 1 to 4 quickflow reservoirs.
+template <class Output>
+void calc_hymod_lean(const HyMod *model, const double *parameters, Output &output, hymod_state *state = NULL)
+{
+    switch (model->parameters.Nq)
+    {
+        case 1: calc_hymod_lean_nq<1>(model, parameters, output, state); break;
+        case 2: calc_hymod_lean_nq<2>(model, parameters, output, state); break;
+        case 3: calc_hymod_lean_nq<3>(model, parameters, output, state); break;
+        case 4: calc_hymod_lean_nq<4>(model, parameters, output, state); break;
+        default: calc_hymod_lean_nq<0>(model, parameters, output, state); break;
+    }
+}
+
+#endif
@@ -0,0 +1,268 @@
+/*
+Copyright (C) 2010-2013 Jon Herman, Josh Kollat, and others.
+
+Hymod is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Hymod is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with Hymod.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "HyModBatch.h"
+
+// base^e for every lane, with the method chosen for each lane. When all lanes share the
+// method the loop has no branches, so fast_pow is vectorised.
+static void batch_pow(const double *base, const double *e, const int *method, int uniform, double *power)
+{
+    if (uniform == POW_APPROX)
+        for (int l = 0; l < HYMOD_LANES; l++) power[l] = fast_pow(base[l], e[l]);
+    else if (uniform == POW_LIBM)
+        for (int l = 0; l < HYMOD_LANES; l++) power[l] = pow(base[l], e[l]);
+    else
+        for (int l = 0; l < HYMOD_LANES; l++) power[l] = pdm_pow(base[l], e[l], method[l]);
+}
+
+// The batched model repeats the arithmetic of snowDD, PDM_soil_moisture and Nash
+// operation for operation, with every branch and min/max clamp turned into a
+// per-lane select, so that each lane reproduces the scalar model bit for bit.
+// Each stage is a short loop over the lanes that the compiler can vectorise; the
+// pow() calls stay scalar libm calls since a vector pow would round differently.
+
+static void batch_snowDD(hymod_batch *b, const double *precip, const double *avgTemp, double *effPrecip)
+{
+    for (int l = 0; l < HYMOD_LANES; l++)
+    {
+        //If temperature is lower than threshold, precip is all snow, otherwise it's all rain
+        bool cold = avgTemp[l] < b->Tth[l];
+        double snow = cold ? precip[l] : 0.0;
+        double Qout = cold ? 0.0 : precip[l];
+
+        //Add to the snow storage for this day
+        double store = b->snow_store[l] + snow;
+
+        //Snow melt occurs if we are above the base temperature (either a fraction of the store, or the whole thing)
+        double potential = b->DDF[l]*(avgTemp[l]-b->Tb[l]);
+        double melt = (avgTemp[l] > b->Tb[l]) ? ((store < potential) ? store : potential) : 0.0;
+
+        //Update the snow storage depending on melt
+        store -= melt;
+        b->snow_store[l] = (store < 0.0) ? 0.0 : store;
+
+        //Qout is any rain + snow melt
+        effPrecip[l] = Qout + melt;
+    }
+}
+
+static void batch_PDM_soil_moisture(hymod_batch *b, const double *PE, double Kv, const double *effPrecip, double *OV)
+{
+    double base[HYMOD_LANES], power[HYMOD_LANES];
+    double Cbeg[HYMOD_LANES], PPinf[HYMOD_LANES], OV2[HYMOD_LANES];
+
+    // Storage contents at begining
+    for (int l = 0; l < HYMOD_LANES; l++) base[l] = 1.0-(b->XHuz[l]/b->Huz[l]);
+    batch_pow(base, b->expC, b->powC, b->uniformC, power);
+
+    for (int l = 0; l < HYMOD_LANES; l++)
+    {
+        Cbeg[l] = b->Cpar[l] * (1.0 - power[l]);
+
+        // Compute overflow from soil moisture storage element
+        double excess = effPrecip[l] + b->XHuz[l] - b->Huz[l];
+        OV2[l] = (0.0 < excess) ? excess : 0.0;
+
+        // Remaining net rainfall
+        PPinf[l] = effPrecip[l] - OV2[l];
+
+        // New actual height in the soil moisture storage element
+        double height = b->XHuz[l] + PPinf[l];
+        double Hint = (height < b->Huz[l]) ? height : b->Huz[l];
+        base[l] = 1.0-(Hint/b->Huz[l]);
+    }
+    batch_pow(base, b->expC, b->powC, b->uniformC, power);
+
+    for (int l = 0; l < HYMOD_LANES; l++)
+    {
+        // New storage content
+        double Cint = b->Cpar[l]*(1.0-power[l]);
+
+        // Additional effective rainfall produced by overflow from stores smaller than Cmax
+        double excess = PPinf[l] + Cbeg[l] - Cint;
+        double OV1 = (0.0 < excess) ? excess : 0.0;
+
+        // Compute total overflow from soil moisture storage element
+        OV[l] = OV1 + OV2[l];
+
+        // Compute actual evapotranspiration
+        double demand = (Cint/b->Cpar[l])*PE[l]*Kv;
+        double AE = (demand < Cint) ? demand : Cint;
+
+        // Storage contents after ET occurs
+        double remaining = Cint - AE;
+        double XCuz = (0.0 < remaining) ? remaining : 0.0;
+        b->XCuz[l] = XCuz;
+        base[l] = 1.0-(XCuz/b->Cpar[l]);
+    }
+    batch_pow(base, b->expH, b->powH, b->uniformH, power);
+
+    // Storage height after ET occurs
+    for (int l = 0; l < HYMOD_LANES; l++) b->XHuz[l] = b->Huz[l]*(1.0-power[l]);
+}
+
+static void batch_Nash(const double *K, int N, const double *Qin, double (*X)[HYMOD_LANES], double *Qout)
+{
+    double inflow[HYMOD_LANES];
+    for (int l = 0; l < HYMOD_LANES; l++) inflow[l] = Qin[l];
+
+    //Loop through reservoirs, the outflow of each one is the inflow to the next
+    for (int Res = 0; Res < N; Res++)
+    {
+        for (int l = 0; l < HYMOD_LANES; l++)
+        {
+            double OO = K[l]*X[Res][l];
+            X[Res][l] = (X[Res][l] - OO) + inflow[l];
+            inflow[l] = OO;
+        }
+    }
+
+    // The outflow from the cascade is the outflow from the last reservoir
+    for (int l = 0; l < HYMOD_LANES; l++) Qout[l] = inflow[l];
+}
+
+// Set up the parameters of each lane and empty all of the stores; unused lanes repeat the first set
+void init_hymod_batch(hymod_batch *b, const HyMod *model, double **parameters, int nSets)
+{
+    int Nq = model->parameters.Nq;
+
+    if (nSets < 1 || nSets > HYMOD_LANES || Nq < 1 || Nq > HYMOD_MAX_NQ)
+    {
+        cout << "calc_hymod_batch: unsupported batch (" << nSets << " sets, Nq = " << Nq << ")" << endl;
+        exit(1);
+    }
+    HYMOD_LAPS_INIT(b->laps);
+
+    for (int l = 0; l < HYMOD_LANES; l++)
+    {
+        //The per-lane values are those calc_hymod would use, including the scaling to the time step
+        hymod_parameters p = model->parameters;
+        set_hymod_parameters(&p, parameters[l < nSets ? l : 0]);
+        b->Ks[l]    = p.Ks;
+        b->Kq[l]    = p.Kq;
+        b->DDF[l]   = p.DDF;
+        b->Tb[l]    = p.Tb;
+        b->Tth[l]   = p.Tth;
+        b->alpha[l] = p.alpha;
+        b->B[l]     = p.B;
+        b->Huz[l]   = p.Huz;
+        b->Cpar[l]  = p.Cpar;
+        b->expC[l]  = p.expC;
+        b->expH[l]  = p.expH;
+        b->powC[l]  = p.powC;
+        b->powH[l]  = p.powH;
+
+        b->snow_store[l] = 0.0;
+        b->XHuz[l] = 0.0;
+        b->XCuz[l] = 0.0;
+        b->Xs[l] = 0.0;
+        for (int m = 0; m < Nq; m++) b->Xq[m][l] = 0.0;
+    }
+
+    b->uniformC = b->powC[0];
+    b->uniformH = b->powH[0];
+    for (int l = 1; l < HYMOD_LANES; l++)
+    {
+        if (b->powC[l] != b->uniformC) b->uniformC = -1;
+        if (b->powH[l] != b->uniformH) b->uniformH = -1;
+    }
+}
+
+// Start the first nSets lanes from the given states instead of empty stores (unused lanes repeat the first set)
+void set_hymod_batch_states(hymod_batch *b, int Nq, const hymod_state *states, int nSets)
+{
+    for (int l = 0; l < HYMOD_LANES; l++)
+    {
+        const hymod_state *state = &states[l < nSets ? l : 0];
+        b->snow_store[l] = state->snow_store;
+        b->XHuz[l] = state->XHuz;
+        b->XCuz[l] = state->XCuz;
+        b->Xs[l] = state->Xs;
+        for (int m = 0; m < Nq; m++) b->Xq[m][l] = state->Xq[m];
+    }
+}
+
+// Copy the current states of the first nSets lanes
+void get_hymod_batch_states(const hymod_batch *b, int Nq, hymod_state *states, int nSets)
+{
+    for (int l = 0; l < nSets; l++)
+    {
+        hymod_state *state = &states[l];
+        init_hymod_state(state);
+        state->snow_store = b->snow_store[l];
+        state->XHuz = b->XHuz[l];
+        state->XCuz = b->XCuz[l];
+        state->Xs = b->Xs[l];
+        for (int m = 0; m < Nq; m++) state->Xq[m] = b->Xq[m][l];
+    }
+}
+
+// Advance all lanes by one day over the same forcing, Q receives the total streamflow of each lane
+void hymod_batch_step(hymod_batch *b, int Nq, double Kv, double precip, double avgTemp, double PE, double *Q)
+{
+    double lanePrecip[HYMOD_LANES], laneTemp[HYMOD_LANES], lanePE[HYMOD_LANES];
+
+    for (int l = 0; l < HYMOD_LANES; l++)
+    {
+        lanePrecip[l] = precip;
+        laneTemp[l] = avgTemp;
+        lanePE[l] = PE;
+    }
+    hymod_batch_step_lanes(b, Nq, Kv, lanePrecip, laneTemp, lanePE, Q);
+}
+
+// Advance all lanes by one day, each with its own forcing (e.g. ensemble members)
+void hymod_batch_step_lanes(hymod_batch *b, int Nq, double Kv, const double *precip, const double *avgTemp, const double *PE, double *Q)
+{
+    double effPrecip[HYMOD_LANES], OV[HYMOD_LANES];
+    double new_quickflow[HYMOD_LANES], new_slowflow[HYMOD_LANES];
+    double Qq[HYMOD_LANES], Qs[HYMOD_LANES];
+
+    // Run snow model to find effective precip for this timestep
+    HYMOD_LAPS_START(b->laps);
+    batch_snowDD(b, precip, avgTemp, effPrecip);
+    HYMOD_LAP(b->laps, STAGE_SNOW);
+
+    // Run Pdm soil moisture accounting including evapotranspiration
+    batch_PDM_soil_moisture(b, PE, Kv, effPrecip, OV);
+    HYMOD_LAP(b->laps, STAGE_SOIL);
+
+    // Split overflow between quickflow and slowflow
+    for (int l = 0; l < HYMOD_LANES; l++)
+    {
+        new_quickflow[l] = b->alpha[l] * OV[l];
+        new_slowflow[l]  = (1.0-b->alpha[l]) * OV[l];
+    }
+
+    // Run Nash Cascade routing of quickflow and slowflow components
+    batch_Nash(b->Kq, Nq, new_quickflow, b->Xq, Qq);
+    batch_Nash(b->Ks, 1, new_slowflow, &b->Xs, Qs);
+    HYMOD_LAP(b->laps, STAGE_ROUTING);
+
+    for (int l = 0; l < HYMOD_LANES; l++) Q[l] = Qq[l] + Qs[l];
+}
+
+void calc_hymod_batch(const HyMod *model, double **parameters, int nSets, double **Q)
+{
+    auto save = [&](int modelDay, const double *Qday) {
+        if (Q != NULL)
+            for (int s = 0; s < nSets; s++) Q[s][modelDay] = Qday[s];
+    };
+
+    calc_hymod_batch_lean(model, parameters, nSets, save);
+    return;
+}
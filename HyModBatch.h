@@ -0,0 +1,158 @@
+/*
+Copyright (C) 2010-2013 Jon Herman, Josh Kollat, and others.
+
+Hymod is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Hymod is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with Hymod.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "HyMod.h"
+
+// Number of parameter sets advanced together by the batched model. Chosen from the
+// vector width the compiler targets (build with -march=native to pick up AVX2/AVX-512);
+// define HYMOD_LANES on the command line to override, HYMOD_LANES=1 is the scalar fallback.
+#ifndef HYMOD_LANES
+#if defined(__AVX512F__)
+#define HYMOD_LANES 8
+#elif defined(__AVX__)
+#define HYMOD_LANES 4
+#elif defined(__SSE2__)
+#define HYMOD_LANES 2
+#else
+#define HYMOD_LANES 1
+#endif
+#endif
+
+// Parameters and carried states for one batch, one entry per lane (structure of arrays)
+struct hymod_batch
+{
+    // Parameters (same meaning as in hymod_parameters)
+    double Ks[HYMOD_LANES];
+    double Kq[HYMOD_LANES];
+    double DDF[HYMOD_LANES];
+    double Tb[HYMOD_LANES];
+    double Tth[HYMOD_LANES];
+    double alpha[HYMOD_LANES];
+    double B[HYMOD_LANES];
+    double Huz[HYMOD_LANES];
+    double Cpar[HYMOD_LANES];
+
+    // Power terms of the soil moisture store (see set_hymod_parameters)
+    double expC[HYMOD_LANES];
+    double expH[HYMOD_LANES];
+    int powC[HYMOD_LANES];
+    int powH[HYMOD_LANES];
+    int uniformC, uniformH;     //Method shared by all lanes, or -1 if they differ
+
+    // States, carried from one day to the next
+    double snow_store[HYMOD_LANES];
+    double XHuz[HYMOD_LANES];
+    double XCuz[HYMOD_LANES];
+    double Xs[HYMOD_LANES];
+    double Xq[HYMOD_MAX_NQ][HYMOD_LANES];
+
+    // Stage times of the run so far, added to the thread's totals with HYMOD_LAPS_FLUSH
+    hymod_stage_laps laps;
+};
+
+// Evaluate up to HYMOD_LANES parameter sets over the forcing of a model instance in lockstep.
+// Only the forcing and the given parameters (Nq, Kv) of the model are used, its states are untouched.
+// parameters[s] holds the 8 parameters of set s in the order used by calc_hymod.
+// If Q is not NULL, Q[s] receives the nDays simulated streamflow values of set s.
+// Results are identical to running calc_hymod on each set separately.
+void calc_hymod_batch(const HyMod *model, double **parameters, int nSets, double **Q);
+
+void init_hymod_batch(hymod_batch *b, const HyMod *model, double **parameters, int nSets);
+void set_hymod_batch_states(hymod_batch *b, int Nq, const hymod_state *states, int nSets);
+void get_hymod_batch_states(const hymod_batch *b, int Nq, hymod_state *states, int nSets);
+void hymod_batch_step(hymod_batch *b, int Nq, double Kv, double precip, double avgTemp, double PE, double *Q);
+void hymod_batch_step_lanes(hymod_batch *b, int Nq, double Kv, const double *precip, const double *avgTemp, const double *PE, double *Q);
+
+// Lean version of calc_hymod_batch: nothing is stored, output(modelDay, Q) is called for
+// each day with the streamflow of every lane (only the first nSets lanes are meaningful).
+// If states is not NULL, set s starts from states[s] and states[s] receives its final states.
+template <class Output>
+void calc_hymod_batch_lean(const HyMod *model, double **parameters, int nSets, Output &output, hymod_state *states = NULL)
+{
+    const hymod_forcing *forcing = model->forcing;
+    hymod_batch b;
+    double Q[HYMOD_LANES];
+
+    init_hymod_batch(&b, model, parameters, nSets);
+    HYMOD_COUNT(COUNT_EVALUATIONS, nSets);
+    HYMOD_COUNT(COUNT_DAYS, (long) nSets*forcing->nDays);
+    if (states != NULL) set_hymod_batch_states(&b, model->parameters.Nq, states, nSets);
+
+    for (int modelDay = 0; modelDay < forcing->nDays; modelDay++)
+    {
+        int dataDay = forcing->startingIndex + modelDay;
+        hymod_batch_step(&b, model->parameters.Nq, model->parameters.Kv, forcing->data.precip[dataDay],
+                         forcing->data.avgTemp[dataDay], forcing->PE[modelDay], Q);
+        output(modelDay, (const double *) Q);
+    }
+    HYMOD_LAPS_FLUSH(b.laps);
+
+    if (states != NULL) get_hymod_batch_states(&b, model->parameters.Nq, states, nSets);
+}
+
+// Run one parameter set over every ensemble member of the forcing (see readMOPEXEnsemble), with the
+// members advanced in lockstep HYMOD_LANES at a time. output(modelDay, Q) is called for each day with
+// the streamflow of the nMembers members, in member order. Each member gives the same results as
+// calc_hymod over a forcing file holding that member alone.
+template <class Output>
+void calc_hymod_ensemble(const HyMod *model, double *parameters, Output &output)
+{
+    const hymod_forcing *forcing = model->forcing;
+    int nMembers = forcing->data.nMembers;
+    int nGroups = (nMembers + HYMOD_LANES - 1) / HYMOD_LANES;
+    vector<hymod_batch> groups(nGroups);
+    vector<double> Q((size_t) nGroups * HYMOD_LANES);
+    double *sets[HYMOD_LANES];
+
+    for (int l = 0; l < HYMOD_LANES; l++) sets[l] = parameters;
+    for (int g = 0; g < nGroups; g++) init_hymod_batch(&groups[g], model, sets, HYMOD_LANES);
+    HYMOD_COUNT(COUNT_EVALUATIONS, nMembers);
+    HYMOD_COUNT(COUNT_DAYS, (long) nMembers*forcing->nDays);
+
+    for (int modelDay = 0; modelDay < forcing->nDays; modelDay++)
+    {
+        size_t dataDay = forcing->startingIndex + modelDay;
+        const double *precip = &forcing->data.memberPrecip[dataDay*nMembers];
+        const double *avgTemp = &forcing->data.memberAvgTemp[dataDay*nMembers];
+        const double *PE = &forcing->memberPE[(size_t) modelDay*nMembers];
+
+        for (int g = 0; g < nGroups; g++)
+        {
+            int first = g*HYMOD_LANES;
+            if (first + HYMOD_LANES <= nMembers)
+            {
+                hymod_batch_step_lanes(&groups[g], model->parameters.Nq, model->parameters.Kv,
+                                       precip + first, avgTemp + first, PE + first, &Q[first]);
+                continue;
+            }
+
+            // The lanes past the last member repeat it
+            double lanePrecip[HYMOD_LANES], laneTemp[HYMOD_LANES], lanePE[HYMOD_LANES];
+            for (int l = 0; l < HYMOD_LANES; l++)
+            {
+                int m = min(first + l, nMembers - 1);
+                lanePrecip[l] = precip[m];
+                laneTemp[l] = avgTemp[m];
+                lanePE[l] = PE[m];
+            }
+            hymod_batch_step_lanes(&groups[g], model->parameters.Nq, model->parameters.Kv, lanePrecip, laneTemp, lanePE, &Q[first]);
+        }
+
+        output(modelDay, (const double *) &Q[0]);
+    }
+    for (int g = 0; g < nGroups; g++) HYMOD_LAPS_FLUSH(groups[g].laps);
+}
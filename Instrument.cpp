@@ -0,0 +1,117 @@
+/*
+Copyright (C) 2010-2013 Jon Herman, Josh Kollat, and others.
+
+Hymod is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Hymod is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with Hymod.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "Instrument.h"
+
+#ifdef HYMOD_INSTRUMENT
+
+#include <iostream>
+#include <iomanip>
+#include <mutex>
+#include <vector>
+#include <signal.h>
+#include <stdlib.h>
+
+using namespace std;
+
+static const char *stage_names[N_STAGES] = {"parse", "PE", "snow", "soil moisture", "routing", "objectives", "output"};
+static const char *counter_names[N_COUNTERS] = {"evaluations", "simulated days", "allocations", "allocated bytes"};
+
+// Blocks of every thread that has recorded something. They are never freed, so the
+// totals of threads that have finished are still included in the summary.
+static mutex registryLock;
+static vector<hymod_thread_counters*> registry;
+
+static volatile sig_atomic_t reportRequested = 0;
+
+hymod_thread_counters *hymod_register_thread()
+{
+    hymod_thread_counters *counters = new hymod_thread_counters();
+    lock_guard<mutex> guard(registryLock);
+    registry.push_back(counters);
+    return counters;
+}
+
+static void request_report(int)
+{
+    reportRequested = 1;
+}
+
+// Add the stage times of a run to the thread's totals and start them again from zero
+void hymod_flush_laps(hymod_stage_laps *laps)
+{
+    hymod_thread_counters *counters = hymod_counters();
+    for (int s = 0; s < N_STAGES; s++)
+    {
+        counters->cycles[s] += laps->cycles[s];
+        counters->calls[s] += laps->calls[s];
+    }
+    *laps = hymod_stage_laps();
+}
+
+static void report_at_exit()
+{
+    hymod_instrument_report();
+}
+
+void hymod_instrument_init()
+{
+    atexit(report_at_exit);
+    signal(SIGUSR1, request_report);
+}
+
+// Printing is not safe inside a signal handler, so the handler only sets a flag that is checked here
+void hymod_instrument_poll()
+{
+    if (!reportRequested) return;
+    reportRequested = 0;
+    hymod_instrument_report();
+}
+
+// Totals are read without stopping the other threads, so a report taken while they run is approximate
+void hymod_instrument_report()
+{
+    uint64_t cycles[N_STAGES] = {0}, calls[N_STAGES] = {0}, counts[N_COUNTERS] = {0};
+    uint64_t totalCycles = 0;
+    {
+        lock_guard<mutex> guard(registryLock);
+        for (size_t t = 0; t < registry.size(); t++)
+        {
+            for (int s = 0; s < N_STAGES; s++)
+            {
+                cycles[s] += registry[t]->cycles[s];
+                calls[s] += registry[t]->calls[s];
+            }
+            for (int c = 0; c < N_COUNTERS; c++) counts[c] += registry[t]->counts[c];
+        }
+    }
+    for (int s = 0; s < N_STAGES; s++) totalCycles += cycles[s];
+
+    cerr << "hymod instrumentation (cycles summed over all threads):" << endl;
+    for (int s = 0; s < N_STAGES; s++)
+    {
+        cerr << "  " << setw(14) << left << stage_names[s] << right << setw(16) << cycles[s] << " cycles "
+             << fixed << setprecision(1) << setw(6) << (totalCycles > 0 ? 100.0*cycles[s]/totalCycles : 0.0) << "% "
+             << setw(14) << calls[s] << " calls " << setw(10) << (calls[s] > 0 ? double(cycles[s])/calls[s] : 0.0)
+             << " cycles/call" << endl;
+    }
+    for (int c = 0; c < N_COUNTERS; c++)
+        cerr << "  " << setw(16) << left << counter_names[c] << right << setw(14) << counts[c] << endl;
+    cerr.unsetf(ios_base::floatfield);
+}
+
+#endif
@@ -0,0 +1,145 @@
+/*
+Copyright (C) 2010-2013 Jon Herman, Josh Kollat, and others.
+
+Hymod is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Hymod is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with Hymod.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef INSTRUMENT_H
+#define INSTRUMENT_H
+
+// Optional instrumentation of the hot paths, enabled by compiling with -DHYMOD_INSTRUMENT.
+// Each stage accumulates the cycles spent in it (time stamp counter where available) and its
+// number of calls; counters track evaluations, simulated days and allocations. The totals of
+// all threads are printed to stderr at exit, or whenever the process receives SIGUSR1.
+// Without HYMOD_INSTRUMENT the macros below expand to nothing.
+
+enum hymod_stage
+{
+    STAGE_PARSE,         //Reading forcing data (readMOPEXData)
+    STAGE_PE,            //Hamon PE series (including the cache lookup)
+    STAGE_SNOW,          //snowDD
+    STAGE_SOIL,          //PDM_soil_moisture
+    STAGE_ROUTING,       //Nash cascades
+    STAGE_OBJECTIVES,    //Updating the objective running sums
+    STAGE_OUTPUT,        //Formatting and writing results
+    N_STAGES
+};
+
+enum hymod_counter
+{
+    COUNT_EVALUATIONS,       //Parameter sets run over the simulation period
+    COUNT_DAYS,              //Simulated days, summed over all evaluations
+    COUNT_ALLOCATIONS,       //Arrays allocated for forcing data, PE and state/flux histories
+    COUNT_ALLOCATED_BYTES,
+    N_COUNTERS
+};
+
+#ifdef HYMOD_INSTRUMENT
+
+#include <stdint.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+inline uint64_t hymod_cycles() { return __rdtsc(); }
+#else
+#include <chrono>
+inline uint64_t hymod_cycles() { return std::chrono::steady_clock::now().time_since_epoch().count(); }
+#endif
+
+// Totals of one thread; threads never share a block, so updates need no locking
+struct hymod_thread_counters
+{
+    uint64_t cycles[N_STAGES];
+    uint64_t calls[N_STAGES];
+    uint64_t counts[N_COUNTERS];
+};
+
+hymod_thread_counters *hymod_register_thread();
+
+inline hymod_thread_counters *hymod_counters()
+{
+    static thread_local hymod_thread_counters *counters = NULL;
+    if (counters == NULL) counters = hymod_register_thread();
+    return counters;
+}
+
+// Print the summary at exit and on SIGUSR1 (checked by hymod_instrument_poll)
+void hymod_instrument_init();
+void hymod_instrument_poll();
+void hymod_instrument_report();
+
+// Times of the stages run every day (snow, soil moisture, routing, objectives), kept by each
+// model run and added to the thread's totals once at the end. Reading the time stamp counter
+// costs about as much as a stage, so only one day in HYMOD_LAP_INTERVAL is timed and its cycles
+// are scaled up; every call is still counted.
+#define HYMOD_LAP_INTERVAL 16
+
+struct hymod_stage_laps
+{
+    uint64_t last;
+    bool timing;        //Whether the current day is timed
+    unsigned days;
+    uint64_t cycles[N_STAGES];
+    uint64_t calls[N_STAGES];
+};
+
+inline void hymod_laps_start(hymod_stage_laps *laps)
+{
+    laps->timing = (laps->days++ % HYMOD_LAP_INTERVAL == 0);
+    if (laps->timing) laps->last = hymod_cycles();
+}
+
+// Charge the cycles since the previous lap (or HYMOD_LAPS_START) to stage
+inline void hymod_lap(hymod_stage_laps *laps, int stage)
+{
+    laps->calls[stage]++;
+    if (!laps->timing) return;
+
+    uint64_t now = hymod_cycles();
+    laps->cycles[stage] += (now - laps->last)*HYMOD_LAP_INTERVAL;
+    laps->last = now;
+}
+
+void hymod_flush_laps(hymod_stage_laps *laps);
+
+#define HYMOD_STAGE_BEGIN(stage) uint64_t hymod_start_##stage = hymod_cycles()
+#define HYMOD_STAGE_END(stage) do { \
+        hymod_thread_counters *hymod_c = hymod_counters(); \
+        hymod_c->cycles[stage] += hymod_cycles() - hymod_start_##stage; \
+        hymod_c->calls[stage]++; \
+    } while (0)
+#define HYMOD_COUNT(counter, n) (hymod_counters()->counts[counter] += (n))
+#define HYMOD_LAPS_INIT(laps) ((laps) = hymod_stage_laps())
+#define HYMOD_LAPS_START(laps) hymod_laps_start(&(laps))
+#define HYMOD_LAP(laps, stage) hymod_lap(&(laps), stage)
+#define HYMOD_LAPS_FLUSH(laps) hymod_flush_laps(&(laps))
+#define HYMOD_INSTRUMENT_INIT() hymod_instrument_init()
+#define HYMOD_INSTRUMENT_POLL() hymod_instrument_poll()
+
+#else
+
+struct hymod_stage_laps {};
+
+#define HYMOD_STAGE_BEGIN(stage)
+#define HYMOD_STAGE_END(stage) do {} while (0)
+#define HYMOD_COUNT(counter, n) do {} while (0)
+#define HYMOD_LAPS_INIT(laps) ((void) (laps))
+#define HYMOD_LAPS_START(laps) ((void) (laps))
+#define HYMOD_LAP(laps, stage) ((void) (laps))
+#define HYMOD_LAPS_FLUSH(laps) ((void) (laps))
+#define HYMOD_INSTRUMENT_INIT() do {} while (0)
+#define HYMOD_INSTRUMENT_POLL() do {} while (0)
+
+#endif
+
+#endif
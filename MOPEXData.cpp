@@ -19,105 +19,634 @@ along with Hymod.  If not, see <http://www.gnu.org/licenses/>.
 #include <string>
 #include <fstream>
 #include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <vector>
+#include <algorithm>
+#include <charconv>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "MOPEXData.h"
+#include "Instrument.h"
 
 using namespace std;
 
-//Function to read in the MOPEX data (precip, flow, temp, AE, etc.)
-void readMOPEXData(MOPEXData *data, string filename)
+// Layout of the binary files: this header followed by the data columns, each starting on a 64-byte boundary.
+// Numbers are stored in the byte order of the machine that wrote the file.
+struct mopex_binary_header
 {
-    ifstream in;
-    string sJunk = "";
-    int ijunk;
-    double dTemp;
+    char magic[8];          //"HYMODBIN"
+    uint32_t version;
+    uint32_t byteOrder;     //MOPEX_BYTE_ORDER as written by the machine that wrote the file
+    int32_t nDays;
+    int32_t stepsPerDay;    //0 in files written before sub-daily data was supported, read as 1
+    char ID[32];
+    double gageLat;
+    double gageLong;
+    double DA;
+    uint64_t offset[7];     //File offsets of the precip, evap, flow, maxTemp, minTemp, avgTemp and date columns
+};
 
-    in.open(filename.c_str(), ios_base::in);
-    if(!in)
+const char MOPEX_MAGIC[8] = {'H','Y','M','O','D','B','I','N'};
+const uint32_t MOPEX_VERSION = 1;
+const uint32_t MOPEX_BYTE_ORDER = 0x01020304;
+const int MOPEX_COLUMNS = 7;
+
+static uint64_t align64(uint64_t offset)
+{
+    return (offset + 63) & ~uint64_t(63);
+}
+
+// Sizes of the columns in the binary file, in the order of the header offsets
+static void column_sizes(int nDays, uint64_t *sizes)
+{
+    for (int c = 0; c < MOPEX_COLUMNS-1; c++) sizes[c] = uint64_t(nDays)*sizeof(double);
+    sizes[MOPEX_COLUMNS-1] = uint64_t(nDays)*3*sizeof(int);
+}
+
+// Map a binary file written by writeMOPEXBinary, or a shared memory segment written by publishMOPEXShared
+// (named shm:/name). Returns false if the file is not in that format.
+static bool readMOPEXBinary(MOPEXData *data, string filename)
+{
+    int fd = (filename.compare(0, 4, "shm:") == 0) ? shm_open(filename.c_str() + 4, O_RDONLY, 0) : open(filename.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat info;
+    mopex_binary_header header;
+    if (fstat(fd, &info) != 0 || size_t(info.st_size) < sizeof(header) ||
+        pread(fd, &header, sizeof(header), 0) != ssize_t(sizeof(header)) ||
+        memcmp(header.magic, MOPEX_MAGIC, sizeof(MOPEX_MAGIC)) != 0)
     {
-        cout << "The input file specified: " << filename << " could not be found!" << endl;
+        close(fd);
+        return false;
+    }
+
+    if (header.version != MOPEX_VERSION || header.byteOrder != MOPEX_BYTE_ORDER || header.nDays < 0)
+    {
+        cout << "The binary input file " << filename << " was written by an incompatible version or machine, convert it again from the text file" << endl;
         exit(1);
     }
 
-    //Look for the <GAGE_ID> key
-    while (sJunk != "<GAGE_ID>")
+    uint64_t sizes[MOPEX_COLUMNS];
+    column_sizes(header.nDays, sizes);
+    for (int c = 0; c < MOPEX_COLUMNS; c++)
     {
-        in >> sJunk;
+        if (header.offset[c] % 8 != 0 || header.offset[c] + sizes[c] > uint64_t(info.st_size))
+        {
+            cout << "The binary input file " << filename << " is truncated or corrupt" << endl;
+            exit(1);
+        }
     }
-    in >> data->ID;
-    //Return to the beginning of the file
-    in.seekg(0, ios::beg);
 
-    //Look for the <GAGE_LATITUDE> key
-    while (sJunk != "<GAGE_LATITUDE>")
+    void *mapping = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
     {
-        in >> sJunk;
+        cout << "The binary input file " << filename << " could not be mapped into memory" << endl;
+        exit(1);
     }
-    in >> data->gageLat;
-    //Return to the beginning of the file
-    in.seekg(0, ios::beg);
 
-    //Look for the <GAGE_LONGITUDE> key
-    while (sJunk != "<GAGE_LONGITUDE>")
+    char *base = (char *) mapping;
+    data->ID = string(header.ID, strnlen(header.ID, sizeof(header.ID)));
+    data->gageLat  = header.gageLat;
+    data->gageLong = header.gageLong;
+    data->DA       = header.DA;
+    data->nDays    = header.nDays;
+    data->stepsPerDay = (header.stepsPerDay > 0) ? header.stepsPerDay : 1;
+    data->precip   = (double *) (base + header.offset[0]);
+    data->evap     = (double *) (base + header.offset[1]);
+    data->flow     = (double *) (base + header.offset[2]);
+    data->maxTemp  = (double *) (base + header.offset[3]);
+    data->minTemp  = (double *) (base + header.offset[4]);
+    data->avgTemp  = (double *) (base + header.offset[5]);
+    data->date     = (int (*)[3]) (base + header.offset[6]);
+    data->mapping = mapping;
+    data->mappingSize = info.st_size;
+    return true;
+}
+
+// Fill in the header of the binary image of the data and the sizes of its columns, returning its total size
+static uint64_t binary_layout(const MOPEXData *data, mopex_binary_header *header, uint64_t *sizes)
+{
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, MOPEX_MAGIC, sizeof(MOPEX_MAGIC));
+    header->version   = MOPEX_VERSION;
+    header->byteOrder = MOPEX_BYTE_ORDER;
+    header->nDays     = data->nDays;
+    header->stepsPerDay = data->stepsPerDay;
+    strncpy(header->ID, data->ID.c_str(), sizeof(header->ID)-1);
+    header->gageLat   = data->gageLat;
+    header->gageLong  = data->gageLong;
+    header->DA        = data->DA;
+
+    column_sizes(data->nDays, sizes);
+    uint64_t offset = align64(sizeof(*header));
+    for (int c = 0; c < MOPEX_COLUMNS; c++)
     {
-        in >> sJunk;
+        header->offset[c] = offset;
+        offset = offset + sizes[c];
+        if (c < MOPEX_COLUMNS-1) offset = align64(offset);
     }
-    in >> data->gageLong;
-    //Return to the beginning of the file
-    in.seekg(0, ios::beg);
+    return offset;
+}
+
+// The data columns, in the order of the header offsets
+static void binary_columns(const MOPEXData *data, const char **columns)
+{
+    columns[0] = (const char *) data->precip;
+    columns[1] = (const char *) data->evap;
+    columns[2] = (const char *) data->flow;
+    columns[3] = (const char *) data->maxTemp;
+    columns[4] = (const char *) data->minTemp;
+    columns[5] = (const char *) data->avgTemp;
+    columns[6] = (const char *) data->date;
+}
 
-    //Look for the <DRAINAGE_AREA> key
-    while (sJunk != "<DRAINAGE_AREA>")
+//Write the data to a columnar binary file that readMOPEXData can map without parsing
+void writeMOPEXBinary(const MOPEXData *data, string filename)
+{
+    mopex_binary_header header;
+    uint64_t sizes[MOPEX_COLUMNS];
+    const char *columns[MOPEX_COLUMNS];
+    binary_layout(data, &header, sizes);
+    binary_columns(data, columns);
+
+    ofstream out(filename.c_str(), ios_base::out | ios_base::binary);
+    if (!out)
     {
-        in >> sJunk;
+        cout << "The output file specified: " << filename << " could not be opened!" << endl;
+        exit(1);
     }
-    in >> data->DA;
-    //Return to the beginning of the file
-    in.seekg(0, ios::beg);
 
-    //Look for the <TIME_STEPS> key
-    while (sJunk != "<TIME_STEPS>")
+    const char zeros[64] = {0};
+    out.write((const char *) &header, sizeof(header));
+    uint64_t position = sizeof(header);
+    for (int c = 0; c < MOPEX_COLUMNS; c++)
     {
-        in >> sJunk;
+        out.write(zeros, header.offset[c] - position);
+        out.write(columns[c], sizes[c]);
+        position = header.offset[c] + sizes[c];
+    }
+
+    if (!out)
+    {
+        cout << "Could not write the binary file " << filename << endl;
+        exit(1);
+    }
+}
+
+//Place the binary image of the data in a POSIX shared memory object. The name must not be in use,
+//so a segment that another process has published (or left behind) is never replaced.
+void publishMOPEXShared(const MOPEXData *data, string name)
+{
+    mopex_binary_header header;
+    uint64_t sizes[MOPEX_COLUMNS];
+    const char *columns[MOPEX_COLUMNS];
+    uint64_t size = binary_layout(data, &header, sizes);
+    binary_columns(data, columns);
+
+    int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0 && errno == EEXIST)
+    {
+        cout << "The shared memory segment " << name << " already exists" << endl;
+        exit(1);
+    }
+    if (fd < 0 || ftruncate(fd, size) != 0)
+    {
+        if (fd >= 0) close(fd);
+        shm_unlink(name.c_str());
+        cout << "The shared memory segment " << name << " could not be created" << endl;
+        exit(1);
+    }
+
+    void *mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        shm_unlink(name.c_str());
+        cout << "The shared memory segment " << name << " could not be mapped into memory" << endl;
+        exit(1);
     }
-    in >> data->nDays;
-    //Return to the beginning of the file
-    in.seekg(0, ios::beg);
 
-    //Allocate the arrays
-    data->date = new int* [data->nDays];
-    for (int i=0; i<data->nDays; i++) data->date[i] = new int[3];
-    data->precip   = new double[data->nDays];
-    data->evap     = new double[data->nDays];
-    data->flow     = new double[data->nDays];
-    data->maxTemp  = new double[data->nDays];
-    data->minTemp  = new double[data->nDays];
-    data->avgTemp  = new double[data->nDays];
+    // The segment starts zeroed, so the padding between columns needs no writes
+    char *base = (char *) mapping;
+    memcpy(base, &header, sizeof(header));
+    for (int c = 0; c < MOPEX_COLUMNS; c++) memcpy(base + header.offset[c], columns[c], sizes[c]);
+    munmap(mapping, size);
+}
+
+//Free the arrays (or unmap the binary file)
+void freeMOPEXData(MOPEXData *data)
+{
+    if (data->nMembers > 0)
+    {
+        delete[] data->memberPrecip;
+        delete[] data->memberAvgTemp;
+        data->nMembers = 0;
+    }
 
-    //Look for the <DATA_START> key
-    while (sJunk != "<DATA_START>")
+    if (data->mapping != NULL)
     {
-        in >> sJunk;
+        munmap(data->mapping, data->mappingSize);
+        data->mapping = NULL;
+        return;
     }
-    
+
+    delete[] data->date;
+    delete[] data->precip;
+    delete[] data->evap;
+    delete[] data->flow;
+    delete[] data->maxTemp;
+    delete[] data->minTemp;
+    delete[] data->avgTemp;
+}
+
+// Cursor over the text of a MOPEX file held in memory
+struct mopex_text
+{
+    const char *pos;
+    const char *end;
+    int line;
+    string filename;
+    const char *endName;    //"file", or "line" when the text is parsed a row at a time
+};
+
+static void parse_error(const mopex_text *text, string message)
+{
+    cout << "Error reading " << text->filename << " (line " << text->line << "): " << message << endl;
+    exit(1);
+}
+
+static void skip_whitespace(mopex_text *text)
+{
+    while (text->pos < text->end && isspace((unsigned char) *text->pos))
+    {
+        if (*text->pos == '\n') text->line++;
+        text->pos++;
+    }
+}
+
+static void skip_line(mopex_text *text)
+{
+    const char *newline = (const char *) memchr(text->pos, '\n', text->end - text->pos);
+    text->pos = (newline != NULL) ? newline : text->end;
+}
+
+// Next whitespace-separated token, or an empty string at the end of the file
+static string next_token(mopex_text *text)
+{
+    skip_whitespace(text);
+    const char *start = text->pos;
+    while (text->pos < text->end && !isspace((unsigned char) *text->pos)) text->pos++;
+    return string(start, text->pos - start);
+}
+
+static double next_number(mopex_text *text, const char *what)
+{
+    double value;
+
+    skip_whitespace(text);
+    if (text->pos < text->end && *text->pos == '+') text->pos++; // from_chars does not take a leading plus sign
+
+    from_chars_result result = from_chars(text->pos, text->end, value);
+    if (result.ec != errc())
+    {
+        if (text->pos >= text->end) parse_error(text, string("unexpected end of ") + text->endName + ", expected " + what);
+        parse_error(text, string("expected ") + what + ", found \"" + next_token(text) + "\"");
+    }
+
+    text->pos = result.ptr;
+    return value;
+}
+
+// Largest number of time steps per day accepted (one per minute)
+const int MOPEX_MAX_STEPS_PER_DAY = 1440;
+
+// Read the header keys, up to and including the line of the <DATA_START> key
+static void parse_header(mopex_text *text, MOPEXData *data)
+{
+    const char *keys[] = {"<GAGE_ID>", "<GAGE_LATITUDE>", "<GAGE_LONGITUDE>", "<DRAINAGE_AREA>", "<TIME_STEPS>", "<STEPS_PER_DAY>"};
+    const int nKeys = 6;
+    const int nRequired = 5;    //<STEPS_PER_DAY> is optional
+    bool found[nKeys] = {false, false, false, false, false, false};
+    string token;
+
+    data->stepsPerDay = 1;
+
+    while ((token = next_token(text)) != "<DATA_START>")
+    {
+        if (token.empty()) parse_error(text, "the <DATA_START> key was not found");
+        if (token[0] != '<') continue;
+
+        int k = 0;
+        while (k < nKeys && token != keys[k]) k++;
+        if (k == nKeys) continue;
+
+        switch (k)
+        {
+            case 0: data->ID = next_token(text); break;
+            case 1: data->gageLat = next_number(text, "the gage latitude"); break;
+            case 2: data->gageLong = next_number(text, "the gage longitude"); break;
+            case 3: data->DA = next_number(text, "the drainage area"); break;
+            case 4: data->nDays = int(next_number(text, "the number of time steps")); break;
+            case 5: data->stepsPerDay = int(next_number(text, "the number of time steps per day")); break;
+        }
+        found[k] = true;
+    }
+
+    for (int k = 0; k < nRequired; k++)
+        if (!found[k]) parse_error(text, string("the ") + keys[k] + " key must appear before <DATA_START>");
+    if (data->nDays < 0) parse_error(text, "the number of time steps is negative");
+    if (data->stepsPerDay < 1 || data->stepsPerDay > MOPEX_MAX_STEPS_PER_DAY || 24*60 % data->stepsPerDay != 0)
+        parse_error(text, "the number of time steps per day must divide a day into whole minutes");
+
     //Once we found the key, ignore the rest of the line and move to the data
-    in.ignore(1000,'\n');
+    skip_line(text);
+}
+
+static void allocate_columns(MOPEXData *data, int nSteps)
+{
+    data->date = new int [nSteps][3];
+    data->precip   = new double[nSteps];
+    data->evap     = new double[nSteps];
+    data->flow     = new double[nSteps];
+    data->maxTemp  = new double[nSteps];
+    data->minTemp  = new double[nSteps];
+    data->avgTemp  = new double[nSteps];
+    HYMOD_COUNT(COUNT_ALLOCATIONS, 7);
+    HYMOD_COUNT(COUNT_ALLOCATED_BYTES, (3*sizeof(int) + 6*sizeof(double))*nSteps);
+}
+
+// Read row i of the data in this order (anything after the 8th column is ignored):
+static void parse_row(mopex_text *text, MOPEXData *data, int i)
+{
+    data->date[i][0] = int(next_number(text, "the year"));
+    data->date[i][1] = int(next_number(text, "the month"));
+    data->date[i][2] = int(next_number(text, "the day"));
+    data->precip[i]  = next_number(text, "the precipitation");
+    data->evap[i]    = next_number(text, "the potential evaporation");
+    data->flow[i]    = next_number(text, "the streamflow");
+    data->maxTemp[i] = next_number(text, "the maximum temperature");
+    data->minTemp[i] = next_number(text, "the minimum temperature");
+    skip_line(text);
+    //While we're at it, calculate average T
+    data->avgTemp[i] = (data->maxTemp[i] + data->minTemp[i])/2.0;
+}
 
-    //Loop through all of the input data and read in this order:
-    for (int i=0; i<data->nDays; i++)
+// Parse MOPEX text in a single pass: header keys first, up to <DATA_START>, then one row per time step
+static void readMOPEXText(MOPEXData *data, string filename)
+{
+    ifstream in(filename.c_str(), ios_base::in | ios_base::binary);
+    if(!in)
     {
-        in >> dTemp;
-        data->date[i][0] = int(dTemp);
-        in >> dTemp;
-        data->date[i][1] = int(dTemp);
-        in >> dTemp;
-        data->date[i][2] = int(dTemp);
-        in >> data->precip[i] >> data->evap[i] >> data->flow[i] >> data->maxTemp[i] >> data->minTemp[i];
-        in.ignore(1000,'\n');
-        //While we're at it, calculate average T
-        data->avgTemp[i] = (data->maxTemp[i] + data->minTemp[i])/2.0;
+        cout << "The input file specified: " << filename << " could not be found!" << endl;
+        exit(1);
     }
 
+    //Read the whole file into memory at once
+    in.seekg(0, ios::end);
+    size_t size = in.tellg();
+    in.seekg(0, ios::beg);
+    vector<char> buffer(size);
+    if (size > 0) in.read(&buffer[0], size);
+    if (!in)
+    {
+        cout << "The input file specified: " << filename << " could not be read!" << endl;
+        exit(1);
+    }
     in.close();
+
+    mopex_text text;
+    text.pos = buffer.data();
+    text.end = text.pos + size;
+    text.line = 1;
+    text.filename = filename;
+    text.endName = "file";
+
+    parse_header(&text, data);
+    allocate_columns(data, data->nDays);
+
+    for (int i=0; i<data->nDays; i++) parse_row(&text, data, i);
+
     return;
 }
+
+//Function to read in the MOPEX data (precip, flow, temp, AE, etc.)
+void readMOPEXData(MOPEXData *data, string filename)
+{
+    data->mapping = NULL;
+    data->mappingSize = 0;
+    data->nMembers = 0;
+    data->memberPrecip = data->memberAvgTemp = NULL;
+
+    //Use the binary cache directly if that is what we were given
+    HYMOD_STAGE_BEGIN(STAGE_PARSE);
+    if (!readMOPEXBinary(data, filename)) readMOPEXText(data, filename);
+    HYMOD_STAGE_END(STAGE_PARSE);
+    return;
+}
+
+//Read the ensemble members of a forcing, one file per member (text or binary) with the same dates
+void readMOPEXEnsemble(MOPEXData *data, const vector<string> &memberFiles)
+{
+    int nMembers = memberFiles.size();
+    if (nMembers == 0)
+    {
+        cout << "The ensemble has no members" << endl;
+        exit(1);
+    }
+
+    readMOPEXData(data, memberFiles[0]);
+    size_t nSteps = data->nDays;
+    double *memberPrecip = new double[nSteps*nMembers];
+    double *memberAvgTemp = new double[nSteps*nMembers];
+    HYMOD_COUNT(COUNT_ALLOCATIONS, 2);
+    HYMOD_COUNT(COUNT_ALLOCATED_BYTES, 2*sizeof(double)*nSteps*nMembers);
+
+    for (int m = 0; m < nMembers; m++)
+    {
+        MOPEXData member;
+        if (m > 0) readMOPEXData(&member, memberFiles[m]);
+        else member = *data;
+
+        if (member.nDays != data->nDays || member.stepsPerDay != data->stepsPerDay ||
+            (nSteps > 0 && memcmp(member.date, data->date, nSteps*sizeof(data->date[0])) != 0))
+        {
+            cout << "The ensemble member " << memberFiles[m] << " does not have the same time steps as " << memberFiles[0] << endl;
+            exit(1);
+        }
+
+        //Interleave the members, so that each step has the values of all members side by side
+        for (size_t i = 0; i < nSteps; i++)
+        {
+            memberPrecip[i*nMembers + m] = member.precip[i];
+            memberAvgTemp[i*nMembers + m] = member.avgTemp[i];
+        }
+
+        if (m > 0) freeMOPEXData(&member);
+    }
+
+    data->nMembers = nMembers;
+    data->memberPrecip = memberPrecip;
+    data->memberAvgTemp = memberAvgTemp;
+}
+
+// Size of the window of a text file held by a stream (grown if a single line does not fit)
+const size_t MOPEX_STREAM_BUFFER = 1 << 20;
+
+//Open a forcing file (text or binary) for reading chunkSteps time steps at a time
+void openMOPEXStream(MOPEXStream *stream, string filename, int chunkSteps)
+{
+    stream->filename = filename;
+    stream->chunkSteps = max(chunkSteps, 1);
+    stream->position = 0;
+    stream->file.mapping = NULL;
+    stream->file.nMembers = 0;
+    stream->data.mapping = NULL;
+    stream->data.mappingSize = 0;
+    stream->data.nMembers = 0;
+
+    HYMOD_STAGE_BEGIN(STAGE_PARSE);
+    stream->binary = readMOPEXBinary(&stream->file, filename);
+    if (stream->binary)
+    {
+        //The chunks are views of the mapping, which is only read once and front to back
+        madvise(stream->file.mapping, stream->file.mappingSize, MADV_SEQUENTIAL);
+        stream->data = stream->file;
+        stream->data.mapping = NULL;
+        stream->totalSteps = stream->file.nDays;
+        stream->data.nDays = 0;
+        HYMOD_STAGE_END(STAGE_PARSE);
+        return;
+    }
+
+    stream->in.open(filename.c_str(), ios_base::in | ios_base::binary);
+    if (!stream->in)
+    {
+        cout << "The input file specified: " << filename << " could not be found!" << endl;
+        exit(1);
+    }
+
+    //The header is read line by line, up to the line of the <DATA_START> key
+    string header, line;
+    stream->line = 1;
+    while (getline(stream->in, line))
+    {
+        header += line;
+        header += '\n';
+        stream->line++;
+        if (line.find("<DATA_START>") != string::npos) break;
+    }
+
+    mopex_text text;
+    text.pos = header.data();
+    text.end = text.pos + header.size();
+    text.line = 1;
+    text.filename = filename;
+    text.endName = "file";
+    parse_header(&text, &stream->data);
+
+    stream->totalSteps = stream->data.nDays;
+    stream->data.nDays = 0;
+    allocate_columns(&stream->data, stream->chunkSteps);
+
+    stream->buffer.resize(MOPEX_STREAM_BUFFER);
+    stream->bufferStart = stream->bufferEnd = 0;
+    HYMOD_STAGE_END(STAGE_PARSE);
+}
+
+// Make sure the buffer holds a whole line from bufferStart (or the rest of the file), returning its length
+static size_t next_stream_line(MOPEXStream *stream)
+{
+    size_t searched = 0;
+
+    while (true)
+    {
+        const char *start = stream->buffer.data() + stream->bufferStart;
+        size_t available = stream->bufferEnd - stream->bufferStart;
+        const char *newline = (const char *) memchr(start + searched, '\n', available - searched);
+        if (newline != NULL) return newline - start + 1;
+        if (!stream->in) return available;
+        searched = available;
+
+        //Move the partial line to the front of the buffer and read more after it
+        memmove(stream->buffer.data(), start, available);
+        stream->bufferStart = 0;
+        stream->bufferEnd = available;
+        if (available == stream->buffer.size()) stream->buffer.resize(2*stream->buffer.size());
+
+        stream->in.read(stream->buffer.data() + available, stream->buffer.size() - available);
+        stream->bufferEnd += stream->in.gcount();
+    }
+}
+
+//Read the next chunk into stream->data, returning its number of steps (0 at the end of the file)
+int readMOPEXChunk(MOPEXStream *stream)
+{
+    stream->position += stream->data.nDays;
+    int nSteps = min(stream->chunkSteps, stream->totalSteps - stream->position);
+    stream->data.nDays = nSteps;
+    if (nSteps <= 0) return 0;
+
+    if (stream->binary)
+    {
+        MOPEXData *file = &stream->file;
+        int first = stream->position;
+        stream->data.date    = file->date + first;
+        stream->data.precip  = file->precip + first;
+        stream->data.evap    = file->evap + first;
+        stream->data.flow    = file->flow + first;
+        stream->data.maxTemp = file->maxTemp + first;
+        stream->data.minTemp = file->minTemp + first;
+        stream->data.avgTemp = file->avgTemp + first;
+        return nSteps;
+    }
+
+    HYMOD_STAGE_BEGIN(STAGE_PARSE);
+    mopex_text text;
+    text.filename = stream->filename;
+    text.endName = "line";
+
+    int i = 0;
+    while (i < nSteps)
+    {
+        size_t length = next_stream_line(stream);
+        text.pos = stream->buffer.data() + stream->bufferStart;
+        text.end = text.pos + length;
+        text.line = stream->line;
+
+        if (length == 0)
+        {
+            text.endName = "file";
+            parse_error(&text, "unexpected end of file, expected the year");
+        }
+
+        //Blank lines between the rows are skipped
+        skip_whitespace(&text);
+        if (text.pos < text.end) parse_row(&text, &stream->data, i++);
+
+        stream->bufferStart += length;
+        stream->line++;
+    }
+    HYMOD_STAGE_END(STAGE_PARSE);
+
+    return nSteps;
+}
+
+void closeMOPEXStream(MOPEXStream *stream)
+{
+    if (stream->binary)
+    {
+        freeMOPEXData(&stream->file);
+        return;
+    }
+
+    freeMOPEXData(&stream->data);
+    stream->in.close();
+    stream->buffer = vector<char>();
+}
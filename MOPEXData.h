@@ -15,10 +15,14 @@ You should have received a copy of the GNU Lesser General Public License
 along with Hymod.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#ifndef MOPEXDATA_H
+#define MOPEXDATA_H
+
 #include <iostream>
 #include <string>
 #include <fstream>
 #include <cstdlib>
+#include <vector>
 
 using namespace std;
 
@@ -29,15 +33,71 @@ struct MOPEXData
     double gageLong;
     double DA;
 
-    int nDays;          //Number of days of data
-    int **date;         //Date of data [year, month, day]
+    int nDays;          //Number of time steps of data (days, unless stepsPerDay > 1)
+    int stepsPerDay;    //Time steps per day (<STEPS_PER_DAY>, 1 if not given), each date repeats this many times
+    int (*date)[3];     //Date of data [year, month, day]
     double *precip;     //Mean areal precipitation (mm)
     double *evap;       //Climatic potential evaporation (mm)
     double *flow;       //Streamflow discharge (mm)
     double *maxTemp;    //Maximum air temperature (Celsius) (should be daily)
     double *minTemp;    //Minimum air temperature (Celsius) (should be daily)
     double *avgTemp;    //Average air temperature (Celsius) (should be daily)
+
+    // Ensemble members (see readMOPEXEnsemble), stored member-contiguous: the values of all members
+    // for step i are at [i*nMembers, (i+1)*nMembers). The arrays above hold the first member.
+    int nMembers;           //0 if the data is a single trace
+    double *memberPrecip;
+    double *memberAvgTemp;
+
+    void *mapping;      //Memory-mapped binary file the arrays point into (NULL if read from text)
+    size_t mappingSize;
 };
 
 //Function to read in the MOPEX data (precip, flow, temp, AE, etc.)
+//Binary files written by writeMOPEXBinary are memory-mapped, anything else is parsed as MOPEX text.
+//A filename of the form shm:/name maps the shared memory segment written by publishMOPEXShared.
 void readMOPEXData(MOPEXData *data, string filename);
+
+//Read the ensemble members of a forcing, one file per member (text or binary) with the same dates.
+//The header values, observed flow and climatic evaporation are those of the first member.
+void readMOPEXEnsemble(MOPEXData *data, const vector<string> &memberFiles);
+
+//Write the data to a columnar binary file that readMOPEXData can map without parsing
+void writeMOPEXBinary(const MOPEXData *data, string filename);
+
+//Publish the data in the binary format as the POSIX shared memory segment name (e.g. /hymod.1234.08167500),
+//so that any number of processes can map one copy of it with readMOPEXData("shm:" + name).
+//The segment must not exist yet, so a segment in use by another process is never replaced.
+void publishMOPEXShared(const MOPEXData *data, string name);
+
+//Free the arrays (or unmap the binary file)
+void freeMOPEXData(MOPEXData *data);
+
+// Forcing data read a chunk of time steps at a time, so that memory use does not depend on the
+// length of the record. data holds the header values and the current chunk (data.nDays steps).
+struct MOPEXStream
+{
+    MOPEXData data;
+    int totalSteps;         //Time steps in the whole file
+    int position;           //Index in the file of the first step of the current chunk
+    int chunkSteps;         //Largest number of steps in a chunk
+
+    MOPEXData file;         //Binary files: the mapped file, chunks point into it
+    bool binary;
+
+    ifstream in;            //Text files: a window of the file, refilled as the rows are parsed
+    vector<char> buffer;
+    size_t bufferStart, bufferEnd;
+    int line;
+    string filename;
+};
+
+//Open a forcing file (text or binary) for reading chunkSteps time steps at a time
+void openMOPEXStream(MOPEXStream *stream, string filename, int chunkSteps);
+
+//Read the next chunk into stream->data, returning its number of steps (0 at the end of the file)
+int readMOPEXChunk(MOPEXStream *stream);
+
+void closeMOPEXStream(MOPEXStream *stream);
+
+#endif
@@ -0,0 +1,131 @@
+/*
+Copyright (C) 2010-2013 Jon Herman, Josh Kollat, and others.
+
+Hymod is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Hymod is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with Hymod.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "MultiBasin.h"
+#include "HyModBatch.h"
+#include "Objectives.h"
+#include "ThreadPool.h"
+
+vector<string> read_basin_manifest(string manifestFile)
+{
+    ifstream in(manifestFile.c_str(), ios_base::in);
+    if (!in)
+    {
+        cout << "The basin manifest specified: " << manifestFile << " could not be found!" << endl;
+        exit(1);
+    }
+
+    vector<string> files;
+    string line;
+    while (getline(in, line))
+    {
+        size_t start = line.find_first_not_of(" \t\r");
+        if (start == string::npos || line[start] == '#') continue;
+        size_t end = line.find_last_not_of(" \t\r");
+        files.push_back(line.substr(start, end - start + 1));
+    }
+    return files;
+}
+
+// Everything needed to evaluate parameter sets on one basin
+struct basin_run
+{
+    hymod_forcing forcing;
+    HyMod model;
+    objective_config objectives;
+    vector<double> results;     //Objectives of each sample
+};
+
+void run_multi_basin(const multi_basin_config &config, const vector<string> &basinFiles,
+                     const vector<double> &parameters, ostream &out)
+{
+    const int nParams = 8;
+    int nSets = parameters.size() / nParams;
+    int batchesPerBasin = (nSets + HYMOD_LANES - 1) / HYMOD_LANES;
+    int nBasins = basinFiles.size();
+
+    // The workers must not exit, so the settings they use are checked here and each basin is read below
+    check_hymod_nq(config.Nq);
+
+    ThreadPool pool(config.nThreads);
+    int basinsPerRound = pool.size();
+
+    // Header row
+    vector<string> names;
+    stringstream list(config.metricList);
+    string name;
+    while (getline(list, name, ',')) names.push_back(name);
+    out << "basin\tsample";
+    for (size_t i = 0; i < names.size(); i++) out << "\t" << names[i];
+    out << endl;
+
+    for (int first = 0; first < nBasins; first += basinsPerRound)
+    {
+        int nRound = min(basinsPerRound, nBasins - first);
+        vector<basin_run> runs(nRound);
+
+        // Read the basins of this round on this thread, so that a bad file or a period it does not cover
+        // is reported (naming the file) before any worker starts; each derives its period from its own dates
+        for (int b = 0; b < nRound; b++)
+        {
+            basin_run &run = runs[b];
+            init_hymod_forcing_dates(&run.forcing, basinFiles[first + b], config.startDate, config.endDate);
+            init_objectives(&run.objectives, &run.forcing, config.metricList, config.warmup);
+            run.results.resize((size_t) nSets * run.objectives.metrics.size());
+        }
+
+        // Set up the models (including their PE series) in parallel
+        pool.run(nRound, [&](int b, int) {
+            init_hymod(&runs[b].model, &runs[b].forcing, false, config.Nq, config.pdmKernel);
+        });
+
+        // Tasks are ordered basin by basin, so the contiguous block each worker starts with covers one basin
+        pool.run(nRound * batchesPerBasin, [&](int task, int) {
+            basin_run &run = runs[task / batchesPerBasin];
+            int batch = task % batchesPerBasin;
+            int firstSet = batch * HYMOD_LANES;
+            int n = min(HYMOD_LANES, nSets - firstSet);
+            double *sets[HYMOD_LANES];
+
+            for (int s = 0; s < n; s++) sets[s] = (double *) &parameters[(size_t) (firstSet + s) * nParams];
+            evaluate_objectives(&run.model, run.objectives, sets, n, &run.results[(size_t) firstSet * run.objectives.metrics.size()]);
+        });
+
+        HYMOD_STAGE_BEGIN(STAGE_OUTPUT);
+        for (int b = 0; b < nRound; b++)
+        {
+            basin_run &run = runs[b];
+            size_t nObjectives = run.objectives.metrics.size();
+
+            for (int s = 0; s < nSets; s++)
+            {
+                out << run.forcing.data.ID << "\t" << s;
+                for (size_t i = 0; i < nObjectives; i++) out << "\t" << run.results[s*nObjectives + i];
+                out << "\n";
+            }
+
+            hymod_delete(&run.model);
+            delete_hymod_forcing(&run.forcing);
+        }
+        out.flush();
+        HYMOD_STAGE_END(STAGE_OUTPUT);
+        HYMOD_INSTRUMENT_POLL();
+
+        // The PE series of this round's basins are not needed again
+        clear_hamon_cache();
+    }
+}
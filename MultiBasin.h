@@ -0,0 +1,47 @@
+/*
+Copyright (C) 2010-2013 Jon Herman, Josh Kollat, and others.
+
+Hymod is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Hymod is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with Hymod.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef MULTIBASIN_H
+#define MULTIBASIN_H
+
+#include <vector>
+
+#include "HyMod.h"
+
+// Settings shared by every basin of a multi-basin run
+struct multi_basin_config
+{
+    int startDate[3];       //First day of the simulation period [year, month, day]
+    int endDate[3];         //Last day of the simulation period
+    string metricList;      //Objectives to compute (see Objectives.h)
+    int warmup;             //Days excluded from the objectives
+    int Nq;                 //Number of quickflow reservoirs
+    int pdmKernel;          //Evaluation of the soil moisture power terms (pdm_kernel)
+    int nThreads;
+};
+
+// Forcing data files listed in a manifest, one per line (blank lines and lines starting with # are skipped)
+vector<string> read_basin_manifest(string manifestFile);
+
+// Evaluate every parameter set (8 values each, in the order of calc_hymod) on every basin, writing
+// a table with one row per basin and sample: basin ID, sample index, then one column per objective.
+// Basins are processed a few at a time (one per thread), each worker evaluating the samples of
+// one basin so that its forcing data stays in cache.
+void run_multi_basin(const multi_basin_config &config, const vector<string> &basinFiles,
+                     const vector<double> &parameters, ostream &out);
+
+#endif
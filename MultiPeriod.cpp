@@ -0,0 +1,272 @@
+/*
+Copyright (C) 2010-2013 Jon Herman, Josh Kollat, and others.
+
+Hymod is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Hymod is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with Hymod.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "MultiPeriod.h"
+#include "HyModBatch.h"
+#include "Objectives.h"
+#include "Checkpoint.h"
+#include "ThreadPool.h"
+
+// A period of the simulation (in time steps from its start) with the objective configuration of a
+// simulation over just that period, without warmup
+struct simulation_period
+{
+    int first;
+    int length;
+    objective_config objectives;
+};
+
+static void write_date(ostream &out, const int *date)
+{
+    out << date[0] << "-" << setfill('0') << setw(2) << date[1] << "-" << setw(2) << date[2] << setfill(' ');
+}
+
+static string date_string(const int *date)
+{
+    stringstream text;
+    write_date(text, date);
+    return text.str();
+}
+
+// The moving windows after the warmup, or the periods listed in the period file
+static vector<simulation_period> find_periods(const multi_period_config &config, const hymod_forcing *forcing)
+{
+    int steps = forcing->data.stepsPerDay;
+    int warmup = config.warmup*steps;
+    vector<simulation_period> periods;
+
+    if (config.window > 0)
+    {
+        int window = config.window*steps, windowStep = max(config.windowStep, 1)*steps;
+        for (int first = max(warmup, 0); first + window <= forcing->nDays; first += windowStep)
+            periods.push_back(simulation_period{first, window, objective_config()});
+    }
+    else
+    {
+        ifstream in(config.periodFile.c_str());
+        if (!in)
+        {
+            cout << "The period file specified: " << config.periodFile << " could not be opened!" << endl;
+            exit(1);
+        }
+
+        string line;
+        while (getline(in, line))
+        {
+            if (line.empty() || line[0] == '#') continue;
+
+            int start[3], end[3];
+            if (sscanf(line.c_str(), "%d-%d-%d,%d-%d-%d", &start[0], &start[1], &start[2], &end[0], &end[1], &end[2]) != 6)
+            {
+                cout << "Invalid period in " << config.periodFile << ": " << line << " (use YYYY-MM-DD,YYYY-MM-DD)" << endl;
+                exit(1);
+            }
+
+            int first = find_date_index(&forcing->data, start);
+            int last = find_date_index(&forcing->data, end);
+            first = (first < 0) ? -1 : first - forcing->startingIndex;
+            last = (last < 0) ? -1 : last + steps - 1 - forcing->startingIndex;
+            if (first < warmup || last < first || last >= forcing->nDays)
+            {
+                cout << "The period " << line << " is not within the simulation after the warmup" << endl;
+                exit(1);
+            }
+            periods.push_back(simulation_period{first, last - first + 1, objective_config()});
+        }
+    }
+
+    if (periods.empty())
+    {
+        cout << "There is no period to evaluate after the warmup of the simulation" << endl;
+        exit(1);
+    }
+
+    for (size_t p = 0; p < periods.size(); p++)
+    {
+        hymod_forcing period = *forcing;
+        period.startingIndex += periods[p].first;
+        period.nDays = periods[p].length;
+        period.PE += periods[p].first;
+        init_objectives(&periods[p].objectives, &period, config.metricList, 0);
+    }
+    return periods;
+}
+
+// Run up to HYMOD_LANES parameter sets once over the simulation, stopping at each period start
+// (starts, in order) to open the running sums of the periods starting there and, if snapshots
+// is not NULL, to save the states of each set s to snapshots[s*nStarts + k]. The objectives of
+// set s over period p go to results[(s*nPeriods + p)*nMetrics].
+template <unsigned Groups>
+static void evaluate_periods_groups(const HyMod *model, const vector<simulation_period> &periods, const vector<int> &starts,
+                                    double **parameters, int nSets, double *results, hymod_state *snapshots)
+{
+    const hymod_forcing *forcing = model->forcing;
+    const double *obs = &forcing->data.flow[forcing->startingIndex];
+    int nPeriods = periods.size(), nStarts = starts.size();
+    int nMetrics = periods[0].objectives.metrics.size();
+
+    vector< objective_accumulator<Groups> > acc((size_t) nPeriods*HYMOD_LANES);
+    for (size_t a = 0; a < acc.size(); a++) acc[a].init();
+
+    int end = 0;
+    for (int p = 0; p < nPeriods; p++) end = max(end, periods[p].first + periods[p].length);
+
+    hymod_state states[HYMOD_LANES];
+    for (int s = 0; s < nSets; s++) init_hymod_state(&states[s]);
+
+    vector<int> active;
+    int offset = 0;
+    hymod_stage_laps laps;
+    HYMOD_LAPS_INIT(laps);
+    auto accumulate = [&](int segmentDay, const double *Q) {
+        int day = offset + segmentDay;
+        HYMOD_LAPS_START(laps);
+        for (size_t i = 0; i < active.size(); i++)
+        {
+            const simulation_period &period = periods[active[i]];
+            if (day >= period.first + period.length) continue;
+            objective_accumulator<Groups> *a = &acc[(size_t) active[i]*HYMOD_LANES];
+            for (int s = 0; s < nSets; s++) a[s].add(obs[day], Q[s], period.objectives.logEps);
+        }
+        HYMOD_LAP(laps, STAGE_OBJECTIVES);
+    };
+
+    // The segments between successive period starts, carrying the states from one to the next
+    for (int k = -1; k < nStarts; k++)
+    {
+        int first = (k < 0) ? 0 : starts[k];
+        int last = (k + 1 < nStarts) ? starts[k+1] : end;
+
+        if (k >= 0)
+        {
+            if (snapshots != NULL)
+                for (int s = 0; s < nSets; s++) snapshots[(size_t) s*nStarts + k] = states[s];
+
+            size_t open = 0;
+            for (size_t i = 0; i < active.size(); i++)
+                if (periods[active[i]].first + periods[active[i]].length > first) active[open++] = active[i];
+            active.resize(open);
+            for (int p = 0; p < nPeriods; p++)
+                if (periods[p].first == first) active.push_back(p);
+        }
+        if (last == first) continue;
+
+        hymod_forcing segmentForcing = *forcing;
+        segmentForcing.startingIndex += first;
+        segmentForcing.nDays = last - first;
+        segmentForcing.PE += first;
+        HyMod segment;
+        segment.forcing = &segmentForcing;
+        segment.parameters = model->parameters;
+
+        offset = first;
+        calc_hymod_batch_lean(&segment, parameters, nSets, accumulate, states);
+    }
+    HYMOD_LAPS_FLUSH(laps);
+
+    for (int p = 0; p < nPeriods; p++)
+        for (int s = 0; s < nSets; s++)
+            finish_objectives(periods[p].objectives, acc[(size_t) p*HYMOD_LANES + s], &results[((size_t) s*nPeriods + p)*nMetrics]);
+}
+
+// Dispatch to the accumulator specialised for the running sums that are actually needed
+static void evaluate_periods(const HyMod *model, const vector<simulation_period> &periods, const vector<int> &starts,
+                             double **parameters, int nSets, double *results, hymod_state *snapshots)
+{
+    switch (periods[0].objectives.groups)
+    {
+        case 0: evaluate_periods_groups<0>(model, periods, starts, parameters, nSets, results, snapshots); break;
+        case 1: evaluate_periods_groups<1>(model, periods, starts, parameters, nSets, results, snapshots); break;
+        case 2: evaluate_periods_groups<2>(model, periods, starts, parameters, nSets, results, snapshots); break;
+        case 3: evaluate_periods_groups<3>(model, periods, starts, parameters, nSets, results, snapshots); break;
+        case 4: evaluate_periods_groups<4>(model, periods, starts, parameters, nSets, results, snapshots); break;
+        case 5: evaluate_periods_groups<5>(model, periods, starts, parameters, nSets, results, snapshots); break;
+        case 6: evaluate_periods_groups<6>(model, periods, starts, parameters, nSets, results, snapshots); break;
+        case 7: evaluate_periods_groups<7>(model, periods, starts, parameters, nSets, results, snapshots); break;
+    }
+}
+
+void run_multi_period(const multi_period_config &config, const HyMod *model, const vector<double> &parameters, ostream &out)
+{
+    const int nParams = 8;
+    const hymod_forcing *forcing = model->forcing;
+    int nSets = parameters.size() / nParams;
+
+    if (config.warmup < 0 || config.warmup*forcing->data.stepsPerDay >= forcing->nDays)
+    {
+        cout << "The warmup period (" << config.warmup << " days) must be shorter than the simulation" << endl;
+        exit(1);
+    }
+
+    vector<simulation_period> periods = find_periods(config, forcing);
+    int nPeriods = periods.size();
+    int nMetrics = periods[0].objectives.metrics.size();
+
+    vector<int> starts;
+    for (int p = 0; p < nPeriods; p++) starts.push_back(periods[p].first);
+    sort(starts.begin(), starts.end());
+    starts.erase(unique(starts.begin(), starts.end()), starts.end());
+    int nStarts = starts.size();
+
+    bool saveSnapshots = (config.snapshotPrefix != "");
+    vector<double> results((size_t) nSets*nPeriods*nMetrics);
+    vector<hymod_state> snapshots(saveSnapshots ? (size_t) nSets*nStarts : 0);
+
+    // Each task runs the sets of one batch over the whole simulation
+    ThreadPool pool(config.nThreads);
+    int nBatches = (nSets + HYMOD_LANES - 1) / HYMOD_LANES;
+    vector<double> sets(parameters);
+    pool.run(nBatches, [&](int b, int) {
+        int first = b*HYMOD_LANES;
+        int n = min(HYMOD_LANES, nSets - first);
+        double *batch[HYMOD_LANES];
+        for (int s = 0; s < n; s++) batch[s] = &sets[(size_t) (first + s)*nParams];
+
+        evaluate_periods(model, periods, starts, batch, n, &results[(size_t) first*nPeriods*nMetrics],
+                         saveSnapshots ? &snapshots[(size_t) first*nStarts] : NULL);
+    });
+
+    // One checkpoint per period start, holding the states at the end of the day before it
+    for (int k = 0; saveSnapshots && k < nStarts; k++)
+    {
+        if (starts[k] == 0) continue;
+
+        hymod_checkpoint checkpoint;
+        memcpy(checkpoint.date, forcing->data.date[forcing->startingIndex + starts[k] - 1], sizeof(checkpoint.date));
+        checkpoint.Nq = model->parameters.Nq;
+        checkpoint.parameters = parameters;
+        for (int s = 0; s < nSets; s++) checkpoint.states.push_back(snapshots[(size_t) s*nStarts + k]);
+        write_hymod_checkpoint(&checkpoint, config.snapshotPrefix + "." + date_string(forcing->data.date[forcing->startingIndex + starts[k]]));
+    }
+
+    out << "set\tstart\tend";
+    for (int m = 0; m < nMetrics; m++) out << "\t" << metric_names[periods[0].objectives.metrics[m]];
+    out << "\n";
+
+    for (int s = 0; s < nSets; s++)
+    {
+        for (int p = 0; p < nPeriods; p++)
+        {
+            out << s << "\t";
+            write_date(out, forcing->data.date[forcing->startingIndex + periods[p].first]);
+            out << "\t";
+            write_date(out, forcing->data.date[forcing->startingIndex + periods[p].first + periods[p].length - 1]);
+            for (int m = 0; m < nMetrics; m++) out << "\t" << results[((size_t) s*nPeriods + p)*nMetrics + m];
+            out << "\n";
+        }
+    }
+}
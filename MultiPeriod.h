@@ -0,0 +1,52 @@
+/*
+Copyright (C) 2010-2013 Jon Herman, Josh Kollat, and others.
+
+Hymod is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Hymod is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with Hymod.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef MULTIPERIOD_H
+#define MULTIPERIOD_H
+
+#include "HyMod.h"
+
+// Settings of a run computing the objectives of several periods of the simulation
+struct multi_period_config
+{
+    string metricList;      //Objectives of each period (see Objectives.h)
+    int warmup;             //Days at the start of the simulation before the first period may start
+    int window;             //Length of the moving windows (days), 0 to read the periods from periodFile
+    int windowStep;         //Days between the starts of successive windows
+    string periodFile;      //Periods as YYYY-MM-DD,YYYY-MM-DD lines (multi-period calibration)
+    string snapshotPrefix;  //If not empty, the states at the start of each period are saved as checkpoints
+    int nThreads;
+};
+
+// Objectives of every parameter set over many periods of the simulation, either the moving windows
+// after the warmup (as in run_sobol_analysis) or the periods listed in a file. Each period gets the
+// values of a separate run from empty stores at the start of the simulation, with the objectives
+// computed over the period alone. Those runs share all of their days up to the start of the period,
+// so each parameter set is simulated once over the whole simulation with the running sums of every
+// period open on a day updated from the same flows. 100 windows cost about one full-length run, not 100.
+//
+// The run stops at each period start to take a snapshot of the states. With a snapshot prefix,
+// the snapshot of each period is written as a checkpoint (see Checkpoint.h) named
+// <prefix>.<period start>. Resuming from it (-r, with -D to the end of the period and -w 0) gives
+// that period's objectives without repeating the days before it. Periods starting on the first day
+// of the simulation have no snapshot, since they start from empty stores.
+//
+// The output is a table with one row per parameter set and period: the index of the set, the
+// first and last day of the period, and its objectives.
+void run_multi_period(const multi_period_config &config, const HyMod *model, const vector<double> &parameters, ostream &out);
+
+#endif
@@ -0,0 +1,246 @@
+/*
+Copyright (C) 2010-2013 Jon Herman, Josh Kollat, and others.
+
+Hymod is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Hymod is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with Hymod.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "Objectives.h"
+#include "HyModBatch.h"
+
+const char *metric_names[N_METRICS] = {"nse", "kge", "lognse", "rmse", "bias", "fms", "fhv"};
+
+// Running sums needed by each metric
+static const unsigned metric_groups[N_METRICS] = {ACC_MOMENTS, ACC_MOMENTS, ACC_LOG, ACC_MOMENTS, ACC_MOMENTS, ACC_FDC, ACC_FDC};
+
+// Exceedance probabilities bounding the flow duration curve midsegment, and the high-flow segment
+const double FMS_LOW = 0.2;
+const double FMS_HIGH = 0.7;
+const double FHV_FRACTION = 0.02;
+
+const double FDC_BIN_WIDTH = (FDC_LOG_MAX - FDC_LOG_MIN)/FDC_BINS;
+
+int fdc_bin(double Q)
+{
+    if (!(Q > 0.0)) return 0;
+    int bin = int((log10(Q) - FDC_LOG_MIN)/FDC_BIN_WIDTH);
+    return max(0, min(FDC_BINS-1, bin));
+}
+
+// log10 of the flow exceeded with probability p, interpolating within the bin where it falls
+static double fdc_log_quantile(const int *histogram, long n, double p)
+{
+    double target = p*n;
+    double above = 0.0;
+
+    for (int bin = FDC_BINS-1; bin >= 0; bin--)
+    {
+        if (histogram[bin] > 0 && above + histogram[bin] >= target)
+        {
+            double fraction = (target - above)/histogram[bin];
+            return FDC_LOG_MIN + (bin + 1 - fraction)*FDC_BIN_WIDTH;
+        }
+        above += histogram[bin];
+    }
+    return FDC_LOG_MIN;
+}
+
+// Slope of the flow duration curve between the midsegment exceedance probabilities
+static double fdc_midsegment_slope(const int *histogram, long n)
+{
+    return (fdc_log_quantile(histogram, n, FMS_LOW) - fdc_log_quantile(histogram, n, FMS_HIGH))*log(10.0)/(FMS_HIGH - FMS_LOW);
+}
+
+// Total volume of the highest flows, taking each bin at its geometric centre
+static double fdc_high_volume(const int *histogram, long n)
+{
+    double target = FHV_FRACTION*n;
+    double counted = 0.0, volume = 0.0;
+
+    for (int bin = FDC_BINS-1; bin >= 0 && counted < target; bin--)
+    {
+        double count = min(double(histogram[bin]), target - counted);
+        volume += count*pow(10.0, FDC_LOG_MIN + (bin + 0.5)*FDC_BIN_WIDTH);
+        counted += count;
+    }
+    return volume;
+}
+
+void init_objectives(objective_config *config, const hymod_forcing *forcing, string metricList, int warmup)
+{
+    config->metrics.clear();
+    int steps = forcing->data.stepsPerDay;
+    config->warmup = warmup*steps;
+    config->groups = 0;
+
+    stringstream list(metricList);
+    string name;
+    while (getline(list, name, ','))
+    {
+        int m = 0;
+        while (m < N_METRICS && name != metric_names[m]) m++;
+        if (m == N_METRICS)
+        {
+            cout << "Unknown objective: " << name << endl;
+            exit(1);
+        }
+        config->metrics.push_back(m);
+        config->groups |= metric_groups[m];
+    }
+
+    if (warmup < 0 || (!config->metrics.empty() && config->warmup >= forcing->nDays))
+    {
+        cout << "The warmup period (" << warmup << " days) must be shorter than the simulation (" << forcing->nDays/steps << " days)" << endl;
+        exit(1);
+    }
+
+    // Reference values from the observations over the evaluation period
+    const double *obs = &forcing->data.flow[forcing->startingIndex];
+    vector<int> histogram(FDC_BINS, 0);
+    double sumObs = 0.0;
+    long n = 0;
+
+    for (int i = config->warmup; i < forcing->nDays; i++)
+    {
+        if (obs[i] < 0.0) continue;
+        sumObs += obs[i];
+        histogram[fdc_bin(obs[i])]++;
+        n++;
+    }
+
+    config->logEps = (n > 0) ? 0.01*sumObs/n : 0.0;
+    config->obsFMS = fdc_midsegment_slope(&histogram[0], n);
+    config->obsFHV = fdc_high_volume(&histogram[0], n);
+}
+
+template <unsigned Groups, class T>
+void finish_objectives(const objective_config &config, const objective_accumulator<Groups, T> &acc, T *results)
+{
+    for (size_t i = 0; i < config.metrics.size(); i++)
+    {
+        T value = 0.0;
+
+        switch (config.metrics[i])
+        {
+            case METRIC_NSE:
+                value = 1.0 - acc.sse/acc.M2obs;
+                break;
+            case METRIC_KGE:
+            {
+                T r = acc.Cos/sqrt(acc.M2obs*acc.M2sim);
+                T alpha = sqrt(acc.M2sim/acc.M2obs);
+                T beta = acc.meanSim/acc.meanObs;
+                value = 1.0 - sqrt((r-1.0)*(r-1.0) + (alpha-1.0)*(alpha-1.0) + (beta-1.0)*(beta-1.0));
+                break;
+            }
+            case METRIC_LOGNSE:
+                value = 1.0 - acc.logSse/acc.logM2obs;
+                break;
+            case METRIC_RMSE:
+                value = sqrt(acc.sse/double(acc.n));
+                break;
+            case METRIC_BIAS:
+                value = 100.0*(acc.meanSim - acc.meanObs)/acc.meanObs;
+                break;
+            case METRIC_FMS:
+                value = 100.0*(fdc_midsegment_slope(acc.histogram, acc.n) - config.obsFMS)/config.obsFMS;
+                break;
+            case METRIC_FHV:
+                value = 100.0*(fdc_high_volume(acc.histogram, acc.n) - config.obsFHV)/config.obsFHV;
+                break;
+        }
+
+        results[i] = value;
+    }
+}
+
+template <unsigned Groups>
+static void evaluate_objectives_groups(const HyMod *model, const objective_config &config, double **parameters, int nSets, double *results, hymod_state *states)
+{
+    objective_accumulator<Groups> acc[HYMOD_LANES];
+    const double *obs = &model->forcing->data.flow[model->forcing->startingIndex];
+    int warmup = config.warmup;
+    double logEps = config.logEps;
+    hymod_stage_laps laps;
+
+    for (int s = 0; s < nSets; s++) acc[s].init();
+    HYMOD_LAPS_INIT(laps);
+
+    auto accumulate = [&](int modelDay, const double *Q) {
+        if (modelDay < warmup) return;
+        HYMOD_LAPS_START(laps);
+        for (int s = 0; s < nSets; s++) acc[s].add(obs[modelDay], Q[s], logEps);
+        HYMOD_LAP(laps, STAGE_OBJECTIVES);
+    };
+    calc_hymod_batch_lean(model, parameters, nSets, accumulate, states);
+    HYMOD_LAPS_FLUSH(laps);
+
+    for (int s = 0; s < nSets; s++) finish_objectives(config, acc[s], &results[s*config.metrics.size()]);
+}
+
+template <unsigned Groups>
+static void series_objectives_groups(const objective_config &config, const double *obs, const double *sim, int n, double *results)
+{
+    objective_accumulator<Groups> acc;
+
+    acc.init();
+    for (int i = 0; i < n; i++) acc.add(obs[i], sim[i], config.logEps);
+    finish_objectives(config, acc, results);
+}
+
+// Objectives of a streamflow series that has already been simulated, sim[i] and obs[i] being
+// the values of the i-th evaluated day (the warmup of the configuration is not skipped here)
+void series_objectives(const objective_config &config, const double *obs, const double *sim, int n, double *results)
+{
+    switch (config.groups)
+    {
+        case 0: series_objectives_groups<0>(config, obs, sim, n, results); break;
+        case 1: series_objectives_groups<1>(config, obs, sim, n, results); break;
+        case 2: series_objectives_groups<2>(config, obs, sim, n, results); break;
+        case 3: series_objectives_groups<3>(config, obs, sim, n, results); break;
+        case 4: series_objectives_groups<4>(config, obs, sim, n, results); break;
+        case 5: series_objectives_groups<5>(config, obs, sim, n, results); break;
+        case 6: series_objectives_groups<6>(config, obs, sim, n, results); break;
+        case 7: series_objectives_groups<7>(config, obs, sim, n, results); break;
+    }
+}
+
+// Dispatch to the accumulator specialised for the running sums that are actually needed
+void evaluate_objectives(const HyMod *model, const objective_config &config, double **parameters, int nSets, double *results, hymod_state *states)
+{
+    switch (config.groups)
+    {
+        case 0: evaluate_objectives_groups<0>(model, config, parameters, nSets, results, states); break;
+        case 1: evaluate_objectives_groups<1>(model, config, parameters, nSets, results, states); break;
+        case 2: evaluate_objectives_groups<2>(model, config, parameters, nSets, results, states); break;
+        case 3: evaluate_objectives_groups<3>(model, config, parameters, nSets, results, states); break;
+        case 4: evaluate_objectives_groups<4>(model, config, parameters, nSets, results, states); break;
+        case 5: evaluate_objectives_groups<5>(model, config, parameters, nSets, results, states); break;
+        case 6: evaluate_objectives_groups<6>(model, config, parameters, nSets, results, states); break;
+        case 7: evaluate_objectives_groups<7>(model, config, parameters, nSets, results, states); break;
+    }
+}
+
+// Instantiate finish_objectives for every set of running sums, for flows and their derivatives
+#define INSTANTIATE_FINISH_OBJECTIVES(T) \
+    template void finish_objectives<0, T>(const objective_config &, const objective_accumulator<0, T> &, T *); \
+    template void finish_objectives<1, T>(const objective_config &, const objective_accumulator<1, T> &, T *); \
+    template void finish_objectives<2, T>(const objective_config &, const objective_accumulator<2, T> &, T *); \
+    template void finish_objectives<3, T>(const objective_config &, const objective_accumulator<3, T> &, T *); \
+    template void finish_objectives<4, T>(const objective_config &, const objective_accumulator<4, T> &, T *); \
+    template void finish_objectives<5, T>(const objective_config &, const objective_accumulator<5, T> &, T *); \
+    template void finish_objectives<6, T>(const objective_config &, const objective_accumulator<6, T> &, T *); \
+    template void finish_objectives<7, T>(const objective_config &, const objective_accumulator<7, T> &, T *);
+
+INSTANTIATE_FINISH_OBJECTIVES(double)
+INSTANTIATE_FINISH_OBJECTIVES(dual<HYMOD_N_PARAMETERS>)
@@ -0,0 +1,148 @@
+/*
+Copyright (C) 2010-2013 Jon Herman, Josh Kollat, and others.
+
+Hymod is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Hymod is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with Hymod.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef OBJECTIVES_H
+#define OBJECTIVES_H
+
+#include <vector>
+#include <string.h>
+
+#include "HyMod.h"
+
+// Objective functions comparing simulated and observed streamflow
+enum hymod_metric
+{
+    METRIC_NSE,      //Nash-Sutcliffe efficiency
+    METRIC_KGE,      //Kling-Gupta efficiency
+    METRIC_LOGNSE,   //Nash-Sutcliffe efficiency of log(Q + eps), eps = 1% of the mean observed flow
+    METRIC_RMSE,     //Root mean squared error (mm per time step)
+    METRIC_BIAS,     //Percent bias of total flow volume
+    METRIC_FMS,      //Percent bias of the flow duration curve midsegment slope (20% to 70% exceedance)
+    METRIC_FHV,      //Percent bias of the flow duration curve high-flow volume (top 2% of flows)
+    N_METRICS
+};
+
+// Groups of running sums. A metric set only updates the groups its metrics need.
+enum
+{
+    ACC_MOMENTS = 1,     //Means, (co)variances and squared error of Q
+    ACC_LOG     = 2,     //Squared error and variance of log(Q + eps)
+    ACC_FDC     = 4      //Histogram of Q for the flow duration curve
+};
+
+// Histogram of log10(Q) used to estimate flow duration curves in a single pass
+// (bins are about 1% of the flow wide, quantiles are interpolated within a bin)
+#define FDC_BINS 2048
+#define FDC_LOG_MIN -6.0
+#define FDC_LOG_MAX 4.0
+
+// Objectives to compute and the reference values that depend only on the observations
+struct objective_config
+{
+    vector<int> metrics;    //Metrics to report, in output order
+    int warmup;             //Number of time steps at the start of the simulation excluded from the objectives
+    unsigned groups;        //Running sums needed by the metrics (ACC_* flags)
+
+    double logEps;          //Offset added to flows before taking logs
+    double obsFMS;          //Observed flow duration curve midsegment slope
+    double obsFHV;          //Observed high-flow volume
+};
+
+int fdc_bin(double Q);
+
+// Single-pass accumulator of the running sums for one parameter set. Groups is fixed at
+// compile time so that unused sums cost nothing per day. The sums involving the simulated
+// flows are of type T, so that a dual T carries their derivatives (see hymod_gradient).
+template <unsigned Groups, class T = double>
+struct objective_accumulator
+{
+    long n;
+    double meanObs;                 //Running means (Welford)
+    T meanSim;
+    double M2obs;                   //Running sums of squared deviations and co-deviations
+    T M2sim, Cos;
+    T sse;                          //Sum of squared errors
+
+    double logMeanObs, logM2obs;
+    T logSse;
+
+    int histogram[(Groups & ACC_FDC) ? FDC_BINS : 1];
+
+    void init()
+    {
+        n = 0;
+        meanObs = M2obs = 0.0;
+        meanSim = M2sim = Cos = sse = 0.0;
+        logMeanObs = logM2obs = 0.0;
+        logSse = 0.0;
+        if (Groups & ACC_FDC) memset(histogram, 0, sizeof(histogram));
+    }
+
+    inline void add(double obs, T sim, double logEps)
+    {
+        // Days with missing observations (negative flows in MOPEX files) are skipped
+        if (obs < 0.0) return;
+        n++;
+
+        if (Groups & ACC_MOMENTS)
+        {
+            double dObs = obs - meanObs;
+            T dSim = sim - meanSim;
+            meanObs += dObs/n;
+            meanSim += dSim/n;
+            M2obs += dObs*(obs - meanObs);
+            M2sim += dSim*(sim - meanSim);
+            Cos   += dObs*(sim - meanSim);
+            sse   += (sim - obs)*(sim - obs);
+        }
+
+        if (Groups & ACC_LOG)
+        {
+            double logObs = log(obs + logEps);
+            T logSim = log(max(sim, T(0.0)) + logEps);
+            double dObs = logObs - logMeanObs;
+            logMeanObs += dObs/n;
+            logM2obs += dObs*(logObs - logMeanObs);
+            logSse += (logSim - logObs)*(logSim - logObs);
+        }
+
+        if (Groups & ACC_FDC) histogram[fdc_bin(value_of(sim))]++;
+    }
+};
+
+// Set up an objective configuration from a comma-separated list of metric names (e.g. "nse,kge,rmse")
+// and the number of warmup days (converted to time steps of the forcing)
+void init_objectives(objective_config *config, const hymod_forcing *forcing, string metricList, int warmup);
+
+// Names of the metrics, in the order of hymod_metric
+extern const char *metric_names[N_METRICS];
+
+// Compute the requested metrics from the running sums, writing config.metrics.size() values.
+// With dual sums, the flow duration curve metrics carry no derivatives: they come from a histogram,
+// so the dual parts are left at zero and must not be used (see hymod_gradient).
+template <unsigned Groups, class T>
+void finish_objectives(const objective_config &config, const objective_accumulator<Groups, T> &acc, T *results);
+
+// Evaluate up to HYMOD_LANES parameter sets with the batched model and compute their objectives
+// without storing any flows. results receives config.metrics.size() values per parameter set.
+// If states is not NULL, the runs start from (and return) the states of each set, as in calc_hymod_batch_lean.
+void evaluate_objectives(const HyMod *model, const objective_config &config, double **parameters, int nSets, double *results, hymod_state *states = NULL);
+
+// Objectives of a stored series of n simulated flows against the matching observations
+void series_objectives(const objective_config &config, const double *obs, const double *sim, int n, double *results);
+
+#endif
@@ -0,0 +1,138 @@
+/*
+Copyright (C) 2010-2013 Jon Herman, Josh Kollat, and others.
+
+Hymod is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Hymod is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with Hymod.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <iostream>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "Protocol.h"
+
+bool host_is_little_endian()
+{
+    const uint16_t one = 1;
+    unsigned char first;
+    memcpy(&first, &one, 1);
+    return first == 1;
+}
+
+// Reverse the bytes of each value in place (only needed on big-endian machines)
+void swap_bytes(void *values, size_t count, size_t size)
+{
+    unsigned char *bytes = (unsigned char *) values;
+    for (size_t i = 0; i < count; i++, bytes += size)
+        for (size_t j = 0; j < size/2; j++) swap(bytes[j], bytes[size-1-j]);
+}
+
+static void read_exactly(FILE *in, void *data, size_t size, size_t count)
+{
+    if (fread(data, size, count, in) != count)
+    {
+        cerr << "hymod: truncated frame on binary input" << endl;
+        exit(1);
+    }
+}
+
+void init_binary_protocol(binary_protocol *protocol, FILE *in, FILE *out, int nParams, int nValues)
+{
+    protocol->in = in;
+    protocol->out = out;
+    protocol->nParams = nParams;
+    protocol->nValues = nValues;
+    protocol->remaining = 0;
+    protocol->pending = 0;
+
+    // Large buffers so that a frame is moved in a few system calls
+    setvbuf(in, NULL, _IOFBF, 1 << 20);
+    setvbuf(out, NULL, _IOFBF, 1 << 20);
+}
+
+int read_binary_parameters(binary_protocol *protocol, double *parameters, int maxSets)
+{
+    bool swapped = !host_is_little_endian();
+
+    if (protocol->remaining == 0)
+    {
+        // Start of a new frame; the end of the input here is a normal end of session
+        uint32_t nSets;
+        if (fread(&nSets, sizeof(nSets), 1, protocol->in) != 1) return 0;
+        if (swapped) swap_bytes(&nSets, 1, sizeof(nSets));
+        if (nSets == 0) return 0;
+
+        protocol->remaining = nSets;
+        protocol->pending = nSets;
+
+        uint32_t header[2] = {nSets, (uint32_t) protocol->nValues};
+        if (swapped) swap_bytes(header, 2, sizeof(uint32_t));
+        fwrite(header, sizeof(uint32_t), 2, protocol->out);
+    }
+
+    int nSets = (int) min((uint32_t) maxSets, protocol->remaining);
+    read_exactly(protocol->in, parameters, sizeof(double), (size_t) nSets * protocol->nParams);
+    if (swapped) swap_bytes(parameters, (size_t) nSets * protocol->nParams, sizeof(double));
+    protocol->remaining -= nSets;
+
+    return nSets;
+}
+
+void write_binary_results(binary_protocol *protocol, const double *results, int nSets)
+{
+    size_t count = (size_t) nSets * protocol->nValues;
+
+    if (host_is_little_endian())
+        fwrite(results, sizeof(double), count, protocol->out);
+    else
+    {
+        protocol->buffer.assign(results, results + count);
+        swap_bytes(protocol->buffer.data(), count, sizeof(double));
+        fwrite(protocol->buffer.data(), sizeof(double), count, protocol->out);
+    }
+
+    protocol->pending -= nSets;
+    if (protocol->pending == 0) fflush(protocol->out);
+}
+
+bool read_fully(int fd, void *data, size_t size)
+{
+    char *bytes = (char *) data;
+    while (size > 0)
+    {
+        ssize_t n = read(fd, bytes, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        bytes += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool write_fully(int fd, const void *data, size_t size)
+{
+    const char *bytes = (const char *) data;
+    while (size > 0)
+    {
+        // A peer that has gone away gives an error rather than SIGPIPE (send only works on sockets)
+        ssize_t n = send(fd, bytes, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == ENOTSOCK) n = write(fd, bytes, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        bytes += n;
+        size -= n;
+    }
+    return true;
+}
@@ -0,0 +1,66 @@
+/*
+Copyright (C) 2010-2013 Jon Herman, Josh Kollat, and others.
+
+Hymod is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Hymod is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with Hymod.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <vector>
+
+using namespace std;
+
+// Framed binary protocol for exchanging parameter sets and results with an optimiser over
+// stdin/stdout (hymod -b). All numbers are little-endian.
+//
+//   request:  uint32 nSets, then nSets records of 8 float64 parameters (in the order of calc_hymod)
+//   response: uint32 nSets, uint32 nValues, then nSets records of nValues float64 results
+//
+// Each request frame gets exactly one response frame, which is flushed once it is complete, so
+// a client can keep several frames in flight. A frame of zero sets, or the end of the input
+// at a frame boundary, ends the session.
+struct binary_protocol
+{
+    FILE *in;
+    FILE *out;
+    int nParams;            //Values per parameter record
+    int nValues;            //Values per result record
+    uint32_t remaining;     //Parameter records of the current request frame not read yet
+    uint32_t pending;       //Result records of the current response frame not written yet
+    vector<double> buffer;
+};
+
+// The frames are little-endian whatever the machine; values are swapped on big-endian hosts
+bool host_is_little_endian();
+void swap_bytes(void *values, size_t count, size_t size);
+
+void init_binary_protocol(binary_protocol *protocol, FILE *in, FILE *out, int nParams, int nValues);
+
+// Read up to maxSets parameter records of the current frame (starting a new frame if needed).
+// Returns the number of records read, 0 once the session has ended.
+int read_binary_parameters(binary_protocol *protocol, double *parameters, int maxSets);
+
+// Write the results of the nSets records read last, flushing the output at the end of a frame
+void write_binary_results(binary_protocol *protocol, const double *results, int nSets);
+
+// Move exactly size bytes over a socket (or other file descriptor), retrying after signals.
+// Both return false if the connection is closed or fails first. On a socket, writing to a peer
+// that has gone away fails without SIGPIPE; on a pipe the usual SIGPIPE is raised.
+bool read_fully(int fd, void *data, size_t size);
+bool write_fully(int fd, const void *data, size_t size);
+
+#endif
@@ -0,0 +1,202 @@
+/*
+Copyright (C) 2010-2013 Jon Herman, Josh Kollat, and others.
+
+Hymod is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Hymod is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with Hymod.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ResultCache.h"
+
+#define CACHE_VERSION 1
+#define CACHE_BYTE_ORDER 0x01020304
+
+struct cache_header
+{
+    char magic[8];      //"HYMODCAC"
+    int version;
+    int byteOrder;      //CACHE_BYTE_ORDER as written by the machine that saved the file
+    long nEntries;
+};
+
+// Each entry in the file is its key, the number of values (as a uint64_t) and the values
+static const char cache_magic[8] = {'H','Y','M','O','D','C','A','C'};
+
+size_t result_cache_hash::operator()(const result_cache_key &key) const
+{
+    return fnv1a(FNV_OFFSET, &key, sizeof(key));
+}
+
+uint64_t result_cache_context(const HyMod *model, string metricList, int warmup)
+{
+    const hymod_forcing *forcing = model->forcing;
+    const MOPEXData *data = &forcing->data;
+    int first = forcing->startingIndex, n = forcing->nDays;
+    int settings[5] = {model->parameters.Nq, model->parameters.pdmKernel, data->stepsPerDay, warmup, n};
+
+    uint64_t hash = FNV_OFFSET;
+    hash = fnv1a(hash, data->ID.data(), data->ID.size());
+    hash = fnv1a(hash, metricList.data(), metricList.size());
+    hash = fnv1a(hash, settings, sizeof(settings));
+    hash = fnv1a(hash, &model->parameters.Kv, sizeof(double));
+    if (n > 0) hash = fnv1a(hash, data->date[first], sizeof(data->date[0]));
+    hash = fnv1a(hash, &data->precip[first], n*sizeof(double));
+    hash = fnv1a(hash, &data->avgTemp[first], n*sizeof(double));
+    hash = fnv1a(hash, &data->flow[first], n*sizeof(double));
+    hash = fnv1a(hash, forcing->PE, n*sizeof(double));
+    return hash;
+}
+
+void init_result_cache(result_cache *cache, size_t capacity, int digits, uint64_t context, string file)
+{
+    cache->capacity = capacity;
+    cache->digits = max(1, min(digits, 17));
+    cache->context = context;
+    cache->file = file;
+    cache->hits = cache->misses = 0;
+    if (file == "") return;
+
+    // A missing file is an empty cache, e.g. on the first job of a sweep
+    ifstream in(file.c_str(), ios_base::in | ios_base::binary);
+    if (!in) return;
+
+    cache_header header;
+    in.read((char *) &header, sizeof(header));
+    if (!in || memcmp(header.magic, cache_magic, sizeof(header.magic)) != 0 || header.version != CACHE_VERSION
+        || header.byteOrder != CACHE_BYTE_ORDER || header.nEntries < 0)
+    {
+        cout << "The cache file specified: " << file << " is not a hymod result cache written on this machine" << endl;
+        exit(1);
+    }
+
+    // Entries are saved least recently used first, inserting them in order restores the order of use
+    result_cache_key key;
+    uint64_t nValues;
+    vector<double> values;
+    for (long e = 0; e < header.nEntries; e++)
+    {
+        in.read((char *) &key, sizeof(key));
+        in.read((char *) &nValues, sizeof(nValues));
+        if (in && nValues < 1024)
+        {
+            values.resize(nValues);
+            in.read((char *) values.data(), nValues*sizeof(double));
+        }
+        if (!in || nValues >= 1024)
+        {
+            cout << "The cache file specified: " << file << " is truncated or corrupt (" << e << " of " << header.nEntries << " entries)" << endl;
+            exit(1);
+        }
+        result_cache_insert(cache, key, values.data(), nValues);
+    }
+}
+
+// Parameters are rounded to the given number of significant digits, so that sets differing
+// only beyond that precision share an entry
+result_cache_key result_cache_make_key(const result_cache *cache, const double *parameters)
+{
+    result_cache_key key;
+    char text[32];
+
+    memset(&key, 0, sizeof(key));
+    key.context = cache->context;
+    for (int i = 0; i < HYMOD_N_PARAMETERS; i++)
+    {
+        snprintf(text, sizeof(text), "%.*e", cache->digits - 1, parameters[i]);
+        double rounded = strtod(text, NULL) + 0.0;   //+0.0 turns -0 into 0
+        memcpy(&key.parameters[i], &rounded, sizeof(rounded));
+    }
+    return key;
+}
+
+bool result_cache_lookup(result_cache *cache, const result_cache_key &key, double *values, int nValues)
+{
+    auto found = cache->index.find(key);
+    if (found == cache->index.end() || (int) found->second->values.size() != nValues)
+    {
+        cache->misses++;
+        return false;
+    }
+
+    // Move the entry to the front of the list of uses
+    cache->entries.splice(cache->entries.begin(), cache->entries, found->second);
+    copy(found->second->values.begin(), found->second->values.end(), values);
+    cache->hits++;
+    return true;
+}
+
+void result_cache_insert(result_cache *cache, const result_cache_key &key, const double *values, int nValues)
+{
+    if (cache->capacity == 0) return;
+
+    auto found = cache->index.find(key);
+    if (found != cache->index.end())
+    {
+        cache->entries.erase(found->second);
+        cache->index.erase(found);
+    }
+    else if (cache->entries.size() >= cache->capacity)
+    {
+        cache->index.erase(cache->entries.back().key);
+        cache->entries.pop_back();
+    }
+
+    cache->entries.push_front(result_cache_entry());
+    result_cache_entry &entry = cache->entries.front();
+    entry.key = key;
+    entry.values.assign(values, values + nValues);
+    cache->index[key] = cache->entries.begin();
+}
+
+void save_result_cache(const result_cache *cache)
+{
+    if (cache->file == "") return;
+
+    cache_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, cache_magic, sizeof(header.magic));
+    header.version = CACHE_VERSION;
+    header.byteOrder = CACHE_BYTE_ORDER;
+    header.nEntries = cache->entries.size();
+
+    // Written to a temporary file first, as checkpoints are. Jobs saving the same file at once
+    // do not corrupt it, the last one to finish replaces it.
+    string tempFile = cache->file + ".tmp" + to_string((long) getpid());
+    ofstream out(tempFile.c_str(), ios_base::out | ios_base::binary);
+    out.write((const char *) &header, sizeof(header));
+    for (auto entry = cache->entries.rbegin(); entry != cache->entries.rend(); entry++)
+    {
+        uint64_t nValues = entry->values.size();
+        out.write((const char *) &entry->key, sizeof(entry->key));
+        out.write((const char *) &nValues, sizeof(nValues));
+        out.write((const char *) entry->values.data(), nValues*sizeof(double));
+    }
+
+    out.close();
+    if (!out || rename(tempFile.c_str(), cache->file.c_str()) != 0)
+    {
+        cout << "The cache file specified: " << cache->file << " could not be written!" << endl;
+        exit(1);
+    }
+}
+
+void report_result_cache(const result_cache *cache)
+{
+    long lookups = cache->hits + cache->misses;
+    cerr << "Result cache: " << cache->hits << " hits, " << cache->misses << " misses";
+    if (lookups > 0) cerr << " (" << 100.0*cache->hits/lookups << "% hits)";
+    cerr << ", " << cache->entries.size() << " entries" << endl;
+}
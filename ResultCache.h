@@ -0,0 +1,80 @@
+/*
+Copyright (C) 2010-2013 Jon Herman, Josh Kollat, and others.
+
+Hymod is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Hymod is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with Hymod.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef RESULTCACHE_H
+#define RESULTCACHE_H
+
+#include <list>
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+
+#include "HyMod.h"
+
+// Identity of a model result: the run it belongs to (forcing window and settings) and the
+// parameter values rounded to the precision of the cache
+struct result_cache_key
+{
+    uint64_t context;
+    uint64_t parameters[HYMOD_N_PARAMETERS];    //Bits of the rounded parameter values
+
+    bool operator==(const result_cache_key &other) const
+    {
+        return context == other.context && memcmp(parameters, other.parameters, sizeof(parameters)) == 0;
+    }
+};
+
+struct result_cache_hash
+{
+    size_t operator()(const result_cache_key &key) const;
+};
+
+struct result_cache_entry
+{
+    result_cache_key key;
+    vector<double> values;
+};
+
+// Bounded table of results, discarding the least recently used once full. It can be loaded
+// from and saved to a file, so that later jobs over the same runs start with its contents.
+struct result_cache
+{
+    size_t capacity;        //Largest number of entries kept
+    int digits;             //Significant digits the parameters are rounded to
+    uint64_t context;       //Identity of the current run, see result_cache_context
+    string file;            //File the cache is loaded from and saved to ("" for none)
+
+    list<result_cache_entry> entries;   //Most recently used first
+    unordered_map<result_cache_key, list<result_cache_entry>::iterator, result_cache_hash> index;
+    long hits, misses;
+};
+
+// Identity of a run: the forcing data over the simulation period and everything else that changes the results
+uint64_t result_cache_context(const HyMod *model, string metricList, int warmup);
+
+void init_result_cache(result_cache *cache, size_t capacity, int digits, uint64_t context, string file);
+result_cache_key result_cache_make_key(const result_cache *cache, const double *parameters);
+
+// Copy the values stored for a key, returning false (and counting a miss) if there are none
+bool result_cache_lookup(result_cache *cache, const result_cache_key &key, double *values, int nValues);
+void result_cache_insert(result_cache *cache, const result_cache_key &key, const double *values, int nValues);
+
+// Write the entries to the cache file (if any), and the hit and miss counts to stderr
+void save_result_cache(const result_cache *cache);
+void report_result_cache(const result_cache *cache);
+
+#endif
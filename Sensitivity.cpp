@@ -0,0 +1,270 @@
+/*
+Copyright (C) 2010-2013 Jon Herman, Josh Kollat, and others.
+
+Hymod is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Hymod is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with Hymod.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "Sensitivity.h"
+#include "HyModBatch.h"
+#include "Objectives.h"
+#include "ThreadPool.h"
+
+// Base samples evaluated per round and thread
+const int samplesPerThread = 16;
+
+// Runs per base sample: the A and B matrices, and A with each column taken from B
+const int runsPerSample = HYMOD_N_PARAMETERS + 2;
+
+// Sobol sequence in 2*HYMOD_N_PARAMETERS dimensions (Bratley and Fox's Gray code construction),
+// with the direction numbers of Joe and Kuo (2008) for dimensions 2 to 16
+#define SOBOL_DIMENSIONS (2*HYMOD_N_PARAMETERS)
+#define SOBOL_BITS 32
+
+struct sobol_sequence
+{
+    uint32_t v[SOBOL_DIMENSIONS][SOBOL_BITS];   //Direction numbers
+    uint32_t x[SOBOL_DIMENSIONS];               //Current point
+    uint32_t index;                             //Number of points generated
+};
+
+static const struct { int s, a, m[6]; } sobol_primitives[SOBOL_DIMENSIONS-1] =
+{
+    {1,  0, {1}},
+    {2,  1, {1, 3}},
+    {3,  1, {1, 3, 1}},
+    {3,  2, {1, 1, 1}},
+    {4,  1, {1, 1, 3, 3}},
+    {4,  4, {1, 3, 5, 13}},
+    {5,  2, {1, 1, 5, 5, 17}},
+    {5,  4, {1, 1, 5, 5, 5}},
+    {5,  7, {1, 1, 7, 11, 19}},
+    {5, 11, {1, 1, 5, 1, 1}},
+    {5, 13, {1, 1, 1, 3, 11}},
+    {5, 14, {1, 3, 5, 5, 31}},
+    {6,  1, {1, 3, 3, 9, 7, 49}},
+    {6, 13, {1, 1, 1, 15, 21, 21}},
+    {6, 16, {1, 3, 1, 13, 27, 49}}
+};
+
+static void init_sobol(sobol_sequence *sobol)
+{
+    for (int k = 0; k < SOBOL_BITS; k++) sobol->v[0][k] = 1u << (31 - k);
+
+    for (int d = 1; d < SOBOL_DIMENSIONS; d++)
+    {
+        int s = sobol_primitives[d-1].s, a = sobol_primitives[d-1].a;
+        uint32_t *v = sobol->v[d];
+
+        for (int k = 0; k < s; k++) v[k] = (uint32_t) sobol_primitives[d-1].m[k] << (31 - k);
+        for (int k = s; k < SOBOL_BITS; k++)
+        {
+            v[k] = v[k-s] ^ (v[k-s] >> s);
+            for (int l = 1; l < s; l++)
+                if ((a >> (s - 1 - l)) & 1) v[k] ^= v[k-l];
+        }
+    }
+
+    memset(sobol->x, 0, sizeof(sobol->x));
+    sobol->index = 0;
+}
+
+// Next point of the sequence in [0, 1)^SOBOL_DIMENSIONS (the first point, all zeros, is skipped)
+static void next_sobol(sobol_sequence *sobol, double *point)
+{
+    int c = 0;
+    while ((sobol->index >> c) & 1) c++;
+    sobol->index++;
+
+    for (int d = 0; d < SOBOL_DIMENSIONS; d++)
+    {
+        sobol->x[d] ^= sobol->v[d][c];
+        point[d] = sobol->x[d] / 4294967296.0;
+    }
+}
+
+// A period over which the objectives are computed: steps [first, first+length) of the simulation
+struct sensitivity_period
+{
+    int first;
+    int length;
+    objective_config objectives;
+};
+
+// Running sums of the estimators for one objective over one period
+struct sobol_accumulator
+{
+    long n;
+    double mean, M2;                        //Mean and sum of squared deviations of f(A) and f(B) together
+    double first[HYMOD_N_PARAMETERS];       //Sum of f(B)*(f(AB_i) - f(A))
+    double total[HYMOD_N_PARAMETERS];       //Sum of (f(A) - f(AB_i))^2
+};
+
+static void add_sample(sobol_accumulator *acc, const double *f, int stride)
+{
+    double fA = f[0], fB = f[stride];
+    double values[2] = {fA, fB};
+
+    for (int k = 0; k < 2; k++)
+    {
+        acc->n++;
+        double delta = values[k] - acc->mean;
+        acc->mean += delta/acc->n;
+        acc->M2 += delta*(values[k] - acc->mean);
+    }
+
+    for (int i = 0; i < HYMOD_N_PARAMETERS; i++)
+    {
+        double fABi = f[(2+i)*stride];
+        acc->first[i] += fB*(fABi - fA);
+        acc->total[i] += (fA - fABi)*(fA - fABi);
+    }
+}
+
+static void write_date(ostream &out, const int *date)
+{
+    out << date[0] << "-" << setfill('0') << setw(2) << date[1] << "-" << setw(2) << date[2] << setfill(' ');
+}
+
+void run_sobol_analysis(const sensitivity_config &config, const HyMod *model, ostream &out)
+{
+    const hymod_forcing *forcing = model->forcing;
+    int steps = forcing->data.stepsPerDay;
+    int warmup = config.warmup*steps;
+
+    if (config.nBase < 1 || warmup < 0 || warmup >= forcing->nDays)
+    {
+        cout << "The sensitivity analysis needs at least one base sample and a warmup shorter than the simulation" << endl;
+        exit(1);
+    }
+
+    // The whole period after the warmup, then the moving windows. Each period has the objective
+    // configuration of a simulation over just that period, without warmup.
+    vector<sensitivity_period> periods;
+    int window = config.window*steps, windowStep = max(config.windowStep, 1)*steps;
+    periods.push_back(sensitivity_period{warmup, forcing->nDays - warmup, objective_config()});
+    if (window > 0)
+        for (int first = warmup; first + window <= forcing->nDays; first += windowStep)
+            periods.push_back(sensitivity_period{first, window, objective_config()});
+
+    for (size_t p = 0; p < periods.size(); p++)
+    {
+        hymod_forcing period = *forcing;
+        period.startingIndex += periods[p].first;
+        period.nDays = periods[p].length;
+        period.PE += periods[p].first;
+        init_objectives(&periods[p].objectives, &period, config.metricList, 0);
+    }
+
+    int nPeriods = periods.size();
+    int nMetrics = periods[0].objectives.metrics.size();
+    int nValues = nPeriods*nMetrics;
+    if (nMetrics == 0)
+    {
+        cout << "The sensitivity analysis needs at least one objective" << endl;
+        exit(1);
+    }
+
+    ThreadPool pool(config.nThreads);
+    int samplesPerRound = samplesPerThread*pool.size();
+    int nDays = forcing->nDays;
+    const double *obs = &forcing->data.flow[forcing->startingIndex];
+
+    vector<double> parameters((size_t) samplesPerRound*runsPerSample*HYMOD_N_PARAMETERS);
+    vector<double> values((size_t) samplesPerRound*runsPerSample*nValues);
+    vector< vector<double> > flows(pool.size(), vector<double>((size_t) HYMOD_LANES*nDays));
+    vector<sobol_accumulator> accumulators(nValues, sobol_accumulator());
+
+    sobol_sequence sobol;
+    init_sobol(&sobol);
+    double point[SOBOL_DIMENSIONS];
+
+    for (int done = 0; done < config.nBase; done += samplesPerRound)
+    {
+        int nRound = min(samplesPerRound, config.nBase - done);
+
+        // Rows A_j, B_j and AB_j^i of the Saltelli matrices for each base sample j of the round
+        for (int j = 0; j < nRound; j++)
+        {
+            next_sobol(&sobol, point);
+            double *rows = &parameters[(size_t) j*runsPerSample*HYMOD_N_PARAMETERS];
+
+            for (int i = 0; i < HYMOD_N_PARAMETERS; i++)
+            {
+                const hymod_parameter_range &range = config.ranges[i];
+                double a = range.lower + point[i]*(range.upper - range.lower);
+                double b = range.lower + point[HYMOD_N_PARAMETERS + i]*(range.upper - range.lower);
+
+                rows[i] = a;
+                rows[HYMOD_N_PARAMETERS + i] = b;
+                for (int r = 0; r < HYMOD_N_PARAMETERS; r++)
+                    rows[(2+r)*HYMOD_N_PARAMETERS + i] = (r == i) ? b : a;
+            }
+        }
+
+        // Each task runs the sets of one base sample in batches, and computes the objectives of every period
+        pool.run(nRound, [&](int j, int worker) {
+            double *Q = &flows[worker][0];
+
+            for (int firstRun = 0; firstRun < runsPerSample; firstRun += HYMOD_LANES)
+            {
+                int n = min(HYMOD_LANES, runsPerSample - firstRun);
+                double *sets[HYMOD_LANES];
+                for (int s = 0; s < n; s++)
+                    sets[s] = &parameters[((size_t) j*runsPerSample + firstRun + s)*HYMOD_N_PARAMETERS];
+
+                auto store = [&](int modelDay, const double *Qday) {
+                    for (int s = 0; s < n; s++) Q[(size_t) s*nDays + modelDay] = Qday[s];
+                };
+                calc_hymod_batch_lean(model, sets, n, store);
+
+                for (int s = 0; s < n; s++)
+                {
+                    double *f = &values[((size_t) j*runsPerSample + firstRun + s)*nValues];
+                    for (int p = 0; p < nPeriods; p++)
+                        series_objectives(periods[p].objectives, obs + periods[p].first, &Q[(size_t) s*nDays + periods[p].first],
+                                          periods[p].length, &f[p*nMetrics]);
+                }
+            }
+        });
+
+        // The sums are updated in sample order, so the results do not depend on the number of threads
+        for (int j = 0; j < nRound; j++)
+            for (int v = 0; v < nValues; v++)
+                add_sample(&accumulators[v], &values[(size_t) j*runsPerSample*nValues + v], nValues);
+
+        HYMOD_INSTRUMENT_POLL();
+    }
+
+    HYMOD_STAGE_BEGIN(STAGE_OUTPUT);
+    out << "start\tend\tobjective\tparameter\tfirst\ttotal\n";
+    for (int p = 0; p < nPeriods; p++)
+    {
+        for (int m = 0; m < nMetrics; m++)
+        {
+            const sobol_accumulator &acc = accumulators[p*nMetrics + m];
+            double variance = acc.M2/acc.n;
+
+            for (int i = 0; i < HYMOD_N_PARAMETERS; i++)
+            {
+                write_date(out, forcing->data.date[forcing->startingIndex + periods[p].first]);
+                out << "\t";
+                write_date(out, forcing->data.date[forcing->startingIndex + periods[p].first + periods[p].length - 1]);
+                out << "\t" << metric_names[periods[p].objectives.metrics[m]] << "\t" << config.ranges[i].name
+                    << "\t" << acc.first[i]/config.nBase/variance << "\t" << 0.5*acc.total[i]/config.nBase/variance << "\n";
+            }
+        }
+    }
+    out.flush();
+    HYMOD_STAGE_END(STAGE_OUTPUT);
+}
@@ -0,0 +1,44 @@
+/*
+Copyright (C) 2010-2013 Jon Herman, Josh Kollat, and others.
+
+Hymod is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Hymod is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with Hymod.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SENSITIVITY_H
+#define SENSITIVITY_H
+
+#include "HyMod.h"
+
+// Settings of a Sobol sensitivity analysis
+struct sensitivity_config
+{
+    int nBase;              //Base samples N, the model is run N*(HYMOD_N_PARAMETERS+2) times
+    string metricList;      //Objectives the indices are computed for (see Objectives.h)
+    int warmup;             //Days at the start of the simulation excluded from every objective
+    int window;             //Length of the moving windows (days), 0 for the whole period only
+    int windowStep;         //Days between the starts of successive windows
+    int nThreads;
+    hymod_parameter_range ranges[HYMOD_N_PARAMETERS];
+};
+
+// First-order and total-order Sobol indices of the objectives with respect to each parameter, from
+// Saltelli's sampling scheme on a Sobol sequence (Saltelli et al. 2010, with Jansen's estimator of the
+// total effects). The samples are generated and evaluated in rounds on the worker threads, and only
+// running sums are kept, so memory does not depend on the number of samples. The indices are computed
+// for the whole period after the warmup and, with a window, for each moving window of that period
+// (time-varying sensitivity, Herman et al. 2013), all from the same runs. The output is a table with
+// one row per period, objective and parameter.
+void run_sobol_analysis(const sensitivity_config &config, const HyMod *model, ostream &out);
+
+#endif
@@ -0,0 +1,408 @@
+/*
+Copyright (C) 2010-2013 Jon Herman, Josh Kollat, and others.
+
+Hymod is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Hymod is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with Hymod.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "Server.h"
+#include "HyModBatch.h"
+#include "Objectives.h"
+#include "Protocol.h"
+#include "ThreadPool.h"
+
+// A basin loaded by the server: its forcing (mapped from the shared memory segment) and the
+// model instance and objectives shared read-only by the worker threads
+struct server_basin
+{
+    string segment;
+    hymod_forcing forcing;
+    HyMod model;
+    objective_config objectives;
+};
+
+// A session. Sockets are non-blocking: bytes are read as they arrive and parsed once a whole
+// frame is there, and responses are queued and sent as the client takes them, so a slow client
+// never holds up the others.
+struct server_client
+{
+    int fd;
+    int basin;              //-1 until the hello has been read
+    bool ending;            //The session has ended, close once the queued output is sent
+    vector<char> input;     //Bytes received that do not yet make up a whole frame
+    vector<char> output;    //Bytes queued for the client
+    size_t sent;            //Bytes of output already sent
+};
+
+// Parameter sets received from a client, waiting for the next batch
+struct server_request
+{
+    int client;
+    int basin;
+    int nSets;
+    vector<double> parameters;
+    vector<double> results;
+};
+
+// HYMOD_LANES (or fewer) sets of one request, evaluated together by a worker
+struct server_task
+{
+    int request;
+    int first;
+    int nSets;
+};
+
+static volatile sig_atomic_t stopRequested = 0;
+
+// Segments published by this server. They are removed at exit, including when a basin fails to
+// load after others have been published (the readers report errors with exit).
+static vector<string> publishedSegments;
+
+static void remove_published_segments()
+{
+    for (size_t s = 0; s < publishedSegments.size(); s++) shm_unlink(publishedSegments[s].c_str());
+    publishedSegments.clear();
+}
+
+static void request_stop(int)
+{
+    stopRequested = 1;
+}
+
+static void load_basin(vector<server_basin> &basins, int b, const server_config &config, string basinFile)
+{
+    server_basin *basin = &basins[b];
+    MOPEXData data;
+    readMOPEXData(&data, basinFile);
+
+    // Segments are named after the server's process and the gage, with the index appended if an
+    // earlier basin has the same gage, so servers running at the same time never share a name
+    basin->segment = "/hymod." + to_string(getpid()) + "." + data.ID;
+    for (int other = 0; other < b; other++)
+        if (basins[other].segment == basin->segment) basin->segment += "." + to_string(b);
+    publishMOPEXShared(&data, basin->segment);
+    publishedSegments.push_back(basin->segment);
+    freeMOPEXData(&data);
+
+    // Evaluate from the segment, so the server holds the same single copy as every other reader
+    init_hymod_forcing_dates(&basin->forcing, "shm:" + basin->segment, config.startDate, config.endDate);
+    init_hymod(&basin->model, &basin->forcing, false, config.Nq, config.pdmKernel);
+    init_objectives(&basin->objectives, &basin->forcing, config.metricList, config.warmup);
+}
+
+static int listen_on(string socketPath)
+{
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(address.sun_path))
+    {
+        cout << "The socket path " << socketPath << " is too long" << endl;
+        exit(1);
+    }
+    strcpy(address.sun_path, socketPath.c_str());
+
+    // A socket file left by a server that was killed is replaced, one that a server is using is not
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, (sockaddr *) &address, sizeof(address)) == 0)
+    {
+        cout << "Another server is listening on the socket " << socketPath << endl;
+        exit(1);
+    }
+    if (fd >= 0) close(fd);
+    unlink(socketPath.c_str());
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, (sockaddr *) &address, sizeof(address)) != 0 || listen(fd, SOMAXCONN) != 0)
+    {
+        cout << "Could not listen on the socket " << socketPath << ": " << strerror(errno) << endl;
+        exit(1);
+    }
+    return fd;
+}
+
+// Receive what a client has sent so far, up to a limit per call so that one client cannot keep
+// the server from the others. Returns false if the connection is closed or fails.
+static bool receive_client(server_client *client)
+{
+    const size_t chunk = 1 << 16, limit = 1 << 20;
+    size_t received = 0;
+
+    while (received < limit)
+    {
+        size_t size = client->input.size();
+        client->input.resize(size + chunk);
+        ssize_t n = recv(client->fd, &client->input[size], chunk, 0);
+        client->input.resize(size + max(n, (ssize_t) 0));
+
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+        if (n <= 0) return false;
+        received += n;
+    }
+    return true;
+}
+
+static void queue_output(server_client *client, const void *data, size_t size)
+{
+    const char *bytes = (const char *) data;
+    client->output.insert(client->output.end(), bytes, bytes + size);
+}
+
+// Parse the hello and every whole request frame a client has sent, queueing the requests.
+// A frame of zero sets (or an invalid one) ends the session.
+static void parse_client(server_client *client, int index, const vector<server_basin> &basins, vector<server_request> &requests)
+{
+    const int nParams = 8;
+    bool swapped = !host_is_little_endian();
+    size_t parsed = 0;
+
+    while (!client->ending && client->input.size() - parsed >= sizeof(uint32_t))
+    {
+        uint32_t value;
+        memcpy(&value, &client->input[parsed], sizeof(value));
+        if (swapped) swap_bytes(&value, 1, sizeof(value));
+
+        if (client->basin < 0)
+        {
+            uint32_t nValues = (value < basins.size()) ? basins[value].objectives.metrics.size() : 0;
+            client->ending = (nValues == 0);
+            client->basin = value;
+            if (swapped) swap_bytes(&nValues, 1, sizeof(nValues));
+            queue_output(client, &nValues, sizeof(nValues));
+            parsed += sizeof(value);
+            continue;
+        }
+
+        if (value == 0 || value > SERVER_MAX_FRAME_SETS)
+        {
+            client->ending = true;
+            break;
+        }
+
+        size_t size = (size_t) value*nParams*sizeof(double);
+        if (client->input.size() - parsed - sizeof(value) < size) break;
+
+        server_request request;
+        request.client = index;
+        request.basin = client->basin;
+        request.nSets = value;
+        request.parameters.resize((size_t) value*nParams);
+        memcpy(&request.parameters[0], &client->input[parsed + sizeof(value)], size);
+        if (swapped) swap_bytes(&request.parameters[0], request.parameters.size(), sizeof(double));
+        requests.push_back(request);
+        parsed += sizeof(value) + size;
+    }
+
+    client->input.erase(client->input.begin(), client->input.begin() + parsed);
+}
+
+// Evaluate every pending request in one pass of the thread pool
+static void evaluate_requests(ThreadPool &pool, const vector<server_basin> &basins, vector<server_request> &requests)
+{
+    const int nParams = 8;
+    vector<server_task> tasks;
+
+    for (size_t r = 0; r < requests.size(); r++)
+    {
+        server_request &request = requests[r];
+        request.results.resize((size_t) request.nSets*basins[request.basin].objectives.metrics.size());
+        for (int first = 0; first < request.nSets; first += HYMOD_LANES)
+        {
+            server_task task = {(int) r, first, min(HYMOD_LANES, request.nSets - first)};
+            tasks.push_back(task);
+        }
+    }
+
+    pool.run(tasks.size(), [&](int t, int) {
+        server_request &request = requests[tasks[t].request];
+        const server_basin &basin = basins[request.basin];
+        double *sets[HYMOD_LANES];
+
+        for (int s = 0; s < tasks[t].nSets; s++) sets[s] = &request.parameters[(size_t) (tasks[t].first + s)*nParams];
+        evaluate_objectives(&basin.model, basin.objectives, sets, tasks[t].nSets,
+                            &request.results[(size_t) tasks[t].first*basin.objectives.metrics.size()]);
+    });
+}
+
+// Queue the response frame of a request
+static void queue_response(server_client *client, server_request &request)
+{
+    uint32_t header[2] = {(uint32_t) request.nSets, (uint32_t) (request.results.size()/request.nSets)};
+
+    if (!host_is_little_endian())
+    {
+        swap_bytes(header, 2, sizeof(uint32_t));
+        swap_bytes(&request.results[0], request.results.size(), sizeof(double));
+    }
+    queue_output(client, header, sizeof(header));
+    queue_output(client, &request.results[0], request.results.size()*sizeof(double));
+}
+
+// Send as much of the queued output as the client's socket takes now.
+// Returns false if the client has gone away.
+static bool flush_client(server_client *client)
+{
+    while (client->sent < client->output.size())
+    {
+        // A peer that has gone away gives an error rather than SIGPIPE
+        ssize_t n = send(client->fd, &client->output[client->sent], client->output.size() - client->sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+        if (n <= 0) return false;
+        client->sent += n;
+    }
+    client->output.clear();
+    client->sent = 0;
+    return true;
+}
+
+static void close_client(server_client *client)
+{
+    close(client->fd);
+    client->fd = -1;
+}
+
+void run_server(const server_config &config, const vector<string> &basinFiles)
+{
+    // The socket is taken first, so a server refused it has not published any segments
+    int listener = listen_on(config.socketPath);
+
+    atexit(remove_published_segments);
+    vector<server_basin> basins(basinFiles.size());
+    for (size_t b = 0; b < basinFiles.size(); b++)
+    {
+        load_basin(basins, b, config, basinFiles[b]);
+        cerr << "hymod: basin " << b << " (" << basins[b].forcing.data.ID << ", " << basins[b].forcing.nDays
+             << " steps) in shared memory segment " << basins[b].segment << endl;
+    }
+
+    // Stop cleanly on SIGINT/SIGTERM: without SA_RESTART, poll() returns EINTR and the loop ends
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = request_stop;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    cerr << "hymod: listening on " << config.socketPath << endl;
+
+    ThreadPool pool(config.nThreads);
+    vector<server_client> clients;
+    vector<server_request> requests;
+    vector<pollfd> polled;
+
+    while (!stopRequested)
+    {
+        // Clients are read from while their unsent output is below SERVER_MAX_QUEUED_OUTPUT, which
+        // bounds the memory held for a client that sends requests without reading the responses
+        polled.clear();
+        pollfd listening = {listener, POLLIN, 0};
+        polled.push_back(listening);
+        for (size_t c = 0; c < clients.size(); c++)
+        {
+            const server_client &client = clients[c];
+            bool reading = !client.ending && client.output.size() - client.sent < SERVER_MAX_QUEUED_OUTPUT;
+            pollfd entry = {client.fd, (short) ((reading ? POLLIN : 0) | (client.output.empty() ? 0 : POLLOUT)), 0};
+            polled.push_back(entry);
+        }
+
+        if (poll(&polled[0], polled.size(), -1) < 0)
+        {
+            if (errno == EINTR) continue;
+            cout << "The server could not wait for requests: " << strerror(errno) << endl;
+            exit(1);
+        }
+
+        // Send queued output, and take the whole frames that have arrived from every client
+        for (size_t c = 0; c < clients.size(); c++)
+        {
+            server_client *client = &clients[c];
+            short events = polled[c+1].revents;
+            if (events == 0) continue;
+
+            // A client that has closed its socket can no longer be answered
+            if ((events & (POLLHUP | POLLERR)) || ((events & POLLOUT) && !flush_client(client)))
+            {
+                close_client(client);
+                continue;
+            }
+            if (events & POLLIN)
+            {
+                // Frames received before the client stopped sending are still answered
+                bool open = receive_client(client);
+                parse_client(client, c, basins, requests);
+                if (!open) client->ending = true;
+            }
+        }
+
+        // Answer all of the requests together
+        if (!requests.empty())
+        {
+            evaluate_requests(pool, basins, requests);
+            for (size_t r = 0; r < requests.size(); r++)
+            {
+                server_client *client = &clients[requests[r].client];
+                if (client->fd < 0) continue;
+                queue_response(client, requests[r]);
+                if (!flush_client(client)) close_client(client);
+            }
+            requests.clear();
+        }
+
+        // Sessions end once their output has been sent
+        size_t open = 0;
+        for (size_t c = 0; c < clients.size(); c++)
+        {
+            if (clients[c].fd >= 0 && clients[c].ending && clients[c].output.empty()) close_client(&clients[c]);
+            if (clients[c].fd >= 0) swap(clients[open++], clients[c]);
+        }
+        clients.resize(open);
+
+        if (polled[0].revents & POLLIN)
+        {
+            int fd = accept(listener, NULL, NULL);
+            if (fd >= 0 && fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == 0)
+            {
+                clients.push_back(server_client());
+                clients.back().fd = fd;
+                clients.back().basin = -1;
+                clients.back().ending = false;
+                clients.back().sent = 0;
+            }
+            else if (fd >= 0)
+                close(fd);
+        }
+    }
+
+    for (size_t c = 0; c < clients.size(); c++) close(clients[c].fd);
+    close(listener);
+    unlink(config.socketPath.c_str());
+
+    for (size_t b = 0; b < basins.size(); b++)
+    {
+        hymod_delete(&basins[b].model);
+        delete_hymod_forcing(&basins[b].forcing);
+    }
+    remove_published_segments();
+    cerr << "hymod: server stopped" << endl;
+}
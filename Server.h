@@ -0,0 +1,61 @@
+/*
+Copyright (C) 2010-2013 Jon Herman, Josh Kollat, and others.
+
+Hymod is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Hymod is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with Hymod.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "HyMod.h"
+
+// Settings of a model server (hymod -P)
+struct server_config
+{
+    string socketPath;      //Unix socket the server listens on
+    string metricList;      //Objectives returned for each parameter set (see Objectives.h)
+    int warmup;             //Days at the start of the simulation excluded from the objectives
+    int startDate[3];       //Simulation period, the same for every basin
+    int endDate[3];
+    int Nq;
+    int pdmKernel;
+    int nThreads;
+};
+
+// Sessions over the socket. A client opens one with
+//
+//   hello:    uint32 basin (index of the forcing file in the server's list, from 0)
+//   reply:    uint32 nValues (objectives per parameter set), or 0 if there is no such basin
+//
+// and then exchanges frames as in Protocol.h (little-endian):
+//
+//   request:  uint32 nSets, then nSets records of 8 float64 parameters (in the order of calc_hymod)
+//   response: uint32 nSets, uint32 nValues, then nSets records of nValues float64 results
+//
+// A client may send several frames before reading the responses, which come back in order. The
+// server stops reading from a client whose unread responses exceed SERVER_MAX_QUEUED_OUTPUT bytes
+// until it takes them, so a client that keeps writing without reading will block.
+// A frame of zero sets, or closing the socket, ends the session. See Client.h for a client.
+#define SERVER_MAX_FRAME_SETS (1 << 20)
+#define SERVER_MAX_QUEUED_OUTPUT (1 << 26)
+
+// Load each basin once, publish its forcing as a POSIX shared memory segment (/hymod.<pid>.<gage ID>,
+// which other processes can read as shm:/hymod.<pid>.<gage ID>; the names are printed at startup) and
+// serve sessions until SIGINT or SIGTERM. The server waits for requests from any number of clients
+// without blocking on any of them, evaluates the parameter sets of all whole request frames received
+// together on the worker threads, HYMOD_LANES sets of a basin per task, and queues the responses,
+// which are sent as each client reads them. The socket and the segments are removed when the server stops.
+void run_server(const server_config &config, const vector<string> &basinFiles);
+
+#endif
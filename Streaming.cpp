@@ -0,0 +1,130 @@
+/*
+Copyright (C) 2010-2013 Jon Herman, Josh Kollat, and others.
+
+Hymod is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Hymod is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with Hymod.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "Streaming.h"
+#include "HyModBatch.h"
+#include "ThreadPool.h"
+
+// Largest number of streamflow values held for one chunk (all sets), which sets the chunk length
+const size_t streamValues = 1 << 22;
+
+// Longest chunk, a year of hourly steps
+const int maxChunkSteps = 8784;
+
+void run_streaming(const streaming_config &config, string dataFile, const vector<double> &parameters, ostream &out)
+{
+    const int nParams = 8;
+    int nSets = parameters.size() / nParams;
+    int nBatches = (nSets + HYMOD_LANES - 1) / HYMOD_LANES;
+    // At least one step per chunk, even when the flows of a single step exceed streamValues
+    int chunkSteps = (int) max((size_t) 1, min((size_t) maxChunkSteps, streamValues / max(nSets, 1)));
+
+    MOPEXStream stream;
+    openMOPEXStream(&stream, dataFile, chunkSteps);
+
+    // The forcing of the model is pointed at each chunk in turn, with the PE of that chunk
+    hymod_forcing forcing;
+    forcing.data = stream.data;
+    forcing.nDays = 0;
+    forcing.startingIndex = 0;
+    forcing.memberPE = NULL;
+    HyMod model;
+    init_hymod(&model, &forcing, false, config.Nq, config.pdmKernel);
+
+    ThreadPool pool(config.nThreads);
+    vector<double> PE(chunkSteps);
+    vector<double> flows((size_t) chunkSteps * nSets);
+    vector<hymod_state> states(nSets);
+    for (int s = 0; s < nSets; s++) init_hymod_state(&states[s]);
+
+    // Header row
+    out << "year\tmonth\tday\tstep";
+    for (int s = 0; s < nSets; s++) out << "\tQ" << s;
+    out << "\n";
+
+    int stepOfDay = 0;
+    int previousDate[3] = {0, 0, 0};
+    bool started = false, finished = false;
+    int nSteps;
+
+    while (!finished && (nSteps = readMOPEXChunk(&stream)) > 0)
+    {
+        const MOPEXData &data = stream.data;
+
+        // Steps of the chunk inside the simulation period
+        int first = 0, last = nSteps;
+        if (config.periodGiven)
+        {
+            while (first < nSteps && compare_dates(data.date[first], config.startDate) < 0) first++;
+            last = first;
+            while (last < nSteps && compare_dates(data.date[last], config.endDate) <= 0) last++;
+            finished = (last < nSteps);
+        }
+        if (first == last) continue;
+        started = true;
+
+        HYMOD_STAGE_BEGIN(STAGE_PE);
+        calculateHamonPE(&data, &PE[0]);
+        HYMOD_STAGE_END(STAGE_PE);
+
+        forcing.data = data;
+        forcing.startingIndex = first;
+        forcing.nDays = last - first;
+        forcing.PE = &PE[first];
+
+        pool.run(nBatches, [&](int batch, int) {
+            int firstSet = batch * HYMOD_LANES;
+            int n = min(HYMOD_LANES, nSets - firstSet);
+            double *sets[HYMOD_LANES];
+
+            for (int s = 0; s < n; s++) sets[s] = (double *) &parameters[(size_t) (firstSet + s) * nParams];
+
+            auto store = [&](int modelDay, const double *Q) {
+                double *row = &flows[(size_t) modelDay * nSets + firstSet];
+                for (int s = 0; s < n; s++) row[s] = Q[s];
+            };
+            calc_hymod_batch_lean(&model, sets, n, store, &states[firstSet]);
+        });
+
+        HYMOD_STAGE_BEGIN(STAGE_OUTPUT);
+        for (int i = first; i < last; i++)
+        {
+            const int *date = data.date[i];
+            stepOfDay = (compare_dates(date, previousDate) == 0) ? stepOfDay + 1 : 0;
+            memcpy(previousDate, date, sizeof(previousDate));
+
+            out << date[0] << "\t" << date[1] << "\t" << date[2] << "\t" << stepOfDay;
+            const double *row = &flows[(size_t) (i - first) * nSets];
+            for (int s = 0; s < nSets; s++) out << "\t" << row[s];
+            out << "\n";
+        }
+        out.flush();
+        HYMOD_STAGE_END(STAGE_OUTPUT);
+        HYMOD_INSTRUMENT_POLL();
+    }
+
+    if (config.periodGiven && !started)
+    {
+        const int *s = config.startDate, *e = config.endDate;
+        cout << "The simulation period " << s[0] << "-" << s[1] << "-" << s[2] << " to "
+             << e[0] << "-" << e[1] << "-" << e[2] << " is not covered by the data in " << dataFile << endl;
+        exit(1);
+    }
+
+    hymod_delete(&model);
+    closeMOPEXStream(&stream);
+}
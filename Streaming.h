@@ -0,0 +1,43 @@
+/*
+Copyright (C) 2010-2013 Jon Herman, Josh Kollat, and others.
+
+Hymod is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Hymod is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with Hymod.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef STREAMING_H
+#define STREAMING_H
+
+#include <vector>
+
+#include "HyMod.h"
+
+// Settings of a streaming run
+struct streaming_config
+{
+    int Nq;                 //Number of quickflow reservoirs
+    int pdmKernel;          //Evaluation of the soil moisture power terms (pdm_kernel)
+    int nThreads;
+    bool periodGiven;       //Only simulate from startDate to endDate (otherwise the whole file)
+    int startDate[3];
+    int endDate[3];
+};
+
+// Run every parameter set (8 values each, in the order of calc_hymod) over a forcing file read a chunk
+// of time steps at a time, writing one row per time step as the chunks are done: the date, the step
+// within the day, then the streamflow of each set. The states are carried from one chunk to the next,
+// so the results are those of a single run, and memory use depends on the number of sets but not on
+// the length of the record.
+void run_streaming(const streaming_config &config, string dataFile, const vector<double> &parameters, ostream &out);
+
+#endif
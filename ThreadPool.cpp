@@ -0,0 +1,141 @@
+/*
+Copyright (C) 2010-2013 Jon Herman, Josh Kollat, and others.
+
+Hymod is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Hymod is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with Hymod.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "ThreadPool.h"
+
+ThreadPool::ThreadPool(int nThreads)
+{
+    if (nThreads < 1) nThreads = 1;
+
+    job = NULL;
+    generation = 0;
+    remaining = 0;
+    busy = 0;
+    stopping = false;
+
+    for (int w = 0; w < nThreads; w++) queues.push_back(new WorkQueue);
+
+    // Worker 0 is the thread calling run()
+    for (int w = 1; w < nThreads; w++) threads.push_back(thread(&ThreadPool::worker_main, this, w));
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+
+    for (size_t i = 0; i < threads.size(); i++) threads[i].join();
+    for (size_t w = 0; w < queues.size(); w++) delete queues[w];
+}
+
+void ThreadPool::run(int nTasks, const function<void(int, int)> &task)
+{
+    if (nTasks <= 0) return;
+    int nWorkers = size();
+
+    {
+        lock_guard<mutex> guard(lock);
+
+        // Hand each worker a contiguous block of tasks so neighbouring tasks stay on one thread
+        for (int w = 0; w < nWorkers; w++)
+        {
+            lock_guard<mutex> queueGuard(queues[w]->lock);
+            int first = (int) ((long) nTasks * w / nWorkers);
+            int last  = (int) ((long) nTasks * (w+1) / nWorkers);
+            for (int i = first; i < last; i++) queues[w]->tasks.push_back(i);
+        }
+
+        job = &task;
+        remaining = nTasks;
+        busy = nWorkers-1;
+        generation++;
+    }
+    wake.notify_all();
+
+    work(0);
+
+    // Wait for the other workers to finish their tasks and stop looking at the queues
+    unique_lock<mutex> guard(lock);
+    finished.wait(guard, [this] { return remaining == 0 && busy == 0; });
+    job = NULL;
+}
+
+// Take the next task for a worker: from the back of its own queue, otherwise steal from the front of another
+bool ThreadPool::next_task(int worker, int &task)
+{
+    int nWorkers = size();
+
+    for (int i = 0; i < nWorkers; i++)
+    {
+        int victim = (worker + i) % nWorkers;
+        WorkQueue *queue = queues[victim];
+        lock_guard<mutex> guard(queue->lock);
+
+        if (queue->tasks.empty()) continue;
+
+        if (i == 0)
+        {
+            task = queue->tasks.back();
+            queue->tasks.pop_back();
+        }
+        else
+        {
+            task = queue->tasks.front();
+            queue->tasks.pop_front();
+        }
+        return true;
+    }
+
+    return false;
+}
+
+void ThreadPool::work(int worker)
+{
+    int task;
+    int completed = 0;
+
+    while (next_task(worker, task))
+    {
+        (*job)(task, worker);
+        completed++;
+    }
+
+    lock_guard<mutex> guard(lock);
+    remaining -= completed;
+    if (worker != 0) busy--;
+    if (remaining == 0 && busy == 0) finished.notify_all();
+}
+
+void ThreadPool::worker_main(int worker)
+{
+    long seen = 0;
+
+    while (true)
+    {
+        {
+            unique_lock<mutex> guard(lock);
+            wake.wait(guard, [this, seen] { return stopping || generation != seen; });
+            if (stopping) return;
+            seen = generation;
+        }
+
+        work(worker);
+    }
+}
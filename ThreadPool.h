@@ -0,0 +1,70 @@
+/*
+Copyright (C) 2010-2013 Jon Herman, Josh Kollat, and others.
+
+Hymod is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Hymod is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with Hymod.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+#include <functional>
+
+using namespace std;
+
+// Work-stealing thread pool. Each call to run() splits the tasks into contiguous
+// blocks, one per worker; a worker takes tasks from the back of its own queue and,
+// once that is empty, steals from the front of the other queues. The calling thread
+// takes part as worker 0, so a pool of one thread runs everything inline.
+class ThreadPool
+{
+public:
+    ThreadPool(int nThreads);
+    ~ThreadPool();
+
+    int size() const { return (int) queues.size(); }
+
+    // Call task(i, worker) for every i in [0, nTasks) and return once all have finished.
+    // worker is in [0, size()) and can be used to index per-thread scratch space.
+    void run(int nTasks, const function<void(int, int)> &task);
+
+private:
+    struct WorkQueue
+    {
+        mutex lock;
+        deque<int> tasks;
+    };
+
+    bool next_task(int worker, int &task);
+    void work(int worker);
+    void worker_main(int worker);
+
+    vector<WorkQueue*> queues;
+    vector<thread> threads;
+
+    mutex lock;
+    condition_variable wake;     // signalled when a new set of tasks is posted (or on shutdown)
+    condition_variable finished; // signalled when the last task of a run completes
+    const function<void(int, int)> *job;
+    long generation;             // incremented by each call to run()
+    int remaining;               // tasks of the current run not yet completed
+    int busy;                    // helper threads still working on the current run
+    bool stopping;
+};
+
+#endif
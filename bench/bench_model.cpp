@@ -0,0 +1,175 @@
+/*
+Copyright (C) 2010-2013 Jon Herman, Josh Kollat, and others.
+
+Hymod is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Hymod is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with Hymod.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Throughput of whole model evaluations (full history, lean and batched) and per-day cost of
+// each model component on the default simulation period of a forcing file.
+
+#include <chrono>
+
+#include "HyMod.h"
+#include "HyModBatch.h"
+
+// Time period used by main: 10/1/1961 to 9/29/1972
+const int nDays = 4017;
+const int startingIndex = 5023-1;
+
+static double seconds_since(chrono::steady_clock::time_point start)
+{
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        cerr << "Usage: bench_model forcing_data_file [evaluations]" << endl;
+        return 1;
+    }
+    int nEvals = (argc > 2) ? atoi(argv[2]) : 400;
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    hymod_forcing forcing;
+    init_hymod_forcing(&forcing, argv[1], startingIndex, nDays);
+    cout << "readMOPEXData + Hamon PE: " << seconds_since(start)*1e3 << " ms" << endl;
+
+    // A spread of parameter sets within the usual ranges
+    vector<double> parameters((size_t) nEvals * 8);
+    for (int s = 0; s < nEvals; s++)
+    {
+        double u = (s + 0.5) / nEvals;
+        double *p = &parameters[(size_t) s * 8];
+        p[0] = 0.001 + 0.099*u;             // Ks
+        p[1] = 0.1 + 0.89*(1.0-u);          // Kq
+        p[2] = 0.05 + 1.9*u;                // DDF
+        p[3] = -3.0 + 6.0*u;                // Tb
+        p[4] = 3.0 - 6.0*u;                 // Tth
+        p[5] = 0.1 + 0.8*u;                 // alpha
+        p[6] = 0.05 + 1.9*(1.0-u);          // B
+        p[7] = 10.0 + 490.0*u;              // Huz
+    }
+
+    // Whole evaluations
+    double checksum = 0.0;
+    HyMod model;
+    init_hymod(&model, &forcing);
+    start = chrono::steady_clock::now();
+    for (int s = 0; s < nEvals; s++)
+    {
+        calc_hymod(&model, &parameters[(size_t) s * 8]);
+        checksum += model.fluxes.Q[nDays-1];
+    }
+    double tFull = seconds_since(start);
+    cout << "calc_hymod:            " << nEvals/tFull << " evaluations/s" << endl;
+
+    double sum = 0.0;
+    auto accumulate = [&](int, double Q) { sum += Q; };
+    start = chrono::steady_clock::now();
+    for (int s = 0; s < nEvals; s++) calc_hymod_lean(&model, &parameters[(size_t) s * 8], accumulate);
+    double tLean = seconds_since(start);
+    cout << "calc_hymod_lean:       " << nEvals/tLean << " evaluations/s" << endl;
+
+    // The batched model with each soil moisture kernel
+    const char *kernelNames[] = {"pow", "fast", "approx"};
+    double batchSum = 0.0;
+    auto accumulateBatch = [&](int, const double *Q) { batchSum += Q[0]; };
+    for (int kernel = PDM_POW; kernel <= PDM_APPROX; kernel++)
+    {
+        model.parameters.pdmKernel = kernel;
+        start = chrono::steady_clock::now();
+        for (int s = 0; s < nEvals; s += HYMOD_LANES)
+        {
+            double *sets[HYMOD_LANES];
+            int n = min(HYMOD_LANES, nEvals - s);
+            for (int l = 0; l < n; l++) sets[l] = &parameters[(size_t) (s + l) * 8];
+            calc_hymod_batch_lean(&model, sets, n, accumulateBatch);
+        }
+        double tBatch = seconds_since(start);
+        cout << "calc_hymod_batch_lean: " << nEvals/tBatch << " evaluations/s (" << HYMOD_LANES << " lanes, "
+             << kernelNames[kernel] << " kernel)" << endl;
+    }
+    model.parameters.pdmKernel = PDM_POW;
+
+    // Components, each run over the simulation period for every parameter set with the
+    // inputs it sees in the model (so that branches take realistic paths)
+    hymod_parameters p = model.parameters;
+    hymod_step_fluxes fluxes;
+    vector<double> effPrecip((size_t) nDays), OV((size_t) nDays);
+    double tSnow = 0.0, tSoil[3] = {0.0, 0.0, 0.0}, tNash = 0.0;
+
+    for (int s = 0; s < nEvals; s++)
+    {
+        hymod_state state;
+        set_hymod_parameters(&p, &parameters[(size_t) s * 8]);
+
+        init_hymod_state(&state);
+        start = chrono::steady_clock::now();
+        for (int day = 0; day < nDays; day++)
+        {
+            effPrecip[day] = snowDD(&p, &state, forcing.data.precip[startingIndex + day], forcing.data.avgTemp[startingIndex + day], &fluxes);
+        }
+        tSnow += seconds_since(start);
+
+        // Kernels in reverse order, so that the overflow saved for the routing comes from pow
+        for (int kernel = PDM_APPROX; kernel >= PDM_POW; kernel--)
+        {
+            p.pdmKernel = kernel;
+            set_hymod_parameters(&p, &parameters[(size_t) s * 8]);
+            init_hymod_state(&state);
+            start = chrono::steady_clock::now();
+            for (int day = 0; day < nDays; day++)
+            {
+                fluxes.effPrecip = effPrecip[day];
+                PDM_soil_moisture(&p, &state, forcing.PE[day], &fluxes);
+                OV[day] = fluxes.OV;
+            }
+            tSoil[kernel] += seconds_since(start);
+        }
+
+        init_hymod_state(&state);
+        start = chrono::steady_clock::now();
+        for (int day = 0; day < nDays; day++)
+        {
+            checksum += Nash(p.Kq, p.Nq, p.alpha*OV[day], state.Xq);
+            checksum += Nash(p.Ks, 1, (1.0-p.alpha)*OV[day], &state.Xs);
+        }
+        tNash += seconds_since(start);
+    }
+
+    double perDay = 1e9/(double(nEvals)*nDays);
+    cout << "snowDD:                " << tSnow*perDay << " ns/day" << endl;
+    for (int kernel = PDM_POW; kernel <= PDM_APPROX; kernel++)
+        cout << "PDM_soil_moisture:     " << tSoil[kernel]*perDay << " ns/day (" << kernelNames[kernel] << " kernel)" << endl;
+    cout << "Nash (quick + slow):   " << tNash*perDay << " ns/day" << endl;
+
+    vector<double> PE((size_t) forcing.data.nDays);
+    int repeats = 50;
+    start = chrono::steady_clock::now();
+    for (int r = 0; r < repeats; r++)
+    {
+        calculateHamonPE(&forcing.data, &PE[0]);
+        checksum += PE[r];
+    }
+    cout << "calculateHamonPE:      " << seconds_since(start)*1e9/(double(repeats)*forcing.data.nDays) << " ns/day ("
+         << forcing.data.nDays << " days)" << endl;
+
+    // Keep the results alive so that none of the loops are optimised away
+    if (checksum + sum + batchSum == 0.123456789) cout << endl;
+
+    hymod_delete(&model);
+    delete_hymod_forcing(&forcing);
+    return 0;
+}
@@ -0,0 +1,100 @@
+/*
+Copyright (C) 2010-2013 Jon Herman, Josh Kollat, and others.
+
+Hymod is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Hymod is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with Hymod.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Per-day cost of routing through the quickflow and slowflow Nash cascades, comparing the
+// original version (which allocated a temporary array on every call) with the run-time
+// dispatched and the compile-time specialised kernels.
+
+#include <chrono>
+
+#include "HyMod.h"
+
+// The original routing kernel, kept here as the baseline
+static double Nash_original(double K, int N, double Qin, double *X)
+{
+    double *OO = new double[N];
+    double Qout;
+
+    for (int Res = 0; Res < N; Res++)
+    {
+        OO[Res] = K*X[Res];
+        X[Res]  = X[Res] - OO[Res];
+
+        if (Res==0) X[Res] = X[Res] + Qin; 
+        else        X[Res] = X[Res] + OO[Res-1];
+    }
+
+    Qout = OO[N-1];
+    delete[] OO;
+    return Qout;
+}
+
+// Route the inflow series through both cascades, returning ns per simulated day
+template <class Route>
+static double time_routing(Route route, const vector<double> &inflow, int repeats, double &checksum)
+{
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    checksum = 0.0;
+
+    for (int r = 0; r < repeats; r++)
+    {
+        double Xq[HYMOD_MAX_NQ] = {0};
+        double Xs = 0.0;
+        for (size_t day = 0; day < inflow.size(); day++) checksum += route(inflow[day], Xq, &Xs);
+    }
+
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    return seconds*1e9/(double(repeats)*inflow.size());
+}
+
+template <int NQ>
+static void compare(const vector<double> &inflow, int repeats)
+{
+    const double Kq = 0.5, Ks = 0.05, alpha = 0.7;
+    double sumOriginal, sumRuntime, sumTemplate;
+
+    double tOriginal = time_routing([&](double in, double *Xq, double *Xs) {
+        return Nash_original(Kq, NQ, alpha*in, Xq) + Nash_original(Ks, 1, (1.0-alpha)*in, Xs);
+    }, inflow, repeats, sumOriginal);
+
+    double tRuntime = time_routing([&](double in, double *Xq, double *Xs) {
+        return Nash(Kq, NQ, alpha*in, Xq) + Nash(Ks, 1, (1.0-alpha)*in, Xs);
+    }, inflow, repeats, sumRuntime);
+
+    double tTemplate = time_routing([&](double in, double *Xq, double *Xs) {
+        return Nash<NQ>(Kq, alpha*in, Xq) + Nash<1>(Ks, (1.0-alpha)*in, Xs);
+    }, inflow, repeats, sumTemplate);
+
+    cout << "Nq = " << NQ << ": original " << tOriginal << " ns/day, run-time dispatch " << tRuntime
+         << " ns/day, specialised " << tTemplate << " ns/day"
+         << ((sumOriginal == sumRuntime && sumOriginal == sumTemplate) ? "" : " (RESULTS DIFFER)") << endl;
+}
+
+int main(int argc, char **argv)
+{
+    int repeats = (argc > 1) ? atoi(argv[1]) : 200;
+
+    // A synthetic inflow series with the length of the default simulation
+    vector<double> inflow(4017);
+    for (size_t day = 0; day < inflow.size(); day++) inflow[day] = (day % 7 == 0) ? 5.0 + (day % 13) : 0.1*(day % 3);
+
+    compare<1>(inflow, repeats);
+    compare<2>(inflow, repeats);
+    compare<3>(inflow, repeats);
+    compare<4>(inflow, repeats);
+    return 0;
+}
@@ -0,0 +1,118 @@
+/*
+Copyright (C) 2010-2013 Jon Herman, Josh Kollat, and others.
+
+Hymod is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Hymod is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with Hymod.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Parse throughput of readMOPEXData on a MOPEX text file, compared with the
+// original iostream parser (scan for each header key, then operator>> for every value)
+// and with loading the same data from the memory-mapped binary format.
+
+#include <chrono>
+#include <sys/stat.h>
+
+#include "MOPEXData.h"
+
+using namespace std;
+
+// The original parser, kept here as the baseline
+static void readMOPEXData_iostream(MOPEXData *data, string filename)
+{
+    ifstream in(filename.c_str(), ios_base::in);
+    string sJunk = "";
+    double dTemp;
+    const char *keys[] = {"<GAGE_ID>", "<GAGE_LATITUDE>", "<GAGE_LONGITUDE>", "<DRAINAGE_AREA>", "<TIME_STEPS>"};
+
+    for (int k = 0; k < 5; k++)
+    {
+        while (sJunk != keys[k]) in >> sJunk;
+        switch (k)
+        {
+            case 0: in >> data->ID; break;
+            case 1: in >> data->gageLat; break;
+            case 2: in >> data->gageLong; break;
+            case 3: in >> data->DA; break;
+            case 4: in >> data->nDays; break;
+        }
+        in.seekg(0, ios::beg);
+    }
+
+    data->date = new int [data->nDays][3];
+    data->precip   = new double[data->nDays];
+    data->evap     = new double[data->nDays];
+    data->flow     = new double[data->nDays];
+    data->maxTemp  = new double[data->nDays];
+    data->minTemp  = new double[data->nDays];
+    data->avgTemp  = new double[data->nDays];
+    data->mapping = NULL;
+
+    while (sJunk != "<DATA_START>") in >> sJunk;
+    in.ignore(1000,'\n');
+
+    for (int i=0; i<data->nDays; i++)
+    {
+        in >> dTemp; data->date[i][0] = int(dTemp);
+        in >> dTemp; data->date[i][1] = int(dTemp);
+        in >> dTemp; data->date[i][2] = int(dTemp);
+        in >> data->precip[i] >> data->evap[i] >> data->flow[i] >> data->maxTemp[i] >> data->minTemp[i];
+        in.ignore(1000,'\n');
+        data->avgTemp[i] = (data->maxTemp[i] + data->minTemp[i])/2.0;
+    }
+}
+
+// Average time of one call to load(), in seconds
+template <class Load>
+static double time_load(Load load, int repeats)
+{
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (int r = 0; r < repeats; r++)
+    {
+        MOPEXData data;
+        load(&data);
+        freeMOPEXData(&data);
+    }
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count()/repeats;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        cerr << "Usage: bench_parse mopex_text_file [repeats]" << endl;
+        return 1;
+    }
+    string filename = argv[1];
+    int repeats = (argc > 2) ? atoi(argv[2]) : 20;
+
+    struct stat info;
+    stat(filename.c_str(), &info);
+    double MB = info.st_size/1.0e6;
+
+    string binaryFile = "bench_parse.tmp.bin";
+    MOPEXData data;
+    readMOPEXData(&data, filename);
+    writeMOPEXBinary(&data, binaryFile);
+    freeMOPEXData(&data);
+
+    double tText = time_load([&](MOPEXData *d) { readMOPEXData(d, filename); }, repeats);
+    double tOld  = time_load([&](MOPEXData *d) { readMOPEXData_iostream(d, filename); }, repeats);
+    double tBin  = time_load([&](MOPEXData *d) { readMOPEXData(d, binaryFile); }, repeats);
+    remove(binaryFile.c_str());
+
+    cout << "File: " << filename << " (" << MB << " MB), " << repeats << " repeats" << endl;
+    cout << "  single-pass text parser: " << tText*1e3 << " ms, " << MB/tText << " MB/s" << endl;
+    cout << "  iostream parser:         " << tOld*1e3 << " ms, " << MB/tOld << " MB/s" << endl;
+    cout << "  binary (mmap):           " << tBin*1e3 << " ms" << endl;
+    return 0;
+}
@@ -0,0 +1,230 @@
+/*
+Copyright (C) 2010-2013 Jon Herman, Josh Kollat, and others.
+
+Hymod is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Hymod is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with Hymod.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Latency and throughput of jobs (small batches of parameter sets, as handed out by a scheduler)
+// run by starting a hymod process for each job, compared with sending them to a model server
+// (hymod -P) that has loaded the forcing once. Run from the top of the repository after make,
+// since it starts ./hymod.
+
+#include <chrono>
+#include <algorithm>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include "HyMod.h"
+#include "Client.h"
+
+static double seconds_since(chrono::steady_clock::time_point start)
+{
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// One job as a new process: ./hymod -m nse forcing < job, reading the objectives from its output
+static bool run_process_job(const char *forcingFile, const double *parameters, int nSets, double *results)
+{
+    int input[2], output[2];
+    if (pipe(input) != 0 || pipe(output) != 0) return false;
+
+    pid_t child = fork();
+    if (child == 0)
+    {
+        dup2(input[0], 0);
+        dup2(output[1], 1);
+        close(input[0]); close(input[1]); close(output[0]); close(output[1]);
+        execl("./hymod", "./hymod", "-m", "nse", forcingFile, (char *) NULL);
+        _exit(127);
+    }
+    close(input[0]);
+    close(output[1]);
+
+    // The job is small enough to fit in the pipe, so it can be written before the output is read
+    stringstream job;
+    job << setprecision(17);
+    for (int s = 0; s < nSets; s++)
+        for (int i = 0; i < 8; i++) job << parameters[s*8 + i] << (i < 7 ? " " : "\n");
+    string text = job.str();
+    bool ok = write(input[1], text.data(), text.size()) == (ssize_t) text.size();
+    close(input[1]);
+
+    string reply;
+    char buffer[4096];
+    ssize_t n;
+    while ((n = read(output[0], buffer, sizeof(buffer))) > 0) reply.append(buffer, n);
+    close(output[0]);
+
+    int status;
+    waitpid(child, &status, 0);
+    stringstream values(reply);
+    for (int s = 0; s < nSets; s++) ok = ok && (values >> results[s]);
+    return ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// Run jobs [first, last) one after the other, recording the latency of each. Returns false on failure.
+static bool run_jobs(bool server, const char *forcingFile, string socketPath, const vector<double> &parameters,
+                     int setsPerJob, int first, int last, double *latency, double *results)
+{
+    hymod_client client;
+    if (server && !hymod_client_connect(&client, socketPath, 0)) return false;
+
+    for (int j = first; j < last; j++)
+    {
+        const double *job = &parameters[(size_t) j*setsPerJob*8];
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        bool ok = server ? hymod_client_evaluate(&client, job, setsPerJob, &results[(size_t) j*setsPerJob])
+                         : run_process_job(forcingFile, job, setsPerJob, &results[(size_t) j*setsPerJob]);
+        latency[j] = seconds_since(start);
+        if (!ok) return false;
+    }
+
+    if (server) hymod_client_close(&client);
+    return true;
+}
+
+// Run all jobs shared among nClients processes, returning the wall time (negative on failure)
+static double run_concurrent(bool server, const char *forcingFile, string socketPath, const vector<double> &parameters,
+                             int setsPerJob, int nJobs, int nClients)
+{
+    vector<double> latency(nJobs), results((size_t) nJobs*setsPerJob);
+    vector<pid_t> children;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+    for (int c = 0; c < nClients; c++)
+    {
+        pid_t child = fork();
+        if (child == 0)
+        {
+            bool ok = run_jobs(server, forcingFile, socketPath, parameters, setsPerJob,
+                               nJobs*c/nClients, nJobs*(c+1)/nClients, &latency[0], &results[0]);
+            _exit(ok ? 0 : 1);
+        }
+        children.push_back(child);
+    }
+
+    bool ok = true;
+    for (size_t c = 0; c < children.size(); c++)
+    {
+        int status;
+        waitpid(children[c], &status, 0);
+        ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
+    return ok ? seconds_since(start) : -1.0;
+}
+
+static void report(const char *name, vector<double> latency, double sequential, double concurrent, int nClients)
+{
+    sort(latency.begin(), latency.end());
+    double mean = 0.0;
+    for (size_t j = 0; j < latency.size(); j++) mean += latency[j]/latency.size();
+
+    cout << name << ": latency mean " << mean*1e3 << " ms, median " << latency[latency.size()/2]*1e3
+         << " ms, 95th percentile " << latency[(latency.size()*95)/100]*1e3 << " ms; "
+         << latency.size()/sequential << " jobs/s with one client, "
+         << latency.size()/concurrent << " jobs/s with " << nClients << endl;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        cerr << "Usage: bench_server forcing_data_file [jobs] [sets_per_job] [clients]" << endl;
+        return 1;
+    }
+    const char *forcingFile = argv[1];
+    int nJobs = (argc > 2) ? atoi(argv[2]) : 40;
+    int setsPerJob = (argc > 3) ? atoi(argv[3]) : 16;
+    int nClients = (argc > 4) ? atoi(argv[4]) : 4;
+    string socketPath = "/tmp/bench_server." + to_string(getpid()) + ".sock";
+
+    // A spread of parameter sets within the usual ranges
+    int nSets = nJobs*setsPerJob;
+    vector<double> parameters((size_t) nSets * 8);
+    for (int s = 0; s < nSets; s++)
+    {
+        double u = (s + 0.5) / nSets;
+        double *p = &parameters[(size_t) s * 8];
+        p[0] = 0.001 + 0.099*u;             // Ks
+        p[1] = 0.1 + 0.89*(1.0-u);          // Kq
+        p[2] = 0.05 + 1.9*u;                // DDF
+        p[3] = -3.0 + 6.0*u;                // Tb
+        p[4] = 3.0 - 6.0*u;                 // Tth
+        p[5] = 0.1 + 0.8*u;                 // alpha
+        p[6] = 2.0*u;                       // B
+        p[7] = 50.0 + 400.0*(1.0-u);        // Huz
+    }
+
+    cout << nJobs << " jobs of " << setsPerJob << " parameter sets on " << forcingFile << endl;
+
+    vector<double> processLatency(nJobs), processResults(nSets);
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    if (!run_jobs(false, forcingFile, "", parameters, setsPerJob, 0, nJobs, &processLatency[0], &processResults[0]))
+    {
+        cerr << "Could not run ./hymod (run the benchmark from the top of the repository after make)" << endl;
+        return 1;
+    }
+    double processSequential = seconds_since(start);
+    double processConcurrent = run_concurrent(false, forcingFile, "", parameters, setsPerJob, nJobs, nClients);
+
+    // Start the server and wait until it accepts sessions
+    start = chrono::steady_clock::now();
+    pid_t server = fork();
+    if (server == 0)
+    {
+        freopen("/dev/null", "w", stderr);
+        execl("./hymod", "./hymod", "-P", socketPath.c_str(), "-m", "nse", "-t", to_string(nClients).c_str(), forcingFile, (char *) NULL);
+        _exit(127);
+    }
+    hymod_client probe;
+    while (!hymod_client_connect(&probe, socketPath, 0))
+    {
+        if (seconds_since(start) > 30.0 || waitpid(server, NULL, WNOHANG) != 0)
+        {
+            cerr << "The server did not start" << endl;
+            return 1;
+        }
+        usleep(1000);
+    }
+    hymod_client_close(&probe);
+    cout << "server startup (load, shared memory, PE): " << seconds_since(start)*1e3 << " ms" << endl;
+
+    vector<double> serverLatency(nJobs), serverResults(nSets);
+    start = chrono::steady_clock::now();
+    bool ok = run_jobs(true, forcingFile, socketPath, parameters, setsPerJob, 0, nJobs, &serverLatency[0], &serverResults[0]);
+    double serverSequential = seconds_since(start);
+    double serverConcurrent = run_concurrent(true, forcingFile, socketPath, parameters, setsPerJob, nJobs, nClients);
+
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+    if (!ok || serverConcurrent < 0.0 || processConcurrent < 0.0)
+    {
+        cerr << "A job failed" << endl;
+        return 1;
+    }
+
+    // The processes print 6 significant digits, the server returns the doubles
+    for (int s = 0; s < nSets; s++)
+    {
+        if (fabs(serverResults[s] - processResults[s]) > 1e-5*max(1.0, fabs(serverResults[s])))
+        {
+            cerr << "Set " << s << ": the server gave " << serverResults[s] << ", the process " << processResults[s] << endl;
+            return 1;
+        }
+    }
+
+    report("process per job", processLatency, processSequential, processConcurrent, nClients);
+    report("server         ", serverLatency, serverSequential, serverConcurrent, nClients);
+    return 0;
+}
@@ -0,0 +1,165 @@
+/*
+Copyright (C) 2010-2013 Jon Herman, Josh Kollat, and others.
+
+Hymod is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Hymod is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with Hymod.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Regression check of the simulated streamflow against a golden series saved from an
+// earlier version of the model. Optimisations must reproduce the hydrology to within
+// the tolerance below; rerun with -w to save a new golden file when a change is intended.
+
+#include "HyMod.h"
+#include "HyModBatch.h"
+
+#include <limits>
+
+// Time period used by main: 10/1/1961 to 9/29/1972
+const int nDays = 4017;
+const int startingIndex = 5023-1;
+
+// Parameter sets (Ks, Kq, DDF, Tb, Tth, alpha, B, Huz) covering snow-dominated, flashy and slow
+// basins, and the exponents with exact shortcuts in the soil moisture kernels (B = 1 and B = 0)
+const int nSets = 6;
+double golden_parameters[nSets][8] = {
+    {0.05,  0.5, 0.3,  0.0,  0.0, 0.5, 0.5, 150.0},
+    {0.01,  0.8, 1.5,  2.0, -1.0, 0.9, 1.5, 400.0},
+    {0.2,   0.3, 0.1, -2.0,  3.0, 0.2, 0.1,  20.0},
+    {0.001, 0.99, 0.8, 1.0,  1.0, 0.7, 2.0, 500.0},
+    {0.02,  0.6, 0.5,  0.5,  0.5, 0.6, 1.0, 250.0},
+    {0.03,  0.4, 0.2, -1.0,  1.0, 0.8, 0.0,  80.0}
+};
+
+const char *kernel_names[] = {"pow", "fast", "approx"};
+
+// |Q - Qgolden| <= relTolerance*|Qgolden| + absTolerance
+const double relTolerance = 1e-9;
+const double absTolerance = 1e-12;
+
+// Compare a simulated series with the golden one, reporting the first mismatch
+static bool check_series(string name, int set, const double *Q, const vector<double> &golden)
+{
+    for (int day = 0; day < nDays; day++)
+    {
+        double expected = golden[(size_t) day * nSets + set];
+        if (!(fabs(Q[day] - expected) <= relTolerance*fabs(expected) + absTolerance))
+        {
+            cout << "FAILED: " << name << ", parameter set " << set << ", day " << day << ": Q = "
+                 << setprecision(17) << Q[day] << ", expected " << expected << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    bool write = (argc > 1 && string(argv[1]) == "-w");
+    if (argc < 3 + write)
+    {
+        cerr << "Usage: check_golden [-w] forcing_data_file golden_file" << endl;
+        return 1;
+    }
+    string dataFile = argv[1 + write];
+    string goldenFile = argv[2 + write];
+
+    hymod_forcing forcing;
+    init_hymod_forcing(&forcing, dataFile, startingIndex, nDays);
+    HyMod model;
+    init_hymod(&model, &forcing);
+
+    // One row per day, one column per parameter set
+    vector<double> Q((size_t) nSets * nDays);
+    for (int s = 0; s < nSets; s++)
+    {
+        calc_hymod(&model, golden_parameters[s]);
+        for (int day = 0; day < nDays; day++) Q[(size_t) day * nSets + s] = model.fluxes.Q[day];
+    }
+
+    if (write)
+    {
+        ofstream out(goldenFile.c_str());
+        out << setprecision(17);
+        for (int day = 0; day < nDays; day++)
+            for (int s = 0; s < nSets; s++) out << Q[(size_t) day * nSets + s] << ((s < nSets-1) ? " " : "\n");
+        cout << "Saved the streamflow of " << nSets << " parameter sets to " << goldenFile << endl;
+        return 0;
+    }
+
+    ifstream in(goldenFile.c_str());
+    vector<double> golden((size_t) nSets * nDays);
+    for (size_t i = 0; i < golden.size(); i++) in >> golden[i];
+    if (!in)
+    {
+        cout << "The golden file specified: " << goldenFile << " could not be read!" << endl;
+        return 1;
+    }
+
+    // Every way of running the model, with each soil moisture kernel, has to reproduce the golden series
+    bool ok = true;
+    vector<double> series((size_t) nDays);
+    double *batchQ[HYMOD_LANES];
+    double *batchSets[HYMOD_LANES];
+    vector<double> batchSeries((size_t) nSets * nDays);
+
+    for (int kernel = PDM_POW; kernel <= PDM_APPROX; kernel++)
+    {
+        string suffix = string(" (") + kernel_names[kernel] + ")";
+        model.parameters.pdmKernel = kernel;
+
+        for (int s = 0; s < nSets; s++)
+        {
+            calc_hymod(&model, golden_parameters[s]);
+            ok = ok && check_series("calc_hymod" + suffix, s, model.fluxes.Q, golden);
+
+            auto save = [&](int modelDay, double Qday) { series[modelDay] = Qday; };
+            calc_hymod_lean(&model, golden_parameters[s], save);
+            ok = ok && check_series("calc_hymod_lean" + suffix, s, &series[0], golden);
+        }
+
+        for (int first = 0; first < nSets; first += HYMOD_LANES)
+        {
+            int n = min(HYMOD_LANES, nSets - first);
+            for (int l = 0; l < n; l++)
+            {
+                batchSets[l] = golden_parameters[first + l];
+                batchQ[l] = &batchSeries[(size_t) (first + l) * nDays];
+            }
+            calc_hymod_batch(&model, batchSets, n, batchQ);
+            for (int l = 0; l < n; l++) ok = ok && check_series("calc_hymod_batch" + suffix, first + l, batchQ[l], golden);
+        }
+    }
+
+    // fast_pow has to stay within its documented error bound, (|e*log(x)| + 4) ulp
+    double worst = 0.0;
+    for (int i = 1; i <= 100000; i++)
+    {
+        double x = pow(double(i)/100000, 1.0 + (i % 17));
+        double e = (i % 2) ? 1.0 + 2.0*(i % 101)/100.0 : 1.0/(1.0 + 2.0*(i % 101)/100.0);
+        double exact = pow(x, e);
+        if (exact < 1e-300) continue;
+        double bound = (fabs(e*log(x)) + 4.0)*numeric_limits<double>::epsilon();
+        worst = max(worst, fabs(fast_pow(x, e) - exact)/exact/bound);
+    }
+    if (worst > 1.0)
+    {
+        cout << "FAILED: fast_pow exceeds its error bound by a factor of " << worst << endl;
+        ok = false;
+    }
+
+    hymod_delete(&model);
+    delete_hymod_forcing(&forcing);
+
+    if (ok) cout << "Streamflow matches " << goldenFile << " (" << nSets << " parameter sets, " << nDays << " days)" << endl;
+    return ok ? 0 : 1;
+}
@@ -15,117 +15,548 @@ You should have received a copy of the GNU Lesser General Public License
 along with Hymod.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <poll.h>
+#include <unistd.h>
+#include <vector>
+
 #include "HyMod.h"
+#include "HyModBatch.h"
+#include "ThreadPool.h"
+#include "Objectives.h"
+#include "MultiBasin.h"
+#include "Checkpoint.h"
+#include "Protocol.h"
+#include "Streaming.h"
+#include "Ensemble.h"
+#include "Sensitivity.h"
+#include "Calibration.h"
+#include "ResultCache.h"
+#include "Gradient.h"
+#include "Server.h"
+#include "MultiPeriod.h"
 
-struct HyMod hymod;
+// Number of parameter sets read from stdin before they are handed to the worker threads
+const int chunkSize = 4096;
 
-// Time period: 10/1/1961 to 9/30/1972 (1 year of warmup plus 10-year period)
-int dayStartIndex = 274; //10-1 is day 274 of the year
-int nDays = 4017; // length of simulation, including leap years
-int startingIndex = 5023-1; //The starting index of the data file corresponding with the start date
+// Whether more of stdin can be read without waiting for the writer. A chunk ends early when it
+// cannot, so an optimiser sending one row at a time gets each result before writing the next.
+bool input_waiting()
+{
+    if (cin.rdbuf()->in_avail() > 0) return true;
+    pollfd input = {STDIN_FILENO, POLLIN, 0};
+    return poll(&input, 1, 0) > 0;
+}
 
-void init_hymod(string dataFile)
+void usage()
 {
-    hymod.data.nDays = nDays;
-    hymod.parameters.Nq = 3; // number of quickflow reservoirs
-    hymod.parameters.Kv = 1.0; // vegetation parameter
-    hymod_allocate(nDays);
-    readMOPEXData(&hymod.data, dataFile);
-
-    //Calculate the Hamon Potential Evaporation for the time series
-    calculateHamonPE(startingIndex, nDays, dayStartIndex);
-    return;
+    cerr << "Usage: hymod [-t threads] [-m objectives] [-w warmup_days] [-q Nq] [-k pow|fast|approx] forcing_data_file < parameter_samples" << endl;
+    cerr << "       hymod -b [options] forcing_data_file   (framed binary parameter/result records on stdin/stdout)" << endl;
+    cerr << "       hymod [-r resume_checkpoint] [-s save_checkpoint] [options] forcing_data_file < parameter_samples" << endl;
+    cerr << "       hymod -K cache_entries[,digits] [-F cache_file] [options] forcing_data_file < parameter_samples" << endl;
+    cerr << "         (reuse the results of parameter sets seen before, rounded to 10 significant digits by default)" << endl;
+    cerr << "       hymod -M basin_manifest [-D start,end] [-o output_file] [-t threads] [-m objectives] [-w warmup_days] [-q Nq] < parameter_samples" << endl;
+    cerr << "       hymod -S [-D start,end] [-t threads] [-q Nq] [-k pow|fast|approx] forcing_data_file < parameter_samples" << endl;
+    cerr << "         (stream the forcing in chunks and write the streamflow of every sample at each time step)" << endl;
+    cerr << "       hymod -E member_manifest [-Q quantiles] [-D start,end] [-o output_file] [-t threads] [-q Nq] [-k pow|fast|approx] < parameter_samples" << endl;
+    cerr << "         (run each sample over every ensemble member and write daily quantiles of the streamflow, default 0.05,0.5,0.95)" << endl;
+    cerr << "       hymod -A base_samples [-W window_days,step_days] [-R range_file] [-m objectives] [-w warmup_days] [-D start,end] [-o output_file] [-t threads] [-q Nq] [-k pow|fast|approx] forcing_data_file" << endl;
+    cerr << "         (Sobol sensitivity indices of the objectives, default rmse, over the whole period and each moving window)" << endl;
+    cerr << "       hymod -O max_evaluations[,complexes[,seed]] [-R range_file] [-m objective] [-w warmup_days] [-D start,end] [-o output_file] [-t threads] [-q Nq] [-k pow|fast|approx] forcing_data_file" << endl;
+    cerr << "         (calibrate the parameters with SCE-UA, default objective nse, 4 complexes and seed 1)" << endl;
+    cerr << "       hymod -G [-m objectives] [-w warmup_days] [-D start,end] [-o output_file] [-t threads] [-q Nq] [-k pow|fast|approx] forcing_data_file < parameter_samples" << endl;
+    cerr << "         (the objectives, default nse, and their derivatives with respect to each parameter)" << endl;
+    cerr << "       hymod -P socket_path [-m objectives] [-w warmup_days] [-D start,end] [-t threads] [-q Nq] [-k pow|fast|approx] forcing_data_file..." << endl;
+    cerr << "         (serve evaluations of the basins to clients on a Unix socket, see Client.h)" << endl;
+    cerr << "       hymod -W window_days,step_days | -B period_file [-s snapshot_prefix] [-m objectives] [-w warmup_days] [-D start,end] [-o output_file] [-t threads] [-q Nq] [-k pow|fast|approx] forcing_data_file < parameter_samples" << endl;
+    cerr << "         (the objectives, default nse, over each moving window or listed period, from a single run of each sample)" << endl;
+    cerr << "       hymod -C binary_file forcing_data_file   (convert forcing data to the binary format)" << endl;
+    cerr << "  start,end: simulation period as YYYY-MM-DD,YYYY-MM-DD (default 1961-10-01,1972-09-29)" << endl;
+    cerr << "  objectives: comma-separated list of " << metric_names[0];
+    for (int m=1; m < N_METRICS; m++) cerr << ", " << metric_names[m];
+    cerr << endl;
+    exit(1);
 }
 
-//This is the function that gets called to evaluate each parameter set
-void calc_hymod(double* parameters)
+// Parse a simulation period given as YYYY-MM-DD,YYYY-MM-DD
+void parse_period(const char *arg, int *startDate, int *endDate)
 {
-    // assign parameter values for this run
-    // Rate constants Ks and Kq should be specified in units of time-1, 0 < Ks < Kq < 1
-    hymod.parameters.Ks    = parameters[0];
-    hymod.parameters.Kq    = parameters[1];
-    hymod.parameters.DDF   = parameters[2];
-    hymod.parameters.Tb    = parameters[3];
-    hymod.parameters.Tth   = parameters[4];
-    hymod.parameters.alpha = parameters[5];
-    hymod.parameters.B     = parameters[6];
-    hymod.parameters.Huz   = parameters[7];
-    hymod.parameters.Cpar = hymod.parameters.Huz / (1.0 + hymod.parameters.B); // max capacity of soil moisture tank
-
-    // Reinitialize everything to zero
-    zero_states_and_fluxes(nDays);
-
-    //Run Model for Simulation Period
-    int dataDay;
-    for (int modelDay = 0; modelDay < nDays; modelDay++)
-    {
-        //Since used as an index, we need to convert to zero indexing
-        dataDay = startingIndex + modelDay;
+    if (sscanf(arg, "%d-%d-%d,%d-%d-%d", &startDate[0], &startDate[1], &startDate[2],
+               &endDate[0], &endDate[1], &endDate[2]) != 6) usage();
+}
 
-        // Run snow model to find effective precip for this timestep
-        hymod.fluxes.effPrecip[modelDay] = snowDD(modelDay, dataDay);
+// Read all of the parameter sets from stdin, nParams values each
+vector<double> read_parameter_sets(int nParams)
+{
+    vector<double> parameters;
+    double value;
+    while (cin >> value) parameters.push_back(value);
 
-        // Run Pdm soil moisture accounting including evapotranspiration
-        PDM_soil_moisture(modelDay, dataDay);
+    if (!cin.eof()) {
+        cout << "Parameter value " << parameters.size() + 1 << " could not be read from the input" << endl;
+        exit(1);
+    }
+    if (parameters.size() % nParams != 0) {
+        cout << "The last parameter set has " << parameters.size() % nParams << " of " << nParams << " values" << endl;
+        exit(1);
+    }
+    return parameters;
+}
 
-        // Run Nash Cascade routing of quickflow component
-        double new_quickflow = hymod.parameters.alpha * hymod.fluxes.OV[modelDay];
-        hymod.fluxes.Qq[modelDay] = Nash(hymod.parameters.Kq, hymod.parameters.Nq, new_quickflow, hymod.states.Xq[modelDay]);
+// The stream for the results: the file given with -o, or stdout. The file stays open until the program exits.
+ostream &open_output(const string &outputFile)
+{
+    static ofstream out;
+    if (outputFile == "") return cout;
 
-        // Run Nash Cascade routing of slowflow component
-        double new_slowflow = (1.0-hymod.parameters.alpha) * hymod.fluxes.OV[modelDay];
-        hymod.fluxes.Qs[modelDay] = Nash(hymod.parameters.Ks, 1, new_slowflow, &hymod.states.Xs[modelDay]);
+    out.open(outputFile.c_str());
+    if (!out) {
+        cout << "The output file specified: " << outputFile << " could not be opened!" << endl;
+        exit(1);
+    }
+    return out;
+}
 
-        // Set the intial states of the next time step to those of the current time step
-        if (modelDay < nDays-1)
+int main(int argc, char **argv)
+{    
+    int nParams = 8;
+    int nThreads = 1;
+    string metricList = "";
+    int warmup = 365; // 1 year of warmup before the objectives are computed
+    string binaryFile = "";
+    int Nq = 3; // number of quickflow reservoirs
+    int pdmKernel = PDM_POW;
+    string manifestFile = "";
+    string outputFile = "";
+    // Default period: 10/1/1961 to 9/29/1972 (1 year of warmup plus 10-year period), found in each file by date
+    int startDate[3] = {1961, 10, 1};
+    int endDate[3] = {1972, 9, 29};
+    bool periodGiven = false;
+    string resumeFile = "";
+    string saveFile = "";
+    bool binaryIO = false;
+    bool streaming = false;
+    string ensembleFile = "";
+    string quantileList = "0.05,0.5,0.95";
+    int nBaseSamples = 0;
+    int window = 0, windowStep = 0;
+    string rangeFile = "";
+    long maxEvaluations = 0;
+    bool calibrate = false;
+    int nComplexes = 4;
+    unsigned long seed = 1;
+    long cacheEntries = 0;
+    int cacheDigits = 10;
+    string cacheFile = "";
+    bool gradients = false;
+    string socketPath = "";
+    string periodFile = "";
+    int opt;
+
+    HYMOD_INSTRUMENT_INIT();
+
+    while ((opt = getopt(argc, argv, "t:m:w:q:k:C:M:D:o:r:s:bSE:Q:A:W:R:O:K:F:GP:B:")) != -1)
+    {
+        switch (opt)
         {
-            hymod.states.XHuz[modelDay+1] = hymod.states.XHuz[modelDay];
-            hymod.states.Xs[modelDay+1]   = hymod.states.Xs[modelDay];
-            hymod.states.snow_store[modelDay+1] = hymod.states.snow_store[modelDay];
+            case 't': nThreads = atoi(optarg); break;
+            case 'm': metricList = optarg; break;
+            case 'w': warmup = atoi(optarg); break;
+            case 'q': Nq = atoi(optarg); break;
+            case 'k': pdmKernel = find_pdm_kernel(optarg); break;
+            case 'C': binaryFile = optarg; break;
+            case 'M': manifestFile = optarg; break;
+            case 'D': parse_period(optarg, startDate, endDate); periodGiven = true; break;
+            case 'o': outputFile = optarg; break;
+            case 'r': resumeFile = optarg; break;
+            case 's': saveFile = optarg; break;
+            case 'b': binaryIO = true; break;
+            case 'S': streaming = true; break;
+            case 'E': ensembleFile = optarg; break;
+            case 'Q': quantileList = optarg; break;
+            case 'A': nBaseSamples = atoi(optarg); break;
+            case 'W': if (sscanf(optarg, "%d,%d", &window, &windowStep) != 2) usage(); break;
+            case 'R': rangeFile = optarg; break;
+            case 'K': if (sscanf(optarg, "%ld,%d", &cacheEntries, &cacheDigits) < 1) usage(); break;
+            case 'F': cacheFile = optarg; break;
+            case 'G': gradients = true; break;
+            case 'P': socketPath = optarg; break;
+            case 'B': periodFile = optarg; break;
+            case 'O': if (sscanf(optarg, "%ld,%d,%lu", &maxEvaluations, &nComplexes, &seed) < 1) usage(); calibrate = true; break;
+            default: usage();
+        }
+    }
+
+    // Evaluate every parameter set on each basin of the manifest, writing a single table
+    if (manifestFile != "") {
+        multi_basin_config config;
+        memcpy(config.startDate, startDate, sizeof(startDate));
+        memcpy(config.endDate, endDate, sizeof(endDate));
+        config.metricList = (metricList != "") ? metricList : "nse";
+        config.warmup = warmup;
+        config.Nq = Nq;
+        config.pdmKernel = pdmKernel;
+        config.nThreads = nThreads;
+
+        vector<string> basinFiles = read_basin_manifest(manifestFile);
+        vector<double> parameters = read_parameter_sets(nParams);
+
+        run_multi_basin(config, basinFiles, parameters, open_output(outputFile));
+        return 0;
+    }
+
+    // Run each parameter set over all members of an ensemble forcing, writing quantiles of the members' streamflow
+    if (ensembleFile != "") {
+        ensemble_config config;
+        config.quantiles = parse_quantiles(quantileList);
+        config.nThreads = nThreads;
+
+        hymod_forcing forcing;
+        init_hymod_forcing_ensemble(&forcing, read_basin_manifest(ensembleFile), startDate, endDate);
+        HyMod model;
+        init_hymod(&model, &forcing, false, Nq, pdmKernel);
+
+        vector<double> parameters = read_parameter_sets(nParams);
+
+        run_ensemble(config, &model, parameters, open_output(outputFile));
+
+        hymod_delete(&model);
+        delete_hymod_forcing(&forcing);
+        return 0;
+    }
+
+    if (optind >= argc) usage();
+
+    // Keep the basins loaded and evaluate parameter sets sent by other processes until stopped
+    if (socketPath != "") {
+        server_config config;
+        config.socketPath = socketPath;
+        config.metricList = (metricList != "") ? metricList : "nse";
+        config.warmup = warmup;
+        memcpy(config.startDate, startDate, sizeof(startDate));
+        memcpy(config.endDate, endDate, sizeof(endDate));
+        config.Nq = Nq;
+        config.pdmKernel = pdmKernel;
+        config.nThreads = nThreads;
+
+        run_server(config, vector<string>(argv + optind, argv + argc));
+        return 0;
+    }
+
+    // Run all of the parameter sets together over the forcing, a chunk of time steps at a time
+    if (streaming) {
+        streaming_config config;
+        config.Nq = Nq;
+        config.pdmKernel = pdmKernel;
+        config.nThreads = nThreads;
+        config.periodGiven = periodGiven;
+        memcpy(config.startDate, startDate, sizeof(startDate));
+        memcpy(config.endDate, endDate, sizeof(endDate));
 
-            for(int m = 0; m < hymod.parameters.Nq; m++)
-                hymod.states.Xq[modelDay+1][m] = hymod.states.Xq[modelDay][m];
+        vector<double> parameters = read_parameter_sets(nParams);
+
+        run_streaming(config, argv[optind], parameters, cout);
+        return 0;
+    }
+
+    // Search for the best parameter set with the model run in-process
+    if (calibrate) {
+        if (maxEvaluations <= 0 || nComplexes <= 0) {
+            cout << "The evaluation budget and number of complexes of -O must be positive" << endl;
+            exit(1);
         }
+        calibration_config config;
+        config.metric = (metricList != "") ? metricList : "nse";
+        config.warmup = warmup;
+        config.maxEvaluations = maxEvaluations;
+        config.nComplexes = nComplexes;
+        config.seed = seed;
+        config.nThreads = nThreads;
+        read_parameter_ranges(rangeFile, config.ranges);
 
-        hymod.fluxes.Q[modelDay] = hymod.fluxes.Qq[modelDay] + hymod.fluxes.Qs[modelDay];
+        hymod_forcing forcing;
+        init_hymod_forcing_dates(&forcing, argv[optind], startDate, endDate);
+        HyMod model;
+        init_hymod(&model, &forcing, false, Nq, pdmKernel);
+
+        run_sce_calibration(config, &model, open_output(outputFile));
+
+        hymod_delete(&model);
+        delete_hymod_forcing(&forcing);
+        return 0;
     }
 
-    return;
-}
+    // Differentiate the objectives of each parameter set, in the same pass as the model run
+    if (gradients) {
+        gradient_config config;
+        config.metricList = (metricList != "") ? metricList : "nse";
+        config.warmup = warmup;
+        config.nThreads = nThreads;
 
-int main(int argc, char **argv)
-{    
-    int nParams = 8;
-    double* parameters = new double [nParams]; 
-    double sumQobs, sumQsim, sumPrecip;
+        hymod_forcing forcing;
+        init_hymod_forcing_dates(&forcing, argv[optind], startDate, endDate);
+        HyMod model;
+        init_hymod(&model, &forcing, false, Nq, pdmKernel);
 
-    // initialize -- the argument is the path to the data file
-    init_hymod(argv[1]);
+        vector<double> parameters = read_parameter_sets(nParams);
 
-    while(!cin.eof())
+        run_gradients(config, &model, parameters, open_output(outputFile));
+
+        hymod_delete(&model);
+        delete_hymod_forcing(&forcing);
+        return 0;
+    }
+
+    // Generate and evaluate the samples of a Sobol sensitivity analysis, keeping only the running sums of the indices
+    if (nBaseSamples > 0) {
+        sensitivity_config config;
+        config.nBase = nBaseSamples;
+        config.metricList = (metricList != "") ? metricList : "rmse";
+        config.warmup = warmup;
+        config.window = window;
+        config.windowStep = windowStep;
+        config.nThreads = nThreads;
+        read_parameter_ranges(rangeFile, config.ranges);
+
+        hymod_forcing forcing;
+        init_hymod_forcing_dates(&forcing, argv[optind], startDate, endDate);
+        HyMod model;
+        init_hymod(&model, &forcing, false, Nq, pdmKernel);
+
+        run_sobol_analysis(config, &model, open_output(outputFile));
+
+        hymod_delete(&model);
+        delete_hymod_forcing(&forcing);
+        return 0;
+    }
+
+    // Objectives over many windows or periods of the simulation, from one run of each parameter set
+    if (window > 0 || periodFile != "") {
+        multi_period_config config;
+        config.metricList = (metricList != "") ? metricList : "nse";
+        config.warmup = warmup;
+        config.window = window;
+        config.windowStep = windowStep;
+        config.periodFile = periodFile;
+        config.snapshotPrefix = saveFile;
+        config.nThreads = nThreads;
+
+        hymod_forcing forcing;
+        init_hymod_forcing_dates(&forcing, argv[optind], startDate, endDate);
+        HyMod model;
+        init_hymod(&model, &forcing, false, Nq, pdmKernel);
+
+        vector<double> parameters = read_parameter_sets(nParams);
+
+        run_multi_period(config, &model, parameters, open_output(outputFile));
+
+        hymod_delete(&model);
+        delete_hymod_forcing(&forcing);
+        return 0;
+    }
+
+    // Convert the forcing data to a binary file that later runs can map directly, instead of parsing text
+    if (binaryFile != "") {
+        MOPEXData data;
+        readMOPEXData(&data, argv[optind]);
+        writeMOPEXBinary(&data, binaryFile);
+        freeMOPEXData(&data);
+        return 0;
+    }
+
+    // initialize -- the argument is the path to the data file. The forcing is shared by all threads.
+    hymod_forcing forcing;
+    hymod_checkpoint checkpoint;
+    if (resumeFile != "") {
+        // Continue from the states saved by an earlier run: only the days after the checkpoint are
+        // simulated (to the end of the data, or of the -D period), and the states are already warm
+        read_hymod_checkpoint(&checkpoint, resumeFile);
+        init_hymod_forcing_resume(&forcing, argv[optind], &checkpoint, periodGiven ? endDate : NULL);
+        Nq = checkpoint.Nq;
+        warmup = 0;
+    }
+    else
+        init_hymod_forcing_dates(&forcing, argv[optind], startDate, endDate);
+
+    HyMod model;
+    init_hymod(&model, &forcing, false, Nq, pdmKernel);
+
+    // Without a list of objectives, check observed and simulated water balance over the whole period
+    double sumQobs = 0, sumPrecip = 0;
+    for (int i=0; i<forcing.nDays; i++) {
+        sumQobs += forcing.data.flow[forcing.startingIndex + i];
+        sumPrecip += forcing.data.precip[forcing.startingIndex + i];
+    }
+
+    objective_config objectives;
+    init_objectives(&objectives, &forcing, metricList, warmup);
+    int nObjectives = objectives.metrics.size();
+
+    ThreadPool pool(nThreads);
+
+    vector<double> parameters((size_t) chunkSize * nParams);
+    vector<double> sumQsim(chunkSize);
+    vector<double> results((size_t) chunkSize * nObjectives);
+
+    // Final states of every parameter set, kept when resuming from or saving a checkpoint
+    bool carryStates = (resumeFile != "" || saveFile != "");
+    vector<hymod_state> states;
+    vector<double> allParameters;
+    long nDone = 0;
+
+    // Results of the parameter sets already evaluated, for this forcing window and these settings.
+    // A checkpointed run depends on the states as well as the parameters, so it is never cached.
+    bool useCache = (cacheEntries > 0);
+    if (useCache && carryStates) {
+        cout << "The result cache cannot be used when resuming from or saving a checkpoint" << endl;
+        exit(1);
+    }
+    result_cache cache;
+    if (useCache) init_result_cache(&cache, cacheEntries, cacheDigits, result_cache_context(&model, metricList, warmup), cacheFile);
+
+    // Each result is the objectives of a set, or its simulated streamflow total without -m
+    int nValues = max(nObjectives, 1);
+    auto setValues = [&](int s) { return (nObjectives > 0) ? &results[(size_t) s * nObjectives] : &sumQsim[s]; };
+    vector<int> pending;
+    vector<double> scratch((size_t) pool.size() * HYMOD_LANES * nValues);
+    vector<result_cache_key> keys(chunkSize);
+    vector< pair<int, int> > repeats;
+    unordered_map<result_cache_key, int, result_cache_hash> chunkSets;
+
+    // In binary mode each result record holds the objectives, or the simulated streamflow total without -m
+    binary_protocol protocol;
+    if (binaryIO) init_binary_protocol(&protocol, stdin, stdout, nParams, max(nObjectives, 1));
+
+    while (true)
     {
-        // Read model parameters from stdin
-        for (int i=0; i < nParams; i++) {
-			cin >> parameters[i];	
+        // Read the next chunk of parameter sets from stdin, up to the rows already written to it
+        int nSets = 0;
+        if (binaryIO) nSets = read_binary_parameters(&protocol, &parameters[0], chunkSize);
+        else while (nSets < chunkSize) {
+            double *p = &parameters[(size_t) nSets * nParams];
+            for (int i=0; i < nParams; i++) {
+                cin >> p[i];
+            }
+            if (cin.fail()) break;
+            nSets++;
+            if (!input_waiting()) break;
+        }
+        if (nSets == 0) break;
+
+        if (carryStates) {
+            if (resumeFile != "") {
+                // The parameter sets must be the ones the checkpoint was saved for, in the same order
+                if (nDone + nSets > (long) checkpoint.states.size() ||
+                    !equal(&parameters[0], &parameters[(size_t) nSets * nParams], &checkpoint.parameters[(size_t) nDone * nParams])) {
+                    cout << "The parameter sets do not match the " << checkpoint.states.size() << " sets saved in " << resumeFile << endl;
+                    exit(1);
+                }
+                states.insert(states.end(), &checkpoint.states[nDone], &checkpoint.states[nDone] + nSets);
+            }
+            else
+                states.resize(nDone + nSets);
+            allParameters.insert(allParameters.end(), &parameters[0], &parameters[(size_t) nSets * nParams]);
+        }
+        hymod_state *chunkStates = carryStates ? &states[nDone] : NULL;
+
+        // Only the sets that are neither in the cache nor repeats of an earlier set of the chunk are run
+        pending.clear();
+        repeats.clear();
+        chunkSets.clear();
+        for (int s=0; s < nSets; s++) {
+            if (useCache) {
+                keys[s] = result_cache_make_key(&cache, &parameters[(size_t) s * nParams]);
+                auto earlier = chunkSets.find(keys[s]);
+                if (earlier != chunkSets.end()) {
+                    repeats.push_back(make_pair(s, earlier->second));
+                    cache.hits++;
+                    continue;
+                }
+                if (result_cache_lookup(&cache, keys[s], setValues(s), nValues)) continue;
+                chunkSets[keys[s]] = s;
+            }
+            pending.push_back(s);
+        }
+        int nPending = pending.size();
+
+        // Run the model for each batch of HYMOD_LANES parameter sets on the worker threads
+        int nBatches = (nPending + HYMOD_LANES - 1) / HYMOD_LANES;
+        pool.run(nBatches, [&](int batch, int worker) {
+            double *sets[HYMOD_LANES];
+            double sum[HYMOD_LANES] = {0};
+            double *values = &scratch[(size_t) worker * HYMOD_LANES * nValues];
+            int first = batch * HYMOD_LANES;
+            int n = min(HYMOD_LANES, nPending - first);
+
+            // Without the cache the pending sets are all of them in order, which is the only case with states
+            hymod_state *batchStates = (chunkStates != NULL) ? &chunkStates[first] : NULL;
+
+            for (int s=0; s < n; s++) sets[s] = &parameters[(size_t) pending[first + s] * nParams];
+
+            if (nObjectives > 0) {
+                evaluate_objectives(&model, objectives, sets, n, values, batchStates);
+                for (int s=0; s < n; s++)
+                    copy(&values[s * nObjectives], &values[(s+1) * nObjectives], setValues(pending[first + s]));
+                return;
+            }
+
+            // Only the running sum of simulated streamflow is kept, no daily series are stored
+            auto accumulate = [&](int, const double *Q) {
+                for (int s=0; s < HYMOD_LANES; s++) sum[s] += Q[s];
+            };
+            calc_hymod_batch_lean(&model, sets, n, accumulate, batchStates);
+
+            for (int s=0; s < n; s++) sumQsim[pending[first + s]] = sum[s];
+        });
+
+        if (useCache) {
+            for (int i=0; i < nPending; i++)
+                result_cache_insert(&cache, keys[pending[i]], setValues(pending[i]), nValues);
+            for (size_t i=0; i < repeats.size(); i++)
+                copy(setValues(repeats[i].second), setValues(repeats[i].second) + nValues, setValues(repeats[i].first));
         }
-		
-        // Run model with this set of parameters
-        calc_hymod(parameters);
-
-        // Check observed and simulated water balance, and print results to stdout (replace with desired objectives)
-        sumQobs = 0; sumQsim = 0; sumPrecip = 0;
-        for (int i=0; i<nDays; i++) {
-            sumQsim += hymod.fluxes.Q[i];
-            sumQobs += hymod.data.flow[i];
-            sumPrecip += hymod.data.precip[i];
+
+        // Results are written in input order, the output is flushed once per chunk (or binary frame)
+        HYMOD_STAGE_BEGIN(STAGE_OUTPUT);
+        if (binaryIO)
+            write_binary_results(&protocol, (nObjectives > 0) ? &results[0] : &sumQsim[0], nSets);
+        else {
+            for (int s=0; s < nSets; s++) {
+                if (nObjectives > 0) {
+                    for (int i=0; i < nObjectives; i++)
+                        cout << (i > 0 ? " " : "") << results[(size_t) s * nObjectives + i];
+                    cout << '\n';
+                }
+                else
+                    cout << "Observed: " << sumQobs << ", Simulated: " << sumQsim[s] << ", Precip: " << sumPrecip << '\n';
+            }
+            cout.flush();
         }
+        HYMOD_STAGE_END(STAGE_OUTPUT);
+        HYMOD_INSTRUMENT_POLL();
+
+        nDone += nSets;
+
+        // The text input has ended (or a row could not be read); binary frames can be any size
+        if (!binaryIO && cin.fail()) break;
+    }
+
+    // Save the final states, dated with the last day simulated
+    if (saveFile != "") {
+        if (forcing.nDays > 0)
+            memcpy(checkpoint.date, forcing.data.date[forcing.startingIndex + forcing.nDays - 1], sizeof(checkpoint.date));
+        checkpoint.Nq = Nq;
+        checkpoint.parameters.swap(allParameters);
+        checkpoint.states.swap(states);
+        write_hymod_checkpoint(&checkpoint, saveFile);
+    }
 
-        if(!cin.eof())
-            cout << "Observed: " << sumQobs << ", Simulated: " << sumQsim << ", Precip: " << sumPrecip << endl;
+    if (useCache) {
+        save_result_cache(&cache);
+        report_result_cache(&cache);
     }
 
-    hymod_delete(nDays);
-    delete[] parameters;
+    hymod_delete(&model);
+    delete_hymod_forcing(&forcing);
 
     return 0;
 }
\ No newline at end of file